@@ -3,3 +3,4 @@
 rmdir /s /q _build
 rmdir /s /q _bin
 rmdir /s /q _obj
+rmdir /s /q _pgo
@@ -0,0 +1,89 @@
+-- Nerd keyword table generator
+--
+-- Writes src/keywords.h, the perfect hash table the lexer uses to recognise keywords.  The lexer already works out the
+-- FNV-1a hash of every name it reads so that it can intern symbols, so this picks the smallest table and a shift that
+-- give every keyword its own slot at (hash >> shift) & mask.  A name is then a keyword only if it matches the single
+-- entry in its slot.
+--
+-- This runs whenever premake generates the project files.  To add a keyword, add it here and to NeToken in nerd.c.
+
+local keywords = {
+	{ "nil", "NeToken_Nil" },
+	{ "yes", "NeToken_Yes" },
+	{ "no",  "NeToken_No" },
+}
+
+-- Must match hash() in nerd.c.
+local function fnv1a(s)
+	local h = 0xcbf29ce484222325
+	for i = 1, #s do
+		h = h ~ s:byte(i)
+		h = h * 0x100000001b3
+	end
+	return h
+end
+
+local function findPerfectHash()
+	local bits = 0
+	while (1 << bits) < #keywords do
+		bits = bits + 1
+	end
+
+	while true do
+		local mask = (1 << bits) - 1
+		for shift = 0, 64 - bits do
+			local used = {}
+			local ok = true
+			for _, k in ipairs(keywords) do
+				local index = (fnv1a(k[1]) >> shift) & mask
+				if used[index] then
+					ok = false
+					break
+				end
+				used[index] = true
+			end
+			if ok then
+				return bits, shift
+			end
+		end
+		bits = bits + 1
+	end
+end
+
+function generateKeywords(outputPath)
+	local bits, shift = findPerfectHash()
+	local mask = (1 << bits) - 1
+	local slots = {}
+	for _, k in ipairs(keywords) do
+		slots[(fnv1a(k[1]) >> shift) & mask] = k
+	end
+
+	local lines = {
+		"//----------------------------------------------------------------------------------------------------------------------",
+		"// Keyword table for the lexer",
+		"// Generated by make/keywords.lua - do not edit.",
+		"//----------------------------------------------------------------------------------------------------------------------",
+		"",
+		"#pragma once",
+		"",
+		string.format("#define NE_KEYWORD_SHIFT    %d", shift),
+		string.format("#define NE_KEYWORD_MASK     %d", mask),
+		"",
+		"static const struct { const char* name; i64 size; NeToken token; } gKeywordTable[NE_KEYWORD_MASK + 1] =",
+		"{",
+	}
+	for i = 0, mask do
+		local k = slots[i]
+		if k then
+			table.insert(lines, string.format("    /* %d */     { \"%s\", %d, %s },", i, k[1], #k[1], k[2]))
+		else
+			table.insert(lines, string.format("    /* %d */     { 0, 0, NeToken_Unknown },", i))
+		end
+	end
+	table.insert(lines, "};")
+	table.insert(lines, "")
+
+	local f = assert(io.open(outputPath, "wb"))
+	f:write(table.concat(lines, "\n"))
+	f:close()
+end
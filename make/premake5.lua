@@ -2,16 +2,56 @@
 
 rootdir = path.join(path.getdirectory(_SCRIPT), "..")
 
+-- Regenerate the lexer's keyword table.
+dofile(path.join(path.getdirectory(_SCRIPT), "keywords.lua"))
+generateKeywords(path.join(rootdir, "src", "keywords.h"))
+
+newoption {
+	trigger = "tagged-atoms",
+	description = "Pack atoms into 8 bytes using pointer tagging (NE_ATOM_TAGGED)",
+}
+
+newoption {
+	trigger = "stats",
+	description = "Count allocations, arena growth, objects and work done for NeGetStats (NE_STATS)",
+}
+
+newoption {
+	trigger = "pgo",
+	value = "PHASE",
+	description = "Profile-guided optimisation phase of the Profile configuration (see pgo.bat and pgo.sh)",
+	allowed = {
+		{ "instrument", "Build an executable that records a profile when it runs (the default)" },
+		{ "optimize", "Build using the recorded profile" },
+	},
+}
+
+newoption {
+	trigger = "libfuzzer",
+	description = "Link nerd-fuzz with libFuzzer and the address and undefined behaviour sanitisers (clang only)",
+}
+
+-- Where GCC keeps its profiles, which are named after the object files.
+pgodir = path.join(rootdir, "_pgo")
+
 filter { "platforms:Win64" }
 	system "Windows"
 	architecture "x64"
 
+filter { "platforms:Linux64" }
+	system "Linux"
+	architecture "x86_64"
+
+filter { "platforms:LinuxARM64" }
+	system "Linux"
+	architecture "ARM64"
+
 
 -- Solution
 solution "nerd"
 	language "C"
-	configurations { "Debug", "Release" }
-	platforms { "Win64" }
+	configurations { "Debug", "Release", "Profile", "Shipping" }
+	platforms { "Win64", "Linux64", "LinuxARM64" }
 	location "../_build"
     debugdir "../data"
     characterset "MBCS"
@@ -34,6 +74,35 @@ solution "nerd"
         flags { "FatalWarnings" }
 		optimize "full"
 
+	-- Release with link-time code generation and profile-guided optimisation.  It includes the benchmarks, so that
+	-- the instrumented executable can run them to train itself.
+	configuration "Profile"
+		defines { "NDEBUG", "NE_BENCH=1" }
+		flags { "FatalCompileWarnings", "LinkTimeOptimization" }
+		optimize "full"
+		symbols "on"
+
+	configuration { "Profile", "Win*" }
+		linkoptions { _OPTIONS["pgo"] == "optimize" and "/USEPROFILE" or "/GENPROFILE" }
+
+	configuration { "Profile", "Linux*" }
+		if _OPTIONS["pgo"] == "optimize" then
+			buildoptions { "-fprofile-use=" .. pgodir, "-fprofile-correction", "-Wno-missing-profile" }
+			linkoptions { "-fprofile-use=" .. pgodir }
+		else
+			buildoptions { "-fprofile-generate=" .. pgodir }
+			linkoptions { "-fprofile-generate=" .. pgodir }
+		end
+
+	-- Release with link-time code generation and every check compiled out (NE_SHIPPING).
+	configuration "Shipping"
+		defines { "NDEBUG", "NE_SHIPPING=1" }
+		flags { "FatalWarnings", "LinkTimeOptimization" }
+		optimize "full"
+		symbols "off"
+
+	configuration {}
+
 	-- Projects
 	project "nerd"
 		targetdir "../_bin/%{cfg.platform}_%{cfg.buildcfg}_%{prj.name}"
@@ -56,6 +125,12 @@ solution "nerd"
         defines {
         }
 
+        configuration "tagged-atoms"
+            defines { "NE_ATOM_TAGGED=1" }
+        configuration "stats"
+            defines { "NE_STATS=1" }
+        configuration {}
+
         -- Where to find the libs
         libdirs {
         }
@@ -91,4 +166,106 @@ solution "nerd"
             linkoptions {
                 "/DEBUG:FULL"
             }
+            removefiles {
+                "../src/platform_posix.c",
+                "../src/fuzz.c",
+            }
+
+        -- Linux-only settings
+		configuration "Linux*"
+            links {
+                "pthread",
+            }
+            removefiles {
+                "../src/platform_win32.c",
+                "../src/fuzz.c",
+            }
 
+	-- Benchmarks: the same executable with NE_BENCH, run as "nerd-bench --bench".
+	project "nerd-bench"
+		targetdir "../_bin/%{cfg.platform}_%{cfg.buildcfg}_%{prj.name}"
+		objdir "../_obj/%{cfg.platform}_%{cfg.buildcfg}_%{prj.name}"
+        kind "ConsoleApp"
+		files {
+            "../src/**.c",
+            "../src/**.h",
+		}
+        includedirs {
+            "../src",
+        }
+        defines {
+            "NE_BENCH=1",
+        }
+        debugargs { "--bench" }
+
+        configuration "tagged-atoms"
+            defines { "NE_ATOM_TAGGED=1" }
+        configuration "stats"
+            defines { "NE_STATS=1" }
+        configuration {}
+
+		configuration "Win*"
+			defines {
+				"WIN32",
+			}
+			flags {
+				"StaticRuntime",
+				"NoMinimalRebuild",
+				"NoIncrementalLink",
+			}
+            linkoptions {
+                "/DEBUG:FULL"
+            }
+            removefiles {
+                "../src/platform_posix.c",
+                "../src/fuzz.c",
+            }
+
+        -- Linux-only settings
+		configuration "Linux*"
+            links {
+                "pthread",
+            }
+            removefiles {
+                "../src/platform_win32.c",
+                "../src/fuzz.c",
+            }
+
+	-- Fuzzing: runs arbitrary input through NeFuzz, which checks the SIMD lexer against the scalar one.  With
+	-- --libfuzzer it is a libFuzzer target, otherwise it runs each file given (or stdin) once, for AFL.
+	project "nerd-fuzz"
+		targetdir "../_bin/%{cfg.platform}_%{cfg.buildcfg}_%{prj.name}"
+		objdir "../_obj/%{cfg.platform}_%{cfg.buildcfg}_%{prj.name}"
+        kind "ConsoleApp"
+		files {
+            "../src/nerd.c",
+            "../src/nerd.h",
+            "../src/fuzz.c",
+		}
+        includedirs {
+            "../src",
+        }
+        defines {
+            "NE_FUZZ=1",
+        }
+
+        configuration "tagged-atoms"
+            defines { "NE_ATOM_TAGGED=1" }
+        configuration "stats"
+            defines { "NE_STATS=1" }
+        configuration "libfuzzer"
+            toolset "clang"
+            defines { "NE_LIBFUZZER=1" }
+            buildoptions { "-fsanitize=fuzzer,address,undefined" }
+            linkoptions { "-fsanitize=fuzzer,address,undefined" }
+        configuration {}
+
+		configuration "Win*"
+			defines {
+				"WIN32",
+			}
+			flags {
+				"StaticRuntime",
+				"NoMinimalRebuild",
+				"NoIncrementalLink",
+			}
@@ -0,0 +1,33 @@
+@echo off
+
+rem Profile-guided build: instrument, train on the benchmarks and data\train.n, then rebuild with the profile.
+
+set "folder=%cd%"
+
+if "%VSINSTALLDIR%"=="" (
+    if exist "C:\Program Files (x86)\Microsoft Visual Studio\2017\Community\VC\Auxiliary\Build\vcvars64.bat" (
+        call "C:\Program Files (x86)\Microsoft Visual Studio\2017\Community\VC\Auxiliary\Build\vcvars64.bat"
+    ) else (
+        if exist "C:\Program Files (x86)\Microsoft Visual Studio\2017\Professional\VC\Auxiliary\Build\vcvars64.bat" (
+            call "C:\Program Files (x86)\Microsoft Visual Studio\2017\Professional\VC\Auxiliary\Build\vcvars64.bat"
+        )
+    )
+)
+cd /d %folder%
+
+pushd make
+premake5 --pgo=instrument vs2017
+popd
+pushd _build
+msbuild nerd.sln /t:nerd:rebuild /p:configuration=Profile /p:platform=Win64 /m
+popd
+
+_bin\Win64_Profile_nerd\nerd.exe --bench --reps 3 data\train.n
+_bin\Win64_Profile_nerd\nerd.exe < data\train.n
+
+pushd make
+premake5 --pgo=optimize vs2017
+popd
+pushd _build
+msbuild nerd.sln /t:nerd:rebuild /p:configuration=Profile /p:platform=Win64 /m
+popd
@@ -0,0 +1,16 @@
+#!/bin/sh
+# Profile-guided build: instrument, train on the benchmarks and data/train.n, then rebuild with the profile.
+set -e
+cd "$(dirname "$0")"
+
+rm -rf _pgo
+(cd make && premake5 --pgo=instrument gmake2)
+make -C _build config=profile_linux64 clean
+make -C _build config=profile_linux64 -j"$(nproc)" nerd
+
+_bin/Linux64_Profile_nerd/nerd --bench --reps 3 data/train.n
+_bin/Linux64_Profile_nerd/nerd < data/train.n > /dev/null
+
+(cd make && premake5 --pgo=optimize gmake2)
+make -C _build config=profile_linux64 clean
+make -C _build config=profile_linux64 -j"$(nproc)" nerd
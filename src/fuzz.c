@@ -0,0 +1,89 @@
+// Nerd - fuzzing harness
+// Copyright (C)2018 Matt Davies, all rights reserved.
+//
+// Built with NE_LIBFUZZER this is a libFuzzer target.  Otherwise it runs each file given on the command line, or stdin
+// if there are none, once, which is what AFL expects and is also how to replay a crash.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <nerd.h>
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static void out(Nerd N, const char* text, i64 size)
+{
+    (void)N;
+    fwrite(text, 1, (size_t)size, stderr);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Run one input.  Anything that goes wrong aborts, so that the fuzzer keeps the input.
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    NeConfig config;
+    NeDefaultConfig(&config);
+    config.outputFunc = &out;
+
+    if (!NeFuzz(&config, (const char *)data, (i64)size)) abort();
+    return 0;
+}
+
+#if !NE_LIBFUZZER
+
+//----------------------------------------------------------------------------------------------------------------------
+// Read a whole file into memory.  Free the return value with free().  Returns 0 if it couldn't be read.
+
+static char* readAll(FILE* f, i64* outSize)
+{
+    i64 size = 0;
+    i64 capacity = 4096;
+    char* buffer = malloc((size_t)capacity);
+
+    while (buffer)
+    {
+        size += (i64)fread(buffer + size, 1, (size_t)(capacity - size), f);
+        if (size < capacity) break;
+
+        capacity *= 2;
+        char* newBuffer = realloc(buffer, (size_t)capacity);
+        if (!newBuffer) free(buffer);
+        buffer = newBuffer;
+    }
+
+    *outSize = size;
+    return buffer;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// nerd-fuzz [<input files>...]
+
+int main(int argc, char** argv)
+{
+    for (int i = (argc > 1) ? 1 : 0; i < argc; ++i)
+    {
+        FILE* f = (argc > 1) ? fopen(argv[i], "rb") : stdin;
+        if (!f)
+        {
+            fprintf(stderr, "%s: Cannot open file.\n", argv[i]);
+            return 1;
+        }
+
+        i64 size;
+        char* data = readAll(f, &size);
+        if (f != stdin) fclose(f);
+        if (!data)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            return 1;
+        }
+
+        LLVMFuzzerTestOneInput((const uint8_t *)data, (size_t)size);
+        free(data);
+    }
+
+    return 0;
+}
+
+#endif // !NE_LIBFUZZER
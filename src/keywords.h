@@ -0,0 +1,17 @@
+//----------------------------------------------------------------------------------------------------------------------
+// Keyword table for the lexer
+// Generated by make/keywords.lua - do not edit.
+//----------------------------------------------------------------------------------------------------------------------
+
+#pragma once
+
+#define NE_KEYWORD_SHIFT    1
+#define NE_KEYWORD_MASK     3
+
+static const struct { const char* name; i64 size; NeToken token; } gKeywordTable[NE_KEYWORD_MASK + 1] =
+{
+    /* 0 */     { "yes", 3, NeToken_Yes },
+    /* 1 */     { "no", 2, NeToken_No },
+    /* 2 */     { "nil", 3, NeToken_Nil },
+    /* 3 */     { 0, 0, NeToken_Unknown },
+};
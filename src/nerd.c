@@ -2,27 +2,54 @@
 // Implementation of Nerd
 //----------------------------------------------------------------------------------------------------------------------
 
+// Shipping builds compile out every check, whatever the build says about NDEBUG.
+#if NE_SHIPPING
+#   ifndef NDEBUG
+#       define NDEBUG
+#   endif
+#endif
+
+// Fuzzing builds keep every check, since a failed assert is what the fuzzer is looking for.
+#if NE_FUZZ
+#   undef NDEBUG
+#endif
+
 #include <assert.h>
 #include <nerd.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 //----------------------------------------------------------------------------------------------------------------------
 // Index of code:
 //
 //      ARENA       Arena management.
+//      BENCH       Benchmarks (NE_BENCH builds only).
+//      COMPILE     Compiling atoms to byte-code.
 //      CONFIG      Setting up default configuration.
 //      DATA        Data structures and types.
 //      EXEC        Execution of code.
+//      FUZZ        Fuzzing entry point (NE_FUZZ builds only).
+//      GC          Garbage collection.
+//      IMAGE       Byte-code image files.
 //      LEX         Lexical analysis.
 //      LIFETIME    Lifetime management routines for the VM.
 //      MEMORY      Basic memory management.
 //      OBJECTS     Object management.
+//      POOL        Size-class pools for small allocations.
+//      PROFILE     Sampling profiler.
 //      PRINT       Printing and conversions to strings.
+//      SOURCES     Source files mapped into memory.
 //      STRINGS     String management
+//      SYMBOLS     Symbol interning.
+//      TABLES      Hash tables keyed on atoms.
+//      VECTORS     Growable arrays of atoms.
+//      VM          Byte-code interpreter.
 //      READ        Reading tokens.
+//      WORKERS     Running code on several VMs in parallel.
 //
 //----------------------------------------------------------------------------------------------------------------------
 
@@ -31,6 +58,31 @@
 
 #define NE_DEBUG_SYMBOL_HASHES      0
 
+//----------------------------------------------------------------------------------------------------------------------
+// Atomic operations, for data that is shared between threads.  atomicInc and atomicDec return the new value, the
+// compare and swaps return 1 if they stored the new value, and atomicSwapPtr returns the old value.
+
+#if defined(_MSC_VER)
+#   include <intrin.h>
+#   define atomicInc(p)             _InterlockedIncrement64((volatile long long *)(p))
+#   define atomicDec(p)             _InterlockedDecrement64((volatile long long *)(p))
+#   define atomicCas8(p, o, n)      (_InterlockedCompareExchange8((volatile char *)(p), (char)(n), (char)(o)) == (char)(o))
+#   define atomicCasPtr(p, o, n)    (_InterlockedCompareExchangePointer((void * volatile *)(p), (n), (o)) == (o))
+#   define atomicSwapPtr(p, n)      _InterlockedExchangePointer((void * volatile *)(p), (n))
+#   define atomicLoadPtr(p)         (*(void * volatile *)(p))
+#   define atomicLoad(p)            (*(volatile long long *)(p))
+#   define NE_THREAD_LOCAL          __declspec(thread)
+#else
+#   define atomicInc(p)             __atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+#   define atomicDec(p)             __atomic_sub_fetch((p), 1, __ATOMIC_ACQ_REL)
+#   define atomicCas8(p, o, n)      __sync_bool_compare_and_swap((p), (u8)(o), (u8)(n))
+#   define atomicCasPtr(p, o, n)    __sync_bool_compare_and_swap((p), (o), (n))
+#   define atomicSwapPtr(p, n)      __atomic_exchange_n((p), (n), __ATOMIC_ACQ_REL)
+#   define atomicLoadPtr(p)         __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#   define atomicLoad(p)            __atomic_load_n((p), __ATOMIC_RELAXED)
+#   define NE_THREAD_LOCAL          _Thread_local
+#endif
+
 //----------------------------------------------------------------------------------------------------------------------{DATA}
 //----------------------------------------------------------------------------------------------------------------------
 // D A T A   S T R U C T U R E S
@@ -40,15 +92,180 @@
 //----------------------------------------------------------------------------------------------------------------------
 // Memory arena structure
 
+// An arena is either linear, virtual or chunked.  A linear arena is a single buffer that is reallocated as it grows, so
+// everything allocated from it can move, but it can be indexed as an array from start.  A virtual arena is a linear
+// arena that reserves its maximum size of address space up front and commits pages as it grows, so nothing moves.  A
+// chunked arena is a list of buffers and never moves anything, but only each allocation is guaranteed to be
+// contiguous.  start, end and cursor describe its current chunk.
+
+typedef struct _ArenaChunk
+{
+    struct _ArenaChunk* prev;       // Previous chunk, or 0 if this is the first.
+    i64                 size;       // Size of the chunk in bytes, including this header.
+}
+ArenaChunk;
+
 typedef struct
 {
-    u8*     start;      // Start of buffer allocated for arena.
-    u8*     end;        // End of buffer allocated for arena (end - start == size of buffer).
-    i64     cursor;     // Position within buffer;
-    i64     restore;    // Most recent restore point.
+    u8*         start;          // Start of buffer allocated for arena.
+    u8*         end;            // End of buffer allocated for arena (end - start == size of buffer).
+    i64         cursor;         // Position within buffer;
+    i64         restore;        // Most recent restore point.
+    ArenaChunk* chunk;          // Current chunk if the arena is chunked, otherwise 0.
+    ArenaChunk* restoreChunk;   // Chunk holding the most recent restore point.
+    i64         reserved;       // Bytes of address space reserved if the arena is virtual, otherwise 0.
+#if NE_STATS
+    i64         numGrowths;     // Number of times the buffer grew.
+#endif
 }
 Arena;
 
+//----------------------------------------------------------------------------------------------------------------------
+// Small block pools.  Each size class carves its blocks out of slabs allocated from the memory function, and freed
+// blocks are kept on a freelist for that size class.
+
+#define NE_POOL_NUM_CLASSES     8
+#define NE_POOL_MAX_SIZE        256
+#define NE_POOL_SLAB_SIZE       (16 * 1024)
+
+typedef struct
+{
+    void*       freeList;           // Singly linked list of freed blocks.
+    void*       remoteList;         // Blocks freed by collector threads, taken by the VM's thread when it runs out.
+    u8*         cursor;             // Next unused block in the current slab.
+    u8*         end;                // End of the current slab.
+}
+Pool;
+
+//----------------------------------------------------------------------------------------------------------------------
+// An entry in the symbol table.  The table uses open addressing with linear probing, and caches the hash of each
+// symbol's name so that probing and growing never look at the names themselves.
+
+typedef struct
+{
+    u64                     hash;       // FNV-1a hash of the symbol's name.
+    struct _SymbolObject*   symbol;     // Interned symbol, or 0 if the slot is empty.
+}
+SymbolSlot;
+
+//----------------------------------------------------------------------------------------------------------------------
+// Size of the buffer that collects text for a sink before it is passed on.
+
+#define NE_SINK_BUFFER_SIZE     1024
+
+//----------------------------------------------------------------------------------------------------------------------
+// Vectors and tables nested deeper than this are printed as "...", as are any that contain themselves.
+
+#define NE_PRINT_MAX_DEPTH      32
+
+//----------------------------------------------------------------------------------------------------------------------
+// Phases of an incremental garbage collection cycle.
+
+typedef enum
+{
+    GC_Idle,            // No collection in progress.
+    GC_Mark,            // Tracing references from the gray stack.
+    GC_Sweep,           // Deleting unmarked objects on the sweep list.
+}
+GcState;
+
+//----------------------------------------------------------------------------------------------------------------------
+// What NeMarkAtom does with the atoms that markFns pass to it.
+
+typedef enum
+{
+    GCM_Major,          // Shade old objects for the incremental collector.
+    GCM_MinorTrace,     // Find the young objects that survive a minor collection.
+    GCM_MinorForward,   // Replace references to surviving young objects with references to their copies.
+    GCM_Clone,          // Replace references to the objects of the VM being cloned with references to their copies.
+}
+GcMode;
+
+//----------------------------------------------------------------------------------------------------------------------
+// Collector threads.  During a stop-the-world mark, the helpers and the VM's thread mark in parallel, each with its own
+// stack of objects to scan.  Markers publish surplus work on the gray stack, where idle markers steal it from.  One
+// helper sweeps while the VM carries on running.
+
+#define NE_GC_MARK_STACK_SIZE       4096        // Objects that each marker can have waiting to be scanned.
+#define NE_GC_SHARE_BATCH           64          // Objects scanned between publishing, and taken when stealing.
+
+typedef enum
+{
+    GCT_None,
+    GCT_Mark,           // All helpers mark until there's nothing left.
+    GCT_Sweep,          // The first helper to see it sweeps gcSweep.
+    GCT_Quit,
+}
+GcTask;
+
+typedef struct
+{
+    struct _Nerd*   N;
+    int             helper;         // Set for the helper threads, rather than the VM's thread.
+    void*           thread;
+    GcObj**         stack;          // Marked objects waiting to be scanned.
+    i64             count;
+}
+GcMarker;
+
+typedef struct
+{
+    void*           lock;           // Protects the fields below, the gray stack while marking, and the sweep list while
+                                    // sweepBusy is set.
+    GcMarker*       markers;        // The VM's thread first, then the helpers.
+    int             numMarkers;
+    GcTask          task;           // Most recent task handed out.
+    i64             taskId;         // Incremented for each task, so helpers can tell when there's a new one.
+    int             markBusy;       // Helpers still marking.
+    int             idle;           // Markers with nothing to scan.
+    int             markDone;       // Set once every marker is idle and the gray stack is empty.
+    int             overflow;       // Set if an object was marked but there was no memory to queue it.
+    int             sweepBusy;      // Set while a helper is sweeping.
+    GcObj*          deferred;       // Dead objects whose types need them deleted on the VM's thread.
+#if NE_STATS
+    NeStats         stats;          // Memory freed and objects deleted by the sweeper, added to the VM's afterwards.
+#endif
+}
+GcHelpers;
+
+// The marker that the current thread is, while it's marking or sweeping for a VM.
+static NE_THREAD_LOCAL GcMarker* gcThisMarker;
+
+//----------------------------------------------------------------------------------------------------------------------
+// Profiler.  Each NeRun or NeRunFile pushes a frame for the source it's running, so a sample can be charged to the
+// whole nest of runs.  Samples are counted in a hash table keyed on their folded stacks.
+
+typedef struct _ProfileFrame
+{
+    struct _ProfileFrame* prev;     // Frame of the run that started this one, or 0.
+    const char*     origin;         // Where the source came from.
+    i64             line;           // Line of the datum being run, or 0 if it isn't known.
+}
+ProfileFrame;
+
+typedef struct
+{
+    u64             hash;           // Hash of the folded stack.
+    const char*     stack;          // Folded stack in the keys arena, or 0 if the entry is empty.
+    i64             size;           // Number of characters in the folded stack.
+    i64             count;          // Samples charged to the stack.
+}
+ProfileEntry;
+
+typedef struct
+{
+    void*           thread;         // Timer thread.
+    i64             ticks;          // Intervals counted by the timer thread.
+    i64             seen;           // Ticks already charged to a stack.
+    i64             quit;           // Set to stop the timer thread.
+    Arena           keys;           // Chunked arena holding the folded stacks.
+    ProfileEntry*   entries;        // Hash table of stacks (capacity is always a power of 2).
+    i64             capacity;       // Number of entries in the hash table.
+    i64             count;          // Number of distinct stacks.
+    i64             samples;        // Total samples taken.
+}
+Profiler;
+
 //----------------------------------------------------------------------------------------------------------------------
 // The structure representing the VM context.
 
@@ -57,14 +274,77 @@ struct _Nerd
     NeConfig        config;         // Copy of the configuration.
     Arena           scratch;        // A place to construct data and strings.
     Arena           objectInfo;     // All object types.
+    Pool            pools[NE_POOL_NUM_CLASSES];     // Small block allocators, one for each size class.
+    Arena           slabs;          // Chunked arena that the pools' slabs are allocated from.
 
     // Built-in object types.
     int             stringType;
+    int             symbolType;
+    int             sourceType;
+    int             codeType;
+    int             vectorType;
+    int             tableType;
+
+    // Execution
+    Arena           stack;          // Stack of atoms used by the byte-code interpreter.
+    ProfileFrame*   profileTop;     // Innermost source being run.
+    Profiler*       profiler;       // Sampling profiler, or 0 if there isn't one.
+
+    // Symbols
+    SymbolSlot*     symbols;        // Symbol table (capacity is always a power of 2).
+    i64             symbolCapacity; // Number of slots in the symbol table.
+    i64             symbolCount;    // Number of symbols interned.
 
     // Garbage collection
-    GcObj*          gcObjs;
+    GcObj*          gcObjs;         // All objects (or those allocated since the current sweep started).
+    GcObj*          gcSweep;        // Objects detached from gcObjs to be swept.
+    GcObj**         gcSweepLink;    // Link in the sweep list to the next object to be swept.
+    GcState         gcState;        // Current phase of the collection cycle.
+    i64             gcDebt;         // Bytes of objects allocated since the last cycle finished.
+    Arena           gcGray;         // Stack of marked objects whose references haven't been marked yet.
+    int             gcGrayFailed;   // Set if a marked object couldn't be queued, so black objects must be rescanned.
+    Arena           roots;          // Stack of atoms that must not be collected.
+    Atom            lastResult;     // Result of the last NeRun, kept alive until the next one.
+    GcMode          gcMode;         // What NeMarkAtom is being used for.
+    Arena           nursery;        // Young objects, bump allocated and never grown.
+    Arena           gcRemembered;   // Old objects that may refer to young objects (0 entries have been deleted).
+    int             gcRememberAll;  // Set if the remembered set overflowed, so all old objects must be scanned.
+    Arena           gcYoung;        // Young objects that survive the minor collection in progress.
+    int             gcYoungFailed;  // Set if gcYoung couldn't grow during a minor collection.
+    Arena           gcFinal;        // Young objects whose deleteFn must be called if they die.
+    int             runDepth;       // Nesting of code being run.  Minor collections only happen at depth 0.
+    u8              gcBlack;        // Value of marked for black objects, which flips at the start of each cycle.
+    int             gcParallel;     // Set while the collector threads are marking.
+    GcHelpers*      gcHelpers;      // Collector threads, or 0 if there are none.
+
+    // Output
+    char*           outBuffer;      // Output waiting to be passed to the output callback.
+    i64             outSize;        // Number of characters in the output buffer.
+    i64             outCapacity;    // Size of the output buffer.
+
+    // String conversion
+    NeSinkFunc      sinkFunc;       // Receives the NeScratch* writes while an atom is converted, or 0 for the scratch.
+    void*           sinkContext;    // Passed to sinkFunc.
+    i64             sinkSize;       // Number of characters waiting in sinkBuffer.
+    Arena           toString;       // Result of the last NeToString.
+    int             printDepth;     // Nesting of vectors and tables being converted.
+    const void*     printing[NE_PRINT_MAX_DEPTH];   // Vectors and tables being converted, outermost first.
+    char            sinkBuffer[NE_SINK_BUFFER_SIZE];
+
+#if NE_STATS
+    NeStats         stats;          // Counters, apart from those kept in the arenas.
+#endif
 };
 
+//----------------------------------------------------------------------------------------------------------------------
+// Update a statistics counter.  These compile to nothing unless NE_STATS is set.
+
+#if NE_STATS
+#   define NE_STAT(N, field, n)     ((N)->stats.field += (n))
+#else
+#   define NE_STAT(N, field, n)     ((void)0)
+#endif
+
 //----------------------------------------------------------------------------------------------------------------------{CONFIG}
 //----------------------------------------------------------------------------------------------------------------------
 // C O N F I G U R A T I O N
@@ -86,12 +366,71 @@ static void* DefaultMemoryFunc(Nerd N, void* address, i64 oldSize, i64 newSize)
     return p;
 }
 
+//----------------------------------------------------------------------------------------------------------------------
+// Without a platform layer to map files, they are just read into memory.
+
+static const char* DefaultMapFileFunc(Nerd N, const char* path, i64* outSize, void** outHandle)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f) return 0;
+
+    char* data = 0;
+    i64 size = 0;
+    if (fseek(f, 0, SEEK_END) == 0 && (size = (i64)ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0)
+    {
+        data = (char *)NeAlloc(N, size + 1);
+        if (data && fread(data, 1, (size_t)size, f) != (size_t)size)
+        {
+            NeFree(N, data, size + 1);
+            data = 0;
+        }
+    }
+    fclose(f);
+
+    *outSize = size;
+    *outHandle = data;
+    return data;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static void DefaultUnmapFileFunc(Nerd N, const char* data, i64 size, void* handle)
+{
+    NeFree(N, handle, size + 1);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Platform layers should provide a monotonic clock; the C library only guarantees a calendar clock.
+
+static i64 DefaultTimeFunc(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (i64)ts.tv_sec * 1000000000 + (i64)ts.tv_nsec;
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 
 void NeDefaultConfig(NeConfig* config)
 {
     config->memoryFunc = &DefaultMemoryFunc;
     config->outputFunc = 0;
+    config->outputBufferSize = 4096;
+    config->outputFlush = NFM_Full;
+    config->mapFileFunc = &DefaultMapFileFunc;
+    config->unmapFileFunc = &DefaultUnmapFileFunc;
+    config->imageCache = 0;
+    config->gcThreshold = 1024 * 1024;
+    config->gcStepBudget = 256;
+    config->usePools = 1;
+    config->arenaGrowth = 2.0;
+    memset(&config->threads, 0, sizeof(config->threads));
+    config->timeFunc = &DefaultTimeFunc;
+    config->nurserySize = 256 * 1024;
+    config->gcThreads = 0;
+    memset(&config->virtualMemory, 0, sizeof(config->virtualMemory));
+    config->virtualArenaSize = 1024 * 1024 * 1024;
+    config->profileInterval = 0;
 }
 
 //----------------------------------------------------------------------------------------------------------------------{MEMORY}
@@ -100,13 +439,47 @@ void NeDefaultConfig(NeConfig* config)
 //----------------------------------------------------------------------------------------------------------------------
 //----------------------------------------------------------------------------------------------------------------------
 
+#if NE_STATS
+
+static void statsMemory(Nerd N, void* address, i64 oldBytes, i64 newBytes)
+{
+    // The sweeper keeps its own counts until it has finished.
+    NeStats* stats = gcThisMarker && gcThisMarker->helper ? &N->gcHelpers->stats : &N->stats;
+    if (!address)
+    {
+        ++stats->numAllocs;
+        oldBytes = 0;
+    }
+    else if (newBytes)
+    {
+        ++stats->numReallocs;
+    }
+    else
+    {
+        ++stats->numFrees;
+    }
+    stats->bytesAllocated += newBytes;
+    stats->bytesFreed += oldBytes;
+    stats->bytesInUse += newBytes - oldBytes;
+    stats->peakBytesInUse = NE_MAX(stats->peakBytesInUse, stats->bytesInUse);
+}
+
+#endif
+
 static void* MemoryOp(Nerd N, void* address, i64 oldBytes, i64 newBytes)
 {
     void* p = 0;
 
     if (N && N->config.memoryFunc)
     {
+#if NE_STATS
+        // Frees are counted first because the VM itself is freed by this function.
+        if (address && !newBytes) statsMemory(N, address, oldBytes, 0);
+#endif
         p = N->config.memoryFunc(N, address, oldBytes, newBytes);
+#if NE_STATS
+        if (p) statsMemory(N, address, oldBytes, newBytes);
+#endif
     }
 
     return p;
@@ -140,7 +513,7 @@ void NeFree(Nerd N, void* address, i64 oldBytes)
 //----------------------------------------------------------------------------------------------------------------------
 
 //----------------------------------------------------------------------------------------------------------------------
-// Initialise an arena structure
+// Initialise a linear arena structure
 
 static void arenaInit(Nerd N, Arena* arena, i64 initialSize)
 {
@@ -149,12 +522,98 @@ static void arenaInit(Nerd N, Arena* arena, i64 initialSize)
     assert(initialSize > 0);
 
     u8* buffer = (u8 *)NeAlloc(N, initialSize);
-    if (buffer)
+    arena->start = buffer;
+    arena->end = buffer ? buffer + initialSize : 0;
+    arena->cursor = 0;
+    arena->restore = -1;
+    arena->chunk = 0;
+    arena->restoreChunk = 0;
+    arena->reserved = 0;
+#if NE_STATS
+    arena->numGrowths = 0;
+#endif
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Initialise a virtual arena structure that can grow to maxSize bytes.  It is a linear arena instead if the
+// configuration has no virtual memory functions or the address space can't be reserved.
+
+#define NE_VIRTUAL_COMMIT_SIZE      (64 * 1024)
+#define NE_VIRTUAL_ROUND(n)         (((n) + NE_VIRTUAL_COMMIT_SIZE - 1) & ~(i64)(NE_VIRTUAL_COMMIT_SIZE - 1))
+
+static void arenaInitVirtual(Nerd N, Arena* arena, i64 initialSize, i64 maxSize)
+{
+    assert(N);
+    assert(arena);
+    assert(initialSize > 0);
+
+    NeVirtualFuncs* vm = &N->config.virtualMemory;
+    i64 reserved = NE_VIRTUAL_ROUND(NE_MAX(initialSize, maxSize));
+    i64 committed = NE_VIRTUAL_ROUND(initialSize);
+    u8* buffer = vm->reserve ? (u8 *)vm->reserve(reserved) : 0;
+    if (buffer && !vm->commit(buffer, committed))
+    {
+        vm->release(buffer, reserved);
+        buffer = 0;
+    }
+
+    if (!buffer)
+    {
+        arenaInit(N, arena, initialSize);
+        return;
+    }
+
+    arena->start = buffer;
+    arena->end = buffer + committed;
+    arena->cursor = 0;
+    arena->restore = -1;
+    arena->chunk = 0;
+    arena->restoreChunk = 0;
+    arena->reserved = reserved;
+#if NE_STATS
+    arena->numGrowths = 0;
+#endif
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Add a new chunk to a chunked arena.  Returns 1 or 0 if out of memory.
+
+static int arenaAddChunk(Nerd N, Arena* arena, i64 size)
+{
+    ArenaChunk* chunk = (ArenaChunk *)NeAlloc(N, (i64)sizeof(ArenaChunk) + size);
+    if (!chunk) return 0;
+
+    chunk->prev = arena->chunk;
+    chunk->size = (i64)sizeof(ArenaChunk) + size;
+    arena->chunk = chunk;
+    arena->start = (u8 *)(chunk + 1);
+    arena->end = arena->start + size;
+    arena->cursor = 0;
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Initialise a chunked arena structure.  Nothing allocated from it moves until it is popped or destroyed.
+
+static void arenaInitChunked(Nerd N, Arena* arena, i64 chunkSize)
+{
+    assert(N);
+    assert(arena);
+    assert(chunkSize > 0);
+
+    arena->start = 0;
+    arena->end = 0;
+    arena->cursor = 0;
+    arena->restore = -1;
+    arena->chunk = 0;
+    arena->restoreChunk = 0;
+    arena->reserved = 0;
+#if NE_STATS
+    arena->numGrowths = 0;
+#endif
+    if (!arenaAddChunk(N, arena, chunkSize))
     {
-        arena->start = buffer;
-        arena->end = buffer + initialSize;
-        arena->cursor = 0;
-        arena->restore = -1;
+        arena->start = arena->end = 0;
     }
 }
 
@@ -166,15 +625,35 @@ static void arenaDone(Nerd N, Arena* arena)
     assert(N);
     assert(arena);
 
-    NeFree(N, arena->start, (arena->end - arena->start));
+    if (arena->chunk)
+    {
+        while (arena->chunk)
+        {
+            ArenaChunk* prev = arena->chunk->prev;
+            NeFree(N, arena->chunk, arena->chunk->size);
+            arena->chunk = prev;
+        }
+    }
+    else if (arena->reserved)
+    {
+        N->config.virtualMemory.release(arena->start, arena->reserved);
+    }
+    else
+    {
+        NeFree(N, arena->start, (arena->end - arena->start));
+    }
+
     arena->start = 0;
     arena->end = 0;
     arena->cursor = 0;
     arena->restore = -1;
+    arena->restoreChunk = 0;
+    arena->reserved = 0;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-// Ensure we have enough space in the arena, expanding if necessary.
+// Ensure we have enough space in the arena, expanding if necessary.  Buffers grow geometrically by the configuration's
+// arena growth factor.
 
 static int arenaEnsureSpace(Nerd N, Arena* arena, i64 numBytes)
 {
@@ -186,10 +665,30 @@ static int arenaEnsureSpace(Nerd N, Arena* arena, i64 numBytes)
     {
         // We don't have enough room to contain those bytes.
         i64 currentSize = (arena->end - arena->start);
-        i64 requiredSize = currentSize + numBytes;
-        i64 newSize = currentSize + NE_MAX(requiredSize, 4096);
+        i64 grownSize = (i64)((double)currentSize * N->config.arenaGrowth);
+#if NE_STATS
+        ++arena->numGrowths;
+        ++N->stats.arenaGrowths;
+#endif
+
+        if (arena->chunk)
+        {
+            // Start a new chunk, leaving the rest of the current one unused.
+            return arenaAddChunk(N, arena, NE_MAX(NE_MAX(grownSize, numBytes), 4096));
+        }
+
+        if (arena->reserved)
+        {
+            // Commit more of the reservation, in place.
+            i64 committed = NE_MIN(NE_VIRTUAL_ROUND(NE_MAX(grownSize, arena->cursor + numBytes)), arena->reserved);
+            if (arena->cursor + numBytes > committed) return 0;
+            if (!N->config.virtualMemory.commit(arena->end, committed - currentSize)) return 0;
+            arena->end = arena->start + committed;
+            return 1;
+        }
 
-        u8* newArena = (u8 *)NeRealloc(N, arena->start, (i64)(arena->end - arena->cursor), newSize);
+        i64 newSize = NE_MAX(NE_MAX(grownSize, arena->cursor + numBytes), 4096);
+        u8* newArena = (u8 *)NeRealloc(N, arena->start, currentSize, newSize);
         if (newArena)
         {
             arena->start = newArena;
@@ -253,6 +752,15 @@ static void* arenaAlignedAlloc(Nerd N, Arena* arena, i64 numBytes)
 //----------------------------------------------------------------------------------------------------------------------
 // Create a restore point so that any future allocations can be deallocated on one go.
 
+typedef struct
+{
+    i64         magic;
+    i64         restore;        // Previous restore point.
+    ArenaChunk* restoreChunk;   // Chunk holding the previous restore point.
+    i64         padding;        // Keeps allocations after the restore point aligned.
+}
+ArenaRestore;
+
 static void arenaPush(Nerd N, Arena* arena)
 {
     assert(N);
@@ -260,10 +768,12 @@ static void arenaPush(Nerd N, Arena* arena)
 
     arenaAlign(N, arena);
 
-    i64* p = arenaAlloc(N, arena, sizeof(i64) * 2);
-    p[0] = 0xaaaaaaaaaaaaaaaa;
-    p[1] = arena->restore;
+    ArenaRestore* p = (ArenaRestore *)arenaAlloc(N, arena, sizeof(ArenaRestore));
+    p->magic = 0xaaaaaaaaaaaaaaaa;
+    p->restore = arena->restore;
+    p->restoreChunk = arena->restoreChunk;
     arena->restore = (i64)((u8 *)p - arena->start);
+    arena->restoreChunk = arena->chunk;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -274,12 +784,23 @@ static void arenaPop(Nerd N, Arena* arena)
     assert(N);
     assert(arena);
 
-    i64* p = 0;
     assert(arena->restore != -1);
+
+    // Release any chunks started since the restore point.
+    while (arena->chunk != arena->restoreChunk)
+    {
+        ArenaChunk* prev = arena->chunk->prev;
+        NeFree(N, arena->chunk, arena->chunk->size);
+        arena->chunk = prev;
+        arena->start = (u8 *)(prev + 1);
+        arena->end = (u8 *)prev + prev->size;
+    }
+
     arena->cursor = arena->restore;
-    p = (i64 *)(arena->start + arena->cursor);
-    p[0] = 0xbbbbbbbbbbbbbbbb;
-    arena->restore = p[1];
+    ArenaRestore* p = (ArenaRestore *)(arena->start + arena->cursor);
+    p->magic = 0xbbbbbbbbbbbbbbbb;
+    arena->restore = p->restore;
+    arena->restoreChunk = p->restoreChunk;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -303,6 +824,10 @@ static char* arenaFormatV(Nerd N, Arena* arena, const char* format, va_list args
     i64 maxSize = arenaSpace(arena);
     char* p = 0;
 
+    // The arguments may be needed twice.
+    va_list argsCopy;
+    va_copy(argsCopy, args);
+
     int numChars = vsnprintf(arena->start + arena->cursor, maxSize, format, args);
     if (numChars < maxSize)
     {
@@ -311,14 +836,15 @@ static char* arenaFormatV(Nerd N, Arena* arena, const char* format, va_list args
     }
     else
     {
-        // There wasn't enough room to hold the string.
+        // There wasn't enough room to hold the string.  The null terminator is written after the cursor, like above.
         if (arenaEnsureSpace(N, arena, numChars + 1))
         {
-            numChars = vsnprintf(arena->start + arena->cursor, numChars + 1, format, args);
-            p = (char *)arenaAlloc(N, arena, numChars + 1);
+            numChars = vsnprintf(arena->start + arena->cursor, numChars + 1, format, argsCopy);
+            p = (char *)arenaAlloc(N, arena, numChars);
         }
     }
 
+    va_end(argsCopy);
     return p;
 }
 
@@ -343,6 +869,128 @@ static char* arenaFormat(Nerd N, Arena* arena, const char* format, ...)
 // Helper macro to allocate memory for a particular data type.
 #define ARENA_ALLOC(n, arena, t, count) (t *)arenaAlignedAlloc((n), (arena), (i64)(sizeof(t) * (count)))
 
+//----------------------------------------------------------------------------------------------------------------------{POOL}
+//----------------------------------------------------------------------------------------------------------------------
+// S I Z E - C L A S S   P O O L S
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------------------------------------------------
+// Block sizes of each class, and the class to use, indexed by the size rounded up to 16 bytes.
+
+static const i64 gPoolSizes[NE_POOL_NUM_CLASSES] = { 16, 32, 48, 64, 96, 128, 192, 256 };
+
+static const u8 gPoolClass[NE_POOL_MAX_SIZE / 16 + 1] =
+{
+    0, 0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7,
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static void poolInit(Nerd N)
+{
+    memset(N->pools, 0, sizeof(N->pools));
+    if (N->config.usePools)
+    {
+        arenaInitChunked(N, &N->slabs, NE_POOL_SLAB_SIZE * 4);
+    }
+    else
+    {
+        memset(&N->slabs, 0, sizeof(N->slabs));
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Release all the slabs.  All blocks allocated from the pools become invalid.
+
+static void poolDone(Nerd N)
+{
+    if (N->config.usePools) arenaDone(N, &N->slabs);
+    memset(N->pools, 0, sizeof(N->pools));
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Allocate a block from the pools, falling back to the memory function for large blocks or if pools are disabled.
+
+static void* poolAlloc(Nerd N, i64 bytes)
+{
+    if (!N->config.usePools || bytes > NE_POOL_MAX_SIZE)
+    {
+        return NeAlloc(N, bytes);
+    }
+
+    i64 cls = gPoolClass[(bytes + 15) >> 4];
+    Pool* pool = &N->pools[cls];
+    void* p = pool->freeList;
+    if (!p && atomicLoadPtr(&pool->remoteList))
+    {
+        p = atomicSwapPtr(&pool->remoteList, 0);
+    }
+
+    if (p)
+    {
+        pool->freeList = *(void **)p;
+    }
+    else
+    {
+        i64 blockSize = gPoolSizes[cls];
+        if (pool->cursor + blockSize > pool->end)
+        {
+            // Current slab is exhausted, so start another one.  Slabs never move since the arena is chunked.
+            u8* slab = (u8 *)arenaAlignedAlloc(N, &N->slabs, NE_POOL_SLAB_SIZE);
+            if (!slab) return 0;
+            pool->cursor = slab;
+            pool->end = slab + NE_POOL_SLAB_SIZE;
+        }
+
+        p = pool->cursor;
+        pool->cursor += blockSize;
+    }
+
+    return p;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Return a block to the pools.  The size must match the size passed to poolAlloc.  Collector threads push blocks on
+// to the remote list instead, since only the VM's thread uses the free list.
+
+static void poolFree(Nerd N, void* p, i64 bytes)
+{
+    if (!p) return;
+
+    if (!N->config.usePools || bytes > NE_POOL_MAX_SIZE)
+    {
+        NeFree(N, p, bytes);
+    }
+    else if (gcThisMarker && gcThisMarker->helper)
+    {
+        Pool* pool = &N->pools[gPoolClass[(bytes + 15) >> 4]];
+        void* head;
+        do
+        {
+            head = atomicLoadPtr(&pool->remoteList);
+            *(void **)p = head;
+        }
+        while (!atomicCasPtr(&pool->remoteList, head, p));
+    }
+    else
+    {
+        Pool* pool = &N->pools[gPoolClass[(bytes + 15) >> 4]];
+        *(void **)p = pool->freeList;
+        pool->freeList = p;
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Copy a block into a new block from the pools.  Returns 0 if the block is 0 or out of memory.
+
+static void* poolClone(Nerd N, const void* p, i64 bytes)
+{
+    void* copy = p ? poolAlloc(N, bytes) : 0;
+    if (copy) memcpy(copy, p, (size_t)bytes);
+    return copy;
+}
+
 //----------------------------------------------------------------------------------------------------------------------{UTILITIES}
 //----------------------------------------------------------------------------------------------------------------------
 // U T I L T I E S
@@ -351,7 +999,7 @@ static char* arenaFormat(Nerd N, Arena* arena, const char* format, ...)
 
 static u64 hash(const char* start, const char* end)
 {
-    u64 h = 14695981039346656037;
+    u64 h = 14695981039346656037ull;
     for (const char* s = start; s != end; ++s)
     {
         h ^= *s;
@@ -377,19 +1025,89 @@ static const char* scratchStart(Nerd N)
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-// Add a printf-style formatted string with a va_list.
+// End the scratch session.
 
-void NeScratchFormatV(Nerd N, const char* format, va_list args)
+static void scratchEnd(Nerd N)
 {
-    arenaFormatV(N, &N->scratch, format, args);
+    char* p = (char *)arenaAlloc(N, &N->scratch, 1);
+    *p = 0;
+    arenaPop(N, &N->scratch);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-// Add a printf-style formatted string with variable arguments.
+// While an atom is converted to a string, the NeScratch* functions write to a sink instead of the scratch.  The text
+// is collected in a small buffer and passed to the sink function a chunk at a time.
 
-void NeScratchFormat(Nerd N, const char* format, ...)
+static void sinkFlush(Nerd N)
 {
-    va_list args;
+    if (N->sinkSize) N->sinkFunc(N, N->sinkContext, N->sinkBuffer, N->sinkSize);
+    N->sinkSize = 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static void sinkWrite(Nerd N, const char* text, i64 size)
+{
+    if (N->sinkSize + size > NE_SINK_BUFFER_SIZE) sinkFlush(N);
+    if (size > NE_SINK_BUFFER_SIZE)
+    {
+        N->sinkFunc(N, N->sinkContext, text, size);
+    }
+    else
+    {
+        memcpy(N->sinkBuffer + N->sinkSize, text, (size_t)size);
+        N->sinkSize += size;
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static void sinkFormatV(Nerd N, const char* format, va_list args)
+{
+    // Try to format straight into the buffer.  vsnprintf needs room for a null terminator too.
+    i64 space = NE_SINK_BUFFER_SIZE - N->sinkSize;
+    va_list argsCopy;
+    va_copy(argsCopy, args);
+    int numChars = vsnprintf(N->sinkBuffer + N->sinkSize, (size_t)space, format, argsCopy);
+    va_end(argsCopy);
+
+    if (numChars < 0) return;
+    if (numChars < space)
+    {
+        N->sinkSize += numChars;
+    }
+    else
+    {
+        // Not enough room so format it in the scratch instead.
+        scratchStart(N);
+        i64 offset = N->scratch.cursor;
+        arenaFormatV(N, &N->scratch, format, args);
+        sinkWrite(N, (const char *)N->scratch.start + offset, N->scratch.cursor - offset);
+        scratchEnd(N);
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Add a printf-style formatted string with a va_list.
+
+void NeScratchFormatV(Nerd N, const char* format, va_list args)
+{
+    if (N->sinkFunc)
+    {
+        sinkFormatV(N, format, args);
+    }
+    else
+    {
+        arenaFormatV(N, &N->scratch, format, args);
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Add a printf-style formatted string with variable arguments.
+
+void NeScratchFormat(Nerd N, const char* format, ...)
+{
+    va_list args;
     va_start(args, format);
     NeScratchFormatV(N, format, args);
     va_end(args);
@@ -400,8 +1118,15 @@ void NeScratchFormat(Nerd N, const char* format, ...)
 
 void NeScratchAdd(Nerd N, const char* start, const char* end)
 {
-    char* p = (char *)arenaAlloc(N, &N->scratch, (i64)(end - start));
-    if (p) memcpy(p, start, (size_t)(end - start));
+    if (N->sinkFunc)
+    {
+        sinkWrite(N, start, (i64)(end - start));
+    }
+    else
+    {
+        char* p = (char *)arenaAlloc(N, &N->scratch, (i64)(end - start));
+        if (p) memcpy(p, start, (size_t)(end - start));
+    }
 }
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -409,18 +1134,7 @@ void NeScratchAdd(Nerd N, const char* start, const char* end)
 
 void NeScratchAddChar(Nerd N, char c)
 {
-    char* p = (char *)arenaAlloc(N, &N->scratch, 1);
-    *p = c;
-}
-
-//----------------------------------------------------------------------------------------------------------------------
-// End the scratch session.
-
-static void scratchEnd(Nerd N)
-{
-    char* p = (char *)arenaAlloc(N, &N->scratch, 1);
-    *p = 0;
-    arenaPop(N, &N->scratch);
+    NeScratchAdd(N, &c, &c + 1);
 }
 
 //----------------------------------------------------------------------------------------------------------------------{OBJECTS}
@@ -434,6 +1148,34 @@ static ObjectInfo* objectType(Nerd N, GcObj* obj)
     return (ObjectInfo *)N->objectInfo.start + obj->type;
 }
 
+//----------------------------------------------------------------------------------------------------------------------
+// Young objects live in the nursery until a minor collection moves the survivors out.
+
+static int gcIsYoung(Nerd N, GcObj* obj)
+{
+    return (u8 *)obj >= N->nursery.start && (u8 *)obj < N->nursery.start + N->nursery.cursor;
+}
+
+// Size an object takes up in the nursery.
+static i64 nurseryObjectSize(GcObj* obj)
+{
+    return ((i64)sizeof(GcObj) + obj->size + 15) & ~(i64)15;
+}
+
+// Allocate from the nursery, or return 0 if it is full.
+static GcObj* nurseryAlloc(Nerd N, i64 size)
+{
+    size = (size + 15) & ~(i64)15;
+    if (N->nursery.start + N->nursery.cursor + size > N->nursery.end) return 0;
+    GcObj* obj = (GcObj *)(N->nursery.start + N->nursery.cursor);
+    N->nursery.cursor += size;
+    return obj;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static void gcForget(Nerd N, GcObj* obj);
+
 static void objectDelete(Nerd N, void* obj)
 {
     GcObj* gcObj = (GcObj *)obj - 1;
@@ -442,31 +1184,26 @@ static void objectDelete(Nerd N, void* obj)
     {
         info->deleteFn(N, obj);
     }
-    NeFree(N, gcObj, sizeof(GcObj) + info->size);
-}
-
-//----------------------------------------------------------------------------------------------------------------------
+#if NE_STATS
+    if (gcObj->type < NE_STATS_MAX_TYPES) --N->stats.types[gcObj->type].alive;
+#endif
+    if (gcObj->remembered) gcForget(N, gcObj);
 
-static int objectEval(Nerd N, Atom a, Atom* outResult)
-{
-    assert(a.type == AT_Object);
-    ObjectInfo* info = objectType(N, a.obj);
-    if (info->evalFn)
-    {
-        return info->evalFn(N, a, a.obj + 1, outResult);
-    }
-    else
-    {
-        *outResult = a;
-        return 1;
-    }
+    // The nursery's memory is reclaimed all at once.
+    if (!gcIsYoung(N, gcObj)) poolFree(N, gcObj, sizeof(GcObj) + gcObj->size);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
 
+static void gcWaitSweep(Nerd N);
+
 int NeObjectRegister(Nerd N, ObjectInfo* info)
 {
+    // The sweeper reads the object types.
+    gcWaitSweep(N);
+
     int type = (int)(N->objectInfo.cursor / sizeof(ObjectInfo));
+    assert(type <= 0xffff);
     ObjectInfo* newInfo = (ObjectInfo *)arenaAlloc(N, &N->objectInfo, sizeof(ObjectInfo));
     *newInfo = *info;
     return type;
@@ -474,26 +1211,87 @@ int NeObjectRegister(Nerd N, ObjectInfo* info)
 
 //----------------------------------------------------------------------------------------------------------------------
 
+static void gcAllocate(Nerd N, i64 bytes);
+static void gcAllocated(Nerd N, GcObj* obj);
+static void gcSafePoint(Nerd N, Atom* keep);
+
 void* NeObjectCreate(Nerd N, int type, const void* data)
 {
+    return NeObjectCreateSized(N, type, 0, data);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+void* NeObjectCreateSized(Nerd N, int type, i64 extraBytes, const void* data)
+{
+    assert(extraBytes >= 0);
     ObjectInfo* info = (ObjectInfo *)N->objectInfo.start + type;
-    GcObj* newObj = (GcObj *)NeAlloc(N, sizeof(GcObj) + info->size);
+    i64 size = info->size + extraBytes;
+
+    // Movable objects start young unless the nursery is full.  They don't go on gcObjs, and the collector doesn't run
+    // for them since they are paid for when they are promoted.
+    GcObj* newObj = 0;
+    int young = (info->flags & NOF_Movable) && N->gcMode == GCM_Major;
+    if (young) newObj = nurseryAlloc(N, sizeof(GcObj) + size);
+    if (!newObj)
+    {
+        young = 0;
+        gcAllocate(N, sizeof(GcObj) + size);
+        newObj = (GcObj *)poolAlloc(N, sizeof(GcObj) + size);
+    }
+
     if (newObj)
     {
-        newObj->next = N->gcObjs;
+        newObj->next = young ? 0 : N->gcObjs;
         newObj->type = type;
-        memset(newObj + 1, 0, info->size);
+        newObj->marked = 0;
+        newObj->selfEval = info->evalFn == 0;
+        newObj->remembered = 0;
+        newObj->size = (u32)size;
+        memset(newObj + 1, 0, (size_t)size);
+#if NE_STATS
+        if (type < NE_STATS_MAX_TYPES)
+        {
+            ++N->stats.types[type].alive;
+            ++N->stats.types[type].created;
+        }
+#endif
 
         if (info->createFn)
         {
             if (!info->createFn(N, newObj + 1, data))
             {
                 objectDelete(N, newObj + 1);
+
+                // A dead young object stays in the nursery until the next minor collection, so leave it zeroed.
+                if (young) memset(newObj + 1, 0, (size_t)size);
                 return 0;
             }
         }
 
+        if (young)
+        {
+#if NE_STATS
+            int final = 1;      // Keep the type's alive count up to date.
+#else
+            int final = info->deleteFn != 0;
+#endif
+            if (final)
+            {
+                GcObj** p = (GcObj **)arenaAlloc(N, &N->gcFinal, sizeof(GcObj*));
+                if (!p)
+                {
+                    objectDelete(N, newObj + 1);
+                    memset(newObj + 1, 0, (size_t)size);
+                    return 0;
+                }
+                *p = newObj;
+            }
+            return newObj + 1;
+        }
+
         N->gcObjs = newObj;
+        gcAllocated(N, newObj);
         return newObj + 1;
     }
     else
@@ -502,1061 +1300,6190 @@ void* NeObjectCreate(Nerd N, int type, const void* data)
     }
 }
 
-//----------------------------------------------------------------------------------------------------------------------{STRINGS}
+//----------------------------------------------------------------------------------------------------------------------{GC}
 //----------------------------------------------------------------------------------------------------------------------
-// S T R I N G S
+// G A R B A G E   C O L L E C T I O N
 //----------------------------------------------------------------------------------------------------------------------
 //----------------------------------------------------------------------------------------------------------------------
 
-typedef struct  
-{
-    i64 size;
-    char* str;
-}
-StringObject;
+//----------------------------------------------------------------------------------------------------------------------
+// The collector is an incremental tri-colour mark and sweep:
+//
+//      white       marked != gcBlack
+//      gray        marked == gcBlack and on the gcGray stack
+//      black       marked == gcBlack and not on the gcGray stack
+//
+// Marking starts from the roots (the root stack and the last result) and drains the gray stack a budgeted number of
+// objects at a time.  Stores into objects made while marking go through NeWriteBarrier so a black object never points
+// to a white one.  Once the gray stack is empty, gcObjs is detached on to the sweep list and swept incrementally.
+// Objects allocated while marking are gray, and while sweeping are white, since they are never on the sweep list.
+//
+// Objects of movable types are allocated young, in the nursery, and aren't seen by the incremental collector: it
+// treats everything they refer to as a root instead.  At a safe point, where no C code holds pointers to young objects,
+// a minor collection traces the young objects reachable from the roots and the remembered set (old objects that the
+// write barrier saw being given references to young ones), copies them out of the nursery and then empties it.
+//
 
-typedef struct  
-{
-    const char* start;
-    const char* end;
-}
-Range;
+//----------------------------------------------------------------------------------------------------------------------
+// Mark an object and queue it for scanning if it holds references.
 
-static int stringCreate(Nerd N, void* obj, const void* data)
+static void gcShadeParallel(Nerd N, GcObj* obj);
+
+static void gcShade(Nerd N, GcObj* obj)
 {
-    StringObject* str = (StringObject *)obj;
-    Range* range = (Range *)data;
+    assert(!gcIsYoung(N, obj));
+    if (N->gcMode != GCM_Major) return;
 
-    // Check the final length of string
-    int strLen = (int)(range->end - range->start);
-    int len = 0;
-    for (int i = 0; i < strLen; ++i)
+    if (N->gcParallel)
     {
-        if (range->start[i] == '\\')
-        {
-            if ((i < (strLen - 1)) && (range->start[i + 1] == '\\')) ++len;
-        }
-        else
-        {
-            ++len;
-        }
+        gcShadeParallel(N, obj);
     }
-
-    str->size = len;
-    str->str = (char *)NeAlloc(N, str->size + 1);
-    if (str->str)
+    else if (obj->marked != N->gcBlack)
     {
-        int j = 0;
-        for (int i = 0; i < strLen; ++i)
+        obj->marked = N->gcBlack;
+        if (objectType(N, obj)->markFn)
         {
-            if (range->start[i] == '\\')
+            GcObj** p = (GcObj **)arenaAlloc(N, &N->gcGray, sizeof(GcObj*));
+            if (p)
             {
-                ++i;
-                if (i < strLen)
-                {
-                    switch (range->start[i])
-                    {
-                    case 'n': str->str[j++] = '\n'; break;
-                    case 'r': str->str[j++] = '\r'; break;
-                    case 't': str->str[j++] = '\t'; break;
-                    case 'b': str->str[j++] = '\b'; break;
-                    default:  str->str[j++] = range->start[i]; break;
-                    }
-                }
+                *p = obj;
             }
             else
             {
-                str->str[j++] = range->start[i];
+                // Out of memory, so it will be found by scanning every black object before marking finishes.
+                N->gcGrayFailed = 1;
             }
         }
-        assert(j == len);
-        str->str[str->size] = 0;
-        return 1;
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Queue a young object that survives the minor collection in progress.
+
+static void gcSurvive(Nerd N, GcObj* obj)
+{
+    obj->marked = 1;
+    GcObj** p = (GcObj **)arenaAlloc(N, &N->gcYoung, sizeof(GcObj*));
+    if (p)
+    {
+        *p = obj;
     }
     else
     {
-        return 0;
+        N->gcYoungFailed = 1;
     }
 }
 
-static void stringDelete(Nerd N, void* obj)
-{
-    StringObject* str = (StringObject *)obj;
-    NeFree(N, str->str, str->size + 1);
-}
+//----------------------------------------------------------------------------------------------------------------------
 
-static void stringToString(Nerd N, void* obj, NeStringMode mode)
+void NeMarkAtom(Nerd N, Atom* a)
 {
-    StringObject* str = (StringObject *)obj;
+    if (NE_ATOM_TYPE(*a) != AT_Object) return;
 
-    if (mode == NSM_Normal)
+    GcObj* obj = NE_ATOM_OBJ(*a);
+    if (N->gcMode == GCM_Clone)
     {
-        NeScratchAdd(N, str->str, str->str + str->size);
+        // Every object in the VM being cloned points to its copy.
+        *a = NeMakeObject(N, obj->next + 1);
     }
-    else
+    else if (!gcIsYoung(N, obj))
     {
-        NeScratchFormat(N, "\"");
-        for (int i = 0; i < str->size; ++i)
+        gcShade(N, obj);
+    }
+    else if (N->gcMode == GCM_MinorTrace)
+    {
+        if (!obj->marked) gcSurvive(N, obj);
+    }
+    else if (N->gcMode == GCM_MinorForward)
+    {
+        // Every reachable young object was traced, so it has a copy.
+        assert(obj->marked);
+        *a = NeMakeObject(N, obj->next + 1);
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+void NeWriteBarrier(Nerd N, void* object, Atom value)
+{
+    if (NE_ATOM_TYPE(value) != AT_Object) return;
+
+    GcObj* obj = (GcObj *)object - 1;
+    GcObj* target = NE_ATOM_OBJ(value);
+    if (gcIsYoung(N, target))
+    {
+        // Old objects that refer to young ones are roots for minor collections.  If the remembered set can't grow,
+        // the next minor collection scans every old object instead.
+        if (!obj->remembered && !N->gcRememberAll && !gcIsYoung(N, obj))
         {
-            switch (str->str[i])
+            GcObj** p = (GcObj **)arenaAlloc(N, &N->gcRemembered, sizeof(GcObj*));
+            if (p)
             {
-            case '\n': NeScratchFormat(N, "\\n"); break;
-            case '\r': NeScratchFormat(N, "\\r"); break;
-            case '\t': NeScratchFormat(N, "\\t"); break;
-            case '\b': NeScratchFormat(N, "\\b"); break;
-
-            default:
-                NeScratchAddChar(N, str->str[i]);
+                *p = obj;
+                obj->remembered = 1;
+            }
+            else
+            {
+                N->gcRememberAll = 1;
             }
         }
-        NeScratchFormat(N, "\"");
+    }
+    else if (N->gcState == GC_Mark && obj->marked == N->gcBlack)
+    {
+        gcShade(N, target);
     }
 }
 
-static int registerStringType(Nerd N)
+//----------------------------------------------------------------------------------------------------------------------
+// Remove an old object that is being deleted from the remembered set.
+
+static void gcForget(Nerd N, GcObj* obj)
 {
-    ObjectInfo strObjectInfo = {
-        .name = "string",
-        .createFn = &stringCreate,
-        .deleteFn = &stringDelete,
-        .evalFn = 0,
-        .toStringFn = &stringToString,
-        .size = sizeof(StringObject)
-    };
-    return NeObjectRegister(N, &strObjectInfo);
+    GcObj** remembered = (GcObj **)N->gcRemembered.start;
+    i64 numRemembered = N->gcRemembered.cursor / (i64)sizeof(GcObj*);
+    for (i64 i = 0; i < numRemembered; ++i)
+    {
+        if (remembered[i] == obj)
+        {
+            remembered[i] = 0;
+            break;
+        }
+    }
+    obj->remembered = 0;
 }
 
-//----------------------------------------------------------------------------------------------------------------------{LIFETIME}
-//----------------------------------------------------------------------------------------------------------------------
-// L I F E T I M E   M A N A G E M E N T
-//----------------------------------------------------------------------------------------------------------------------
 //----------------------------------------------------------------------------------------------------------------------
+// Mark everything that is directly reachable by the VM or host.
 
-Nerd NeOpen(NeConfig* config)
+static void gcMarkRoots(Nerd N)
 {
-    // Create a default configuration if necessary.
-    NeConfig defaultConfig;
-    if (!config)
+    Atom* roots = (Atom *)N->roots.start;
+    i64 numRoots = N->roots.cursor / (i64)sizeof(Atom);
+    for (i64 i = 0; i < numRoots; ++i)
     {
-        config = &defaultConfig;
-        NeDefaultConfig(config);
+        NeMarkAtom(N, &roots[i]);
     }
+    NeMarkAtom(N, &N->lastResult);
 
-    // Create the Nerd structure.
-    Nerd N = config->memoryFunc(0, 0, 0, sizeof(struct _Nerd));
-    if (N)
+    Atom* stack = (Atom *)N->stack.start;
+    i64 stackSize = N->stack.cursor / (i64)sizeof(Atom);
+    for (i64 i = 0; i < stackSize; ++i)
     {
-        // Copy configuration.
-        N->config = *config;
-
-        // Initialise the scratch.
-        arenaInit(N, &N->scratch, 4096);
+        NeMarkAtom(N, &stack[i]);
+    }
 
-        // Initialise object types
-        N->gcObjs = 0;
-        arenaInit(N, &N->objectInfo, sizeof(ObjectInfo) * 16);
-        N->stringType = registerStringType(N);
+    // Symbols are never collected since they hold the global values.
+    for (i64 i = 0; i < N->symbolCapacity; ++i)
+    {
+        if (N->symbols[i].symbol) gcShade(N, (GcObj *)N->symbols[i].symbol - 1);
     }
 
-    return N;
+    // Young objects aren't traced, so anything old that they refer to is reachable.
+    for (i64 offset = 0; offset < N->nursery.cursor;)
+    {
+        GcObj* obj = (GcObj *)(N->nursery.start + offset);
+        ObjectMarkFn markFn = objectType(N, obj)->markFn;
+        if (markFn) markFn(N, obj + 1);
+        offset += nurseryObjectSize(obj);
+    }
 }
 
 //----------------------------------------------------------------------------------------------------------------------
+// Pass every atom that may refer to a young object to NeMarkAtom, apart from those in young objects.
 
-void NeClose(Nerd N)
+static void gcMinorRoots(Nerd N)
 {
-    while (N->gcObjs)
+    Atom* roots = (Atom *)N->roots.start;
+    i64 numRoots = N->roots.cursor / (i64)sizeof(Atom);
+    for (i64 i = 0; i < numRoots; ++i)
     {
-        GcObj* nextObj = N->gcObjs->next;
-        objectDelete(N, N->gcObjs + 1);
-        N->gcObjs = nextObj;
+        NeMarkAtom(N, &roots[i]);
     }
+    NeMarkAtom(N, &N->lastResult);
 
-    arenaDone(N, &N->scratch);
-    arenaDone(N, &N->objectInfo);
-    NeFree(N, N, sizeof(struct _Nerd));
+    Atom* stack = (Atom *)N->stack.start;
+    i64 stackSize = N->stack.cursor / (i64)sizeof(Atom);
+    for (i64 i = 0; i < stackSize; ++i)
+    {
+        NeMarkAtom(N, &stack[i]);
+    }
+
+    if (N->gcRememberAll)
+    {
+        GcObj* lists[] = { N->gcObjs, N->gcSweep };
+        for (int i = 0; i < 2; ++i)
+        {
+            for (GcObj* obj = lists[i]; obj; obj = obj->next)
+            {
+                ObjectMarkFn markFn = objectType(N, obj)->markFn;
+                if (markFn) markFn(N, obj + 1);
+            }
+        }
+    }
+    else
+    {
+        GcObj** remembered = (GcObj **)N->gcRemembered.start;
+        i64 numRemembered = N->gcRemembered.cursor / (i64)sizeof(GcObj*);
+        for (i64 i = 0; i < numRemembered; ++i)
+        {
+            ObjectMarkFn markFn = remembered[i] ? objectType(N, remembered[i])->markFn : 0;
+            if (markFn) markFn(N, remembered[i] + 1);
+        }
+    }
 }
 
-//----------------------------------------------------------------------------------------------------------------------{ATOM}
-//----------------------------------------------------------------------------------------------------------------------
-// A T O M   M A N A G M E N T
-//----------------------------------------------------------------------------------------------------------------------
 //----------------------------------------------------------------------------------------------------------------------
+// Move the reachable young objects out of the nursery and delete the rest.  Nothing changes until every copy has been
+// allocated, so if memory runs out the young objects are left where they are.  Returns 1 if the nursery was emptied.
 
-Atom NeMakeNil()
+static int gcMinor(Nerd N)
 {
-    Atom a = {
-        .type = AT_Nil
-    };
-    return a;
-}
-
+    if (!N->nursery.cursor) return 1;
+    if (N->gcRememberAll) gcWaitSweep(N);
+
+    // Find the survivors.
+    N->gcMode = GCM_MinorTrace;
+    N->gcYoung.cursor = 0;
+    N->gcYoungFailed = 0;
+    gcMinorRoots(N);
+    for (i64 i = 0; i < N->gcYoung.cursor / (i64)sizeof(GcObj*); ++i)
+    {
+        GcObj* obj = ((GcObj **)N->gcYoung.start)[i];
+        ObjectMarkFn markFn = objectType(N, obj)->markFn;
+        if (markFn) markFn(N, obj + 1);
+    }
+
+    // Allocate their copies, which next points to.
+    GcObj** young = (GcObj **)N->gcYoung.start;
+    i64 numYoung = N->gcYoung.cursor / (i64)sizeof(GcObj*);
+    i64 numCopies = 0;
+    if (!N->gcYoungFailed)
+    {
+        for (; numCopies < numYoung; ++numCopies)
+        {
+            GcObj* copy = (GcObj *)poolAlloc(N, sizeof(GcObj) + young[numCopies]->size);
+            if (!copy) break;
+            young[numCopies]->next = copy;
+        }
+    }
+
+    if (numCopies < numYoung || N->gcYoungFailed)
+    {
+        for (i64 i = 0; i < numCopies; ++i)
+        {
+            poolFree(N, young[i]->next, sizeof(GcObj) + young[i]->size);
+        }
+        for (i64 offset = 0; offset < N->nursery.cursor;)
+        {
+            GcObj* obj = (GcObj *)(N->nursery.start + offset);
+            obj->marked = 0;
+            obj->next = 0;
+            offset += nurseryObjectSize(obj);
+        }
+        N->gcMode = GCM_Major;
+        return 0;
+    }
+
+    // Copy them and then redirect every reference to them.
+    i64 bytes = 0;
+    for (i64 i = 0; i < numYoung; ++i)
+    {
+        GcObj* copy = young[i]->next;
+        memcpy(copy, young[i], sizeof(GcObj) + young[i]->size);
+        copy->marked = 0;
+        copy->next = N->gcObjs;
+        N->gcObjs = copy;
+        bytes += sizeof(GcObj) + copy->size;
+    }
+
+    N->gcMode = GCM_MinorForward;
+    gcMinorRoots(N);
+    for (i64 i = 0; i < numYoung; ++i)
+    {
+        ObjectMarkFn markFn = objectType(N, young[i])->markFn;
+        if (markFn) markFn(N, young[i]->next + 1);
+    }
+
+    // Delete the young objects that died.  The copies take over the survivors' resources.
+    GcObj** final = (GcObj **)N->gcFinal.start;
+    for (i64 i = 0; i < N->gcFinal.cursor / (i64)sizeof(GcObj*); ++i)
+    {
+        if (!final[i]->marked) objectDelete(N, final[i] + 1);
+    }
+
+    GcObj** remembered = (GcObj **)N->gcRemembered.start;
+    for (i64 i = 0; i < N->gcRemembered.cursor / (i64)sizeof(GcObj*); ++i)
+    {
+        if (remembered[i]) remembered[i]->remembered = 0;
+    }
+
+    // The copies are new to the incremental collector.
+    N->gcMode = GCM_Major;
+    for (i64 i = 0; i < numYoung; ++i)
+    {
+        gcAllocated(N, young[i]->next);
+    }
+
+    N->nursery.cursor = 0;
+    N->gcRemembered.cursor = 0;
+    N->gcRememberAll = 0;
+    N->gcYoung.cursor = 0;
+    N->gcFinal.cursor = 0;
+
+    NE_STAT(N, minorCollections, 1);
+    NE_STAT(N, objectsPromoted, numYoung);
+    NE_STAT(N, bytesPromoted, bytes);
+
+    // Promotion is paid for like any other allocation.
+    gcAllocate(N, bytes);
+    return 1;
+}
+
 //----------------------------------------------------------------------------------------------------------------------
+// A safe point at the end of running code.  If the nursery is at least half full, run a minor collection, keeping keep
+// (if not 0) pointing at the same object.
 
-Atom NeMakeInt(i64 i)
+static void gcSafePoint(Nerd N, Atom* keep)
 {
-    Atom a = {
-        .type = AT_Integer,
-        .i = i
-    };
-    return a;
+    if (N->runDepth || N->nursery.cursor * 2 < N->nursery.end - N->nursery.start) return;
+
+    if (keep)
+    {
+        i64 numRoots = N->roots.cursor;
+        int root = NeRootPush(N, *keep);
+        if (N->roots.cursor > numRoots)
+        {
+            gcMinor(N);
+            *keep = NeRootGet(N, root);
+            NeRootPop(N, 1);
+        }
+    }
+    else
+    {
+        gcMinor(N);
+    }
 }
 
 //----------------------------------------------------------------------------------------------------------------------
+// Move the remaining objects on the sweep list back to gcObjs.
 
-Atom NeMakeBool(int b)
+static void gcFinishSweep(Nerd N)
 {
-    Atom a = {
-        .type = AT_Boolean,
-        .i = b ? 1 : 0
-    };
-    return a;
+    if (N->gcObjs)
+    {
+        GcObj* tail = N->gcObjs;
+        while (tail->next) tail = tail->next;
+        tail->next = N->gcSweep;
+    }
+    else
+    {
+        N->gcObjs = N->gcSweep;
+    }
+
+    N->gcSweep = 0;
+    N->gcSweepLink = 0;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
+// Mark an object on a collector thread.  Another marker may be trying to mark it at the same time, so only the one
+// that changes its colour queues it.
 
-Atom NeMakeAtom(AtomType at)
+static void gcShare(Nerd N, GcMarker* m, int force);
+
+static void gcShadeParallel(Nerd N, GcObj* obj)
 {
-    Atom a = {
-        .type = at,
-    };
-    return a;
+    u8 black = N->gcBlack;
+    if (!atomicCas8(&obj->marked, !black, black) || !objectType(N, obj)->markFn) return;
+
+    GcMarker* m = gcThisMarker;
+    if (m->count == NE_GC_MARK_STACK_SIZE) gcShare(N, m, 1);
+    if (m->count < NE_GC_MARK_STACK_SIZE)
+    {
+        m->stack[m->count++] = obj;
+    }
+    else
+    {
+        // Out of memory, so it will be found by scanning every black object once marking is done.
+        N->config.threads.lock(N->gcHelpers->lock);
+        N->gcHelpers->overflow = 1;
+        N->config.threads.unlock(N->gcHelpers->lock);
+    }
 }
 
 //----------------------------------------------------------------------------------------------------------------------
+// Publish half of a marker's stack on the gray stack if another marker has run out of work, or if force is set.
 
-Atom NeMakeChar(char c)
+static void gcShare(Nerd N, GcMarker* m, int force)
 {
-    Atom a = {
-        .type = AT_Character,
-        .c = c
-    };
-    return a;
+    GcHelpers* H = N->gcHelpers;
+    const NeThreadFuncs* t = &N->config.threads;
+    t->lock(H->lock);
+    if (H->idle || force)
+    {
+        i64 n = m->count / 2;
+        GcObj** p = (GcObj **)arenaAlloc(N, &N->gcGray, n * (i64)sizeof(GcObj*));
+        if (p)
+        {
+            m->count -= n;
+            memcpy(p, m->stack + m->count, (size_t)n * sizeof(GcObj*));
+            if (H->idle) t->wakeAll(H->lock);
+        }
+    }
+    t->unlock(H->lock);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
+// Scan objects until every marker has run out of work.
 
-Atom NeMakeString(Nerd N, const char* str)
+static void gcMarkWork(Nerd N, GcMarker* m)
 {
-    return NeMakeStringRanged(N, str, str + (strlen(str)));
+    GcHelpers* H = N->gcHelpers;
+    const NeThreadFuncs* t = &N->config.threads;
+
+    for (;;)
+    {
+        i64 numScanned = 0;
+        while (m->count)
+        {
+            GcObj* obj = m->stack[--m->count];
+            objectType(N, obj)->markFn(N, obj + 1);
+            if (++numScanned % NE_GC_SHARE_BATCH == 0 && m->count > 1) gcShare(N, m, 0);
+        }
+
+        // Steal some published work, or wait for some.  Marking is done once every marker is waiting.
+        t->lock(H->lock);
+        ++H->idle;
+        while (!N->gcGray.cursor && !H->markDone)
+        {
+            if (H->idle == H->numMarkers)
+            {
+                H->markDone = 1;
+                t->wakeAll(H->lock);
+            }
+            else
+            {
+                t->wait(H->lock);
+            }
+        }
+        if (H->markDone)
+        {
+            t->unlock(H->lock);
+            return;
+        }
+
+        --H->idle;
+        i64 n = NE_MIN(N->gcGray.cursor / (i64)sizeof(GcObj*), NE_GC_SHARE_BATCH);
+        N->gcGray.cursor -= n * (i64)sizeof(GcObj*);
+        memcpy(m->stack, N->gcGray.start + N->gcGray.cursor, (size_t)n * sizeof(GcObj*));
+        m->count = n;
+        t->unlock(H->lock);
+    }
 }
 
 //----------------------------------------------------------------------------------------------------------------------
+// Empty the gray stack using all the collector threads.  It's only used under the helpers' lock until they're done.
 
-Atom NeMakeStringRanged(Nerd N, const char* start, const char* end)
+static void gcMarkParallel(Nerd N)
 {
-    Range r = { .start = start, .end = end };
-    StringObject* str = (StringObject *)NeObjectCreate(N, N->stringType, &r);
-    return NeMakeObject(N, str);
+    GcHelpers* H = N->gcHelpers;
+    const NeThreadFuncs* t = &N->config.threads;
+
+    while (N->gcGray.cursor)
+    {
+        t->lock(H->lock);
+        H->idle = 0;
+        H->markDone = 0;
+        H->overflow = 0;
+        H->markBusy = H->numMarkers - 1;
+        H->task = GCT_Mark;
+        ++H->taskId;
+        N->gcParallel = 1;
+        t->wakeAll(H->lock);
+        t->unlock(H->lock);
+
+        gcThisMarker = &H->markers[0];
+        gcMarkWork(N, &H->markers[0]);
+        gcThisMarker = 0;
+
+        t->lock(H->lock);
+        while (H->markBusy) t->wait(H->lock);
+        int overflow = H->overflow;
+        t->unlock(H->lock);
+        N->gcParallel = 0;
+
+        // There's no telling which objects were marked without being queued, so scan every black object again.
+        if (overflow)
+        {
+            for (GcObj* obj = N->gcObjs; obj; obj = obj->next)
+            {
+                ObjectMarkFn markFn = objectType(N, obj)->markFn;
+                if (markFn && obj->marked == N->gcBlack) markFn(N, obj + 1);
+            }
+        }
+    }
 }
 
 //----------------------------------------------------------------------------------------------------------------------
+// Delete the white objects on the sweep list on a helper thread.  Returns the objects that must be deleted on the
+// VM's thread instead.
 
-Atom NeMakeObject(Nerd N, void* object)
+static GcObj* gcSweepWork(Nerd N)
 {
-    Atom a = {
-        .type = AT_Object,
-        .obj = (GcObj *)object - 1
-    };
-    return a;
+    GcObj* deferred = 0;
+    GcObj** link = &N->gcSweep;
+    while (*link)
+    {
+        GcObj* obj = *link;
+        if (obj->marked == N->gcBlack)
+        {
+            link = &obj->next;
+            continue;
+        }
+
+        *link = obj->next;
+        ObjectInfo* info = objectType(N, obj);
+        if (info->flags & NOF_MutatorDelete)
+        {
+            obj->next = deferred;
+            deferred = obj;
+            continue;
+        }
+
+        if (info->deleteFn) info->deleteFn(N, obj + 1);
+#if NE_STATS
+        if (obj->type < NE_STATS_MAX_TYPES) --N->gcHelpers->stats.types[obj->type].alive;
+#endif
+        poolFree(N, obj, sizeof(GcObj) + obj->size);
+    }
+
+    return deferred;
 }
 
-//----------------------------------------------------------------------------------------------------------------------{PRINT}
-//----------------------------------------------------------------------------------------------------------------------
-// P R I N T I N G
 //----------------------------------------------------------------------------------------------------------------------
+
+static void gcHelperMain(void* arg)
+{
+    GcMarker* m = (GcMarker *)arg;
+    Nerd N = m->N;
+    GcHelpers* H = N->gcHelpers;
+    const NeThreadFuncs* t = &N->config.threads;
+    i64 taskId = 0;
+
+    gcThisMarker = m;
+    t->lock(H->lock);
+    for (;;)
+    {
+        while (H->taskId == taskId) t->wait(H->lock);
+        taskId = H->taskId;
+        if (H->task == GCT_Quit) break;
+
+        if (H->task == GCT_Mark)
+        {
+            t->unlock(H->lock);
+            gcMarkWork(N, m);
+            t->lock(H->lock);
+            if (--H->markBusy == 0) t->wakeAll(H->lock);
+        }
+        else if (H->task == GCT_Sweep)
+        {
+            // Claim the sweep so the other helpers leave it alone.
+            H->task = GCT_None;
+            t->unlock(H->lock);
+            GcObj* deferred = gcSweepWork(N);
+            t->lock(H->lock);
+            H->deferred = deferred;
+            H->sweepBusy = 0;
+            t->wakeAll(H->lock);
+        }
+    }
+    t->unlock(H->lock);
+    gcThisMarker = 0;
+}
+
 //----------------------------------------------------------------------------------------------------------------------
+// Hand the sweep list to a helper.  The VM doesn't touch the list again until gcSweepFinish.
 
-#define NE_IS_WHITESPACE(c) (' ' == (c) || '\t' == (c) || '\n' == (c))
-#define NE_IS_CLOSE_PAREN(c) (')' == (c) || ']' == (c) || '}' == (c))
-#define NE_IS_TERMCHAR(c) (NE_IS_WHITESPACE(c) || NE_IS_CLOSE_PAREN(c) || ':' == (c) || '\\' == (c) || 0 == (c))
+static void gcSweepStart(Nerd N)
+{
+    GcHelpers* H = N->gcHelpers;
+    const NeThreadFuncs* t = &N->config.threads;
+
+    // Only the VM's thread can change the remembered set, so remove the objects that are about to die from it now.
+    GcObj** remembered = (GcObj **)N->gcRemembered.start;
+    for (i64 i = 0; i < N->gcRemembered.cursor / (i64)sizeof(GcObj*); ++i)
+    {
+        if (remembered[i] && remembered[i]->marked != N->gcBlack)
+        {
+            remembered[i]->remembered = 0;
+            remembered[i] = 0;
+        }
+    }
+
+    t->lock(H->lock);
+    H->sweepBusy = 1;
+    H->task = GCT_Sweep;
+    ++H->taskId;
+    t->wakeAll(H->lock);
+    t->unlock(H->lock);
+}
 
 //----------------------------------------------------------------------------------------------------------------------
-// This table defines the character tokens that are understood
-static struct { const char* name; char ch; } gCharMap[] =
+
+#if NE_STATS
+
+static void gcAddStats(NeStats* stats, NeStats* add)
 {
-    { "5\\space", ' ' },
-    { "9\\backspace", '\b' },
-    { "3\\tab", '\t' },
-    { "7\\newline", '\n' },
-    { "6\\return", '\r' },
-    { "4\\bell", '\a' },
-    { "3\\esc", '\033' },
-    { 0, 0 }
-};
+    stats->numAllocs += add->numAllocs;
+    stats->numReallocs += add->numReallocs;
+    stats->numFrees += add->numFrees;
+    stats->bytesAllocated += add->bytesAllocated;
+    stats->bytesFreed += add->bytesFreed;
+    stats->bytesInUse += add->bytesInUse;
+    for (int i = 0; i < NE_STATS_MAX_TYPES; ++i) stats->types[i].alive += add->types[i].alive;
+    memset(add, 0, sizeof(*add));
+}
+
+#endif
 
 //----------------------------------------------------------------------------------------------------------------------
+// Finish a concurrent sweep.  If wait is 0 and the helper is still sweeping, returns 0, otherwise returns 1 once the
+// cycle is complete.
 
-NeString NeToString(Nerd N, Atom value, NeStringMode mode)
+static int gcSweepFinish(Nerd N, int wait)
 {
-    assert(N);
-    assert(mode == NSM_Normal || mode == NSM_REPL || mode == NSM_Code);
+    GcHelpers* H = N->gcHelpers;
+    const NeThreadFuncs* t = &N->config.threads;
 
-    NeString p = 0;
-    p = scratchStart(N);
+    t->lock(H->lock);
+    if (H->sweepBusy && !wait)
+    {
+        t->unlock(H->lock);
+        return 0;
+    }
+    while (H->sweepBusy) t->wait(H->lock);
+    GcObj* deferred = H->deferred;
+    H->deferred = 0;
+#if NE_STATS
+    gcAddStats(&N->stats, &H->stats);
+#endif
+    t->unlock(H->lock);
 
-    switch (value.type)
+    gcFinishSweep(N);
+    while (deferred)
     {
-    case AT_Nil:
-        NeScratchFormat(N, "nil");
-        break;
+        GcObj* next = deferred->next;
+        objectDelete(N, deferred + 1);
+        deferred = next;
+    }
 
-    case AT_Integer:
-        NeScratchFormat(N, "%lli", value.i);
-        break;
+    N->gcState = GC_Idle;
+    N->gcDebt = 0;
+    return 1;
+}
 
-    case AT_Boolean:
-        NeScratchFormat(N, "%s", value.i ? "yes" : "no");
-        break;
+//----------------------------------------------------------------------------------------------------------------------
+// Wait for a concurrent sweep to finish, for when the VM needs the sweep list or the object types.
 
-    case AT_Character:
+static void gcWaitSweep(Nerd N)
+{
+    if (N->gcHelpers && N->gcState == GC_Sweep) gcSweepFinish(N, 1);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static void gcHelpersClose(Nerd N)
+{
+    GcHelpers* H = N->gcHelpers;
+    if (!H) return;
+
+    const NeThreadFuncs* t = &N->config.threads;
+    if (H->lock)
+    {
+        t->lock(H->lock);
+        H->task = GCT_Quit;
+        ++H->taskId;
+        t->wakeAll(H->lock);
+        t->unlock(H->lock);
+        for (int i = 1; i < H->numMarkers; ++i) t->joinThread(H->markers[i].thread);
+        t->destroyLock(H->lock);
+    }
+
+    if (H->markers)
+    {
+        for (int i = 0; i <= N->config.gcThreads; ++i)
         {
-            int done = 0;
-            char c = value.c;
+            NeFree(N, H->markers[i].stack, sizeof(GcObj*) * NE_GC_MARK_STACK_SIZE);
+        }
+        NeFree(N, H->markers, sizeof(GcMarker) * (N->config.gcThreads + 1));
+    }
+    NeFree(N, H, sizeof(GcHelpers));
+    N->gcHelpers = 0;
+}
 
-            if (NSM_Normal != mode)
+//----------------------------------------------------------------------------------------------------------------------
+// Start the collector threads, if the configuration asks for them and the thread functions are set.  Without them,
+// the VM collects on its own.
+
+static void gcHelpersOpen(Nerd N)
+{
+    const NeThreadFuncs* t = &N->config.threads;
+    int numThreads = N->config.gcThreads;
+    N->gcHelpers = 0;
+    if (numThreads <= 0 || !t->createThread || !t->createLock) return;
+
+    GcHelpers* H = (GcHelpers *)NeAlloc(N, sizeof(GcHelpers));
+    if (!H) return;
+    memset(H, 0, sizeof(*H));
+    N->gcHelpers = H;
+
+    int ok = (H->lock = t->createLock()) != 0;
+    ok = ok && (H->markers = (GcMarker *)NeAlloc(N, sizeof(GcMarker) * (numThreads + 1))) != 0;
+    if (H->markers) memset(H->markers, 0, sizeof(GcMarker) * (numThreads + 1));
+    for (int i = 0; ok && i <= numThreads; ++i)
+    {
+        GcMarker* m = &H->markers[i];
+        m->N = N;
+        m->helper = i > 0;
+        ok = (m->stack = (GcObj **)NeAlloc(N, sizeof(GcObj*) * NE_GC_MARK_STACK_SIZE)) != 0;
+    }
+
+    H->numMarkers = 1;
+    for (int i = 1; ok && i <= numThreads; ++i)
+    {
+        if (!(H->markers[i].thread = t->createThread(&gcHelperMain, &H->markers[i]))) break;
+        ++H->numMarkers;
+    }
+
+    if (H->numMarkers == 1) gcHelpersClose(N);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Do at most budget objects worth of work.  Returns 1 if the cycle completed.
+
+static int gcStep(Nerd N, i64 budget)
+{
+    if (N->gcState == GC_Idle)
+    {
+        // Every object is black or white, so this makes them all white.
+        N->gcBlack = !N->gcBlack;
+        N->gcState = GC_Mark;
+        N->gcGrayFailed = 0;
+        gcMarkRoots(N);
+    }
+
+    while (budget > 0)
+    {
+        if (N->gcState == GC_Mark)
+        {
+            if (N->gcGray.cursor == 0)
             {
-                NeScratchFormat(N, "\\");
+                // The root stack isn't protected by the write barrier, so rescan it before finishing marking.
+                gcMarkRoots(N);
 
-                // Check for long name version.
-                if (c <= ' ' || c > 126)
+                // Scanning may queue more objects, or fail to again, but each failure means another object is black.
+                if (N->gcGray.cursor == 0 && N->gcGrayFailed)
                 {
-                    int i = 0;
-                    for (; gCharMap[i].name; ++i)
-                    {
-                        if (c == gCharMap[i].ch)
-                        {
-                            NeScratchFormat(N, "%s", gCharMap[i].name + 2);
-                            done = 1;
-                            break;
-                        }
-                    }
-                    if (!done && !gCharMap[i].name)
+                    N->gcGrayFailed = 0;
+                    for (GcObj* obj = N->gcObjs; obj; obj = obj->next)
                     {
-                        // Unknown characters, so show hex version.
-                        NeScratchFormat(N, "#x%02x", (int)c);
-                        done = 1;
+                        ObjectMarkFn markFn = objectType(N, obj)->markFn;
+                        if (markFn && obj->marked == N->gcBlack) markFn(N, obj + 1);
                     }
+                    continue;
                 }
 
-            }
-
-            if (!done)
-            {
-                if (NE_IS_WHITESPACE(c) || '\r' == c || '\b' == c || '\033' == c ||
-                    (c > ' ' && c < 127))
-                {
-                    NeScratchAdd(N, &c, &c + 1);
-                }
-                else
+                if (N->gcGray.cursor == 0)
                 {
-                    NeScratchFormat(N, "?");
+                    N->gcSweep = N->gcObjs;
+                    N->gcSweepLink = &N->gcSweep;
+                    N->gcObjs = 0;
+                    N->gcState = GC_Sweep;
+                    if (N->gcHelpers) gcSweepStart(N);
                 }
+                continue;
             }
-        }
-        break;
 
-    case AT_Object:
-        {
-            ObjectInfo* info = objectType(N, value.obj);
-            if (info->toStringFn)
+            if (N->gcHelpers && budget == INT64_MAX)
             {
-                info->toStringFn(N, value.obj + 1, mode);
+                gcMarkParallel(N);
+                continue;
+            }
+
+            N->gcGray.cursor -= sizeof(GcObj*);
+            GcObj* obj = *(GcObj **)(N->gcGray.start + N->gcGray.cursor);
+            objectType(N, obj)->markFn(N, obj + 1);
+            --budget;
+        }
+        else if (N->gcHelpers)
+        {
+            return gcSweepFinish(N, budget == INT64_MAX);
+        }
+        else
+        {
+            GcObj* obj = *N->gcSweepLink;
+            if (!obj)
+            {
+                gcFinishSweep(N);
+                N->gcState = GC_Idle;
+                N->gcDebt = 0;
+                return 1;
+            }
+
+            if (obj->marked == N->gcBlack)
+            {
+                N->gcSweepLink = &obj->next;
             }
             else
             {
-                NeScratchAddChar(N, '<');
-                if (info->name)
+                *N->gcSweepLink = obj->next;
+                objectDelete(N, obj + 1);
+            }
+            --budget;
+        }
+    }
+
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Called before an object is allocated.  This is where the collector gets to run.
+
+static void gcAllocate(Nerd N, i64 bytes)
+{
+    N->gcDebt += bytes;
+    if (N->gcState != GC_Idle || N->gcDebt > N->config.gcThreshold)
+    {
+        if (N->config.gcStepBudget > 0)
+        {
+            gcStep(N, N->config.gcStepBudget);
+        }
+        else
+        {
+            while (!gcStep(N, INT64_MAX));
+        }
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Called when a new object has been added to gcObjs.
+
+static void gcAllocated(Nerd N, GcObj* obj)
+{
+    if (N->gcState == GC_Mark)
+    {
+        // Allocate gray so that anything the object was initialised with is still marked.
+        obj->marked = !N->gcBlack;
+        gcShade(N, obj);
+    }
+    else
+    {
+        // Black, so that the object is white once the next cycle starts.
+        obj->marked = N->gcBlack;
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+int NeGarbageStep(Nerd N)
+{
+    if (!N->runDepth) gcMinor(N);
+    return gcStep(N, N->config.gcStepBudget > 0 ? N->config.gcStepBudget : INT64_MAX);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+void NeGarbageCollect(Nerd N)
+{
+    if (!N->runDepth) gcMinor(N);
+
+    // Finish the current cycle because anything allocated during it may have been considered reachable.
+    if (N->gcState != GC_Idle)
+    {
+        while (!gcStep(N, INT64_MAX));
+    }
+    while (!gcStep(N, INT64_MAX));
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+int NeRootPush(Nerd N, Atom a)
+{
+    int index = (int)(N->roots.cursor / sizeof(Atom));
+    Atom* root = (Atom *)arenaAlloc(N, &N->roots, sizeof(Atom));
+    if (root) *root = a;
+    return index;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+Atom NeRootGet(Nerd N, int index)
+{
+    assert(index >= 0 && index < (int)(N->roots.cursor / sizeof(Atom)));
+    return ((Atom *)N->roots.start)[index];
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+void NeRootPop(Nerd N, int count)
+{
+    assert(count >= 0 && count <= (int)(N->roots.cursor / sizeof(Atom)));
+    N->roots.cursor -= count * sizeof(Atom);
+}
+
+//----------------------------------------------------------------------------------------------------------------------{STRINGS}
+//----------------------------------------------------------------------------------------------------------------------
+// S T R I N G S
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------------------------------------------------
+// Strings shorter than NE_STRING_INLINE_MAX characters are stored inside the object itself, overlapping the pointer
+// and extending into extra bytes allocated with the object.  This keeps a short string and its header in a single
+// 64-byte block.  Longer strings have their characters allocated separately, or point into the characters of an
+// owner object (such as a mapped source file) which must be kept alive, or refer to shared characters.  Only strings
+// that own or share their characters are null-terminated.
+//
+// Shared characters are allocated with the memory function but not against any VM, so they can outlive the VM that
+// created them.  They are never changed once created, so only the reference count needs to be atomic.
+
+#define NE_STRING_INLINE_MAX    40
+
+struct _NeShared
+{
+    volatile i64 refCount;
+    i64 size;                           // Length of the string, excluding the null terminator.
+    char* chars;                        // Either points to the characters following this structure or to an adopted
+                                        // buffer.
+    NeMemoryFunc memoryFunc;            // Used to free the characters.
+};
+
+typedef struct  
+{
+    i64 size;                           // Length of the string, excluding the null terminator.
+    union {
+        struct {
+            char* str;                  // Characters of a long string.
+            GcObj* owner;               // Object that owns the characters, or 0 if the string owns them.
+            NeShared shared;            // Shared characters, or 0 if the string owns them.
+        };
+        char chars[sizeof(char*)];      // Characters of a short string (may extend past the end of the structure).
+    };
+}
+StringObject;
+
+typedef struct  
+{
+    const char* start;
+    const char* end;
+}
+Range;
+
+typedef struct
+{
+    Range range;                        // Source characters, with escape codes.
+    i64 size;                           // Length of the string after escape codes are decoded.
+    GcObj* owner;                       // If not 0, the string refers to the range instead of copying it.
+    NeShared shared;                    // If not 0, the string takes a reference to these characters.
+    int raw;                            // Non-zero if the range has no escape codes to decode.
+}
+StringInit;
+
+//----------------------------------------------------------------------------------------------------------------------
+// Create shared characters with a reference count of 1.  If buffer is 0 the characters are allocated with the
+// structure and must be filled in by the caller, otherwise the buffer is adopted.
+
+static NeShared sharedCreate(Nerd N, char* buffer, i64 size)
+{
+    NeMemoryFunc memoryFunc = N->config.memoryFunc;
+    NeShared shared = (NeShared)memoryFunc(0, 0, 0, sizeof(struct _NeShared) + (buffer ? 0 : size + 1));
+    if (shared)
+    {
+        shared->refCount = 1;
+        shared->size = size;
+        shared->chars = buffer ? buffer : (char *)(shared + 1);
+        shared->memoryFunc = memoryFunc;
+        shared->chars[size] = 0;
+    }
+
+    return shared;
+}
+
+static NeShared sharedAcquire(NeShared shared)
+{
+    atomicInc(&shared->refCount);
+    return shared;
+}
+
+void NeSharedRelease(NeShared shared)
+{
+    if (shared && atomicDec(&shared->refCount) == 0)
+    {
+        int adopted = shared->chars != (char *)(shared + 1);
+        if (adopted) shared->memoryFunc(0, shared->chars, shared->size + 1, 0);
+        shared->memoryFunc(0, shared, sizeof(struct _NeShared) + (adopted ? 0 : shared->size + 1), 0);
+    }
+}
+
+const char* NeSharedChars(NeShared shared, i64* outSize)
+{
+    assert(shared);
+    if (outSize) *outSize = shared->size;
+    return shared->chars;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static int stringIsInline(i64 size)
+{
+    return size < NE_STRING_INLINE_MAX;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static char* stringChars(StringObject* str)
+{
+    return stringIsInline(str->size) ? str->chars : str->str;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Calculate the length of a string once its escape codes are decoded.
+
+static i64 stringDecodedSize(const char* start, const char* end)
+{
+    i64 len = 0;
+    for (const char* s = start; s < end; ++s)
+    {
+        if (*s == '\\')
+        {
+            if (++s < end) ++len;
+        }
+        else
+        {
+            ++len;
+        }
+    }
+
+    return len;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static int stringCreate(Nerd N, void* obj, const void* data)
+{
+    StringObject* str = (StringObject *)obj;
+    const StringInit* init = (const StringInit *)data;
+    const char* start = init->range.start;
+    int strLen = (int)(init->range.end - start);
+
+    str->size = init->size;
+    char* dest = str->chars;
+    if (init->shared && !stringIsInline(init->size))
+    {
+        str->str = init->shared->chars;
+        str->owner = 0;
+        str->shared = sharedAcquire(init->shared);
+        return 1;
+    }
+    else if (init->owner)
+    {
+        // The range has no escape codes and outlives the string, so refer to it directly.
+        assert(init->size == strLen && !stringIsInline(init->size));
+        str->str = (char *)start;
+        str->owner = init->owner;
+        str->shared = 0;
+        return 1;
+    }
+    else if (!stringIsInline(str->size))
+    {
+        dest = str->str = (char *)poolAlloc(N, str->size + 1);
+        if (!dest) return 0;
+        str->owner = 0;
+        str->shared = 0;
+    }
+
+    if (init->raw)
+    {
+        memcpy(dest, start, (size_t)strLen);
+        dest[strLen] = 0;
+        return 1;
+    }
+
+    int j = 0;
+    for (int i = 0; i < strLen; ++i)
+    {
+        if (start[i] == '\\')
+        {
+            ++i;
+            if (i < strLen)
+            {
+                switch (start[i])
+                {
+                case 'n': dest[j++] = '\n'; break;
+                case 'r': dest[j++] = '\r'; break;
+                case 't': dest[j++] = '\t'; break;
+                case 'b': dest[j++] = '\b'; break;
+                default:  dest[j++] = start[i]; break;
+                }
+            }
+        }
+        else
+        {
+            dest[j++] = start[i];
+        }
+    }
+    assert(j == str->size);
+    dest[str->size] = 0;
+    return 1;
+}
+
+static void stringDelete(Nerd N, void* obj)
+{
+    StringObject* str = (StringObject *)obj;
+    if (stringIsInline(str->size) || str->owner) return;
+
+    if (str->shared)
+    {
+        NeSharedRelease(str->shared);
+    }
+    else
+    {
+        poolFree(N, str->str, str->size + 1);
+    }
+}
+
+static void stringMark(Nerd N, void* obj)
+{
+    StringObject* str = (StringObject *)obj;
+    if (!stringIsInline(str->size) && str->owner)
+    {
+        gcShade(N, str->owner);
+    }
+}
+
+// Long strings share their characters with the original, which is given shared characters first if necessary.  That
+// way cloning again is free, and the original no longer needs its owner.
+
+static int stringClone(Nerd N, void* obj, Nerd from, void* original)
+{
+    StringObject* str = (StringObject *)obj;
+    if (stringIsInline(str->size)) return 1;
+
+    NeShared shared = NeStringShare(from, NeMakeObject(from, original));
+    if (!shared) return 0;
+    str->str = shared->chars;
+    str->owner = 0;
+    str->shared = shared;
+    return 1;
+}
+
+static void stringToString(Nerd N, void* obj, NeStringMode mode)
+{
+    StringObject* str = (StringObject *)obj;
+    const char* chars = stringChars(str);
+
+    if (mode == NSM_Normal)
+    {
+        NeScratchAdd(N, chars, chars + str->size);
+    }
+    else
+    {
+        NeScratchFormat(N, "\"");
+        for (int i = 0; i < str->size; ++i)
+        {
+            switch (chars[i])
+            {
+            case '\n': NeScratchFormat(N, "\\n"); break;
+            case '\r': NeScratchFormat(N, "\\r"); break;
+            case '\t': NeScratchFormat(N, "\\t"); break;
+            case '\b': NeScratchFormat(N, "\\b"); break;
+
+            default:
+                NeScratchAddChar(N, chars[i]);
+            }
+        }
+        NeScratchFormat(N, "\"");
+    }
+}
+
+static int registerStringType(Nerd N)
+{
+    ObjectInfo strObjectInfo = {
+        .name = "string",
+        .createFn = &stringCreate,
+        .deleteFn = &stringDelete,
+        .evalFn = 0,
+        .toStringFn = &stringToString,
+        .markFn = &stringMark,
+        .cloneFn = &stringClone,
+        .size = sizeof(StringObject),
+        .flags = NOF_Movable
+    };
+    return NeObjectRegister(N, &strObjectInfo);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Create a string atom from an initialiser.  If owner is not 0, it owns the characters, and a long string with no
+// escape codes will refer to them rather than make a copy.  The initialiser's owner is ignored.
+
+static Atom stringMakeInit(Nerd N, StringInit init, GcObj* owner)
+{
+    const char* start = init.range.start;
+    const char* end = init.range.end;
+
+    // Short strings need room for their characters and terminator after the start of the union.
+    i64 extraBytes = 0;
+    if (stringIsInline(init.size))
+    {
+        extraBytes = NE_MAX((i64)offsetof(StringObject, chars) + init.size + 1 - (i64)sizeof(StringObject), 0);
+    }
+    else if (init.size == (i64)(end - start))
+    {
+        init.owner = owner;
+    }
+
+    StringObject* str = (StringObject *)NeObjectCreateSized(N, N->stringType, extraBytes, &init);
+    return str ? NeMakeObject(N, str) : NeMakeNil();
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Create a string atom from source characters with escape codes.  If owner is not 0, it owns the characters.
+
+static Atom stringMake(Nerd N, const char* start, const char* end, GcObj* owner)
+{
+    StringInit init = { .range = { .start = start, .end = end }, .size = stringDecodedSize(start, end), .raw = 0 };
+    return stringMakeInit(N, init, owner);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Create a string atom from characters that have already been decoded.
+
+static Atom stringMakeRaw(Nerd N, const char* start, const char* end, GcObj* owner)
+{
+    StringInit init = { .range = { .start = start, .end = end }, .size = (i64)(end - start), .raw = 1 };
+    return stringMakeInit(N, init, owner);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Create a string atom that refers to shared characters.  Short strings copy them instead.
+
+static Atom stringMakeShared(Nerd N, NeShared shared)
+{
+    StringInit init = {
+        .range = { .start = shared->chars, .end = shared->chars + shared->size },
+        .size = shared->size,
+        .shared = shared,
+        .raw = 1
+    };
+    return stringMakeInit(N, init, 0);
+}
+
+//----------------------------------------------------------------------------------------------------------------------{SOURCES}
+//----------------------------------------------------------------------------------------------------------------------
+// S O U R C E S
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------------------------------------------------
+// A source object owns a file mapped by the configuration's mapFileFunc.  Strings read from the file refer to it, so
+// the mapping is released once the last of them is collected.
+
+typedef struct
+{
+    const char* data;                   // Start of the mapped file.
+    i64 size;                           // Size of the file in bytes.
+    void* handle;                       // Handle returned by mapFileFunc.
+}
+SourceObject;
+
+typedef struct
+{
+    const char* path;
+}
+SourceInit;
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static int sourceCreate(Nerd N, void* obj, const void* data)
+{
+    SourceObject* src = (SourceObject *)obj;
+    const SourceInit* init = (const SourceInit *)data;
+
+    if (!N->config.mapFileFunc) return 0;
+    src->data = N->config.mapFileFunc(N, init->path, &src->size, &src->handle);
+    return src->data ? 1 : 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static void sourceDelete(Nerd N, void* obj)
+{
+    SourceObject* src = (SourceObject *)obj;
+    if (src->data && N->config.unmapFileFunc)
+    {
+        N->config.unmapFileFunc(N, src->data, src->size, src->handle);
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// A copy of a source doesn't map the file again.  Strings and code that referred to it have their own characters and
+// byte-code in the clone, so it has nothing to own.
+
+static int sourceClone(Nerd N, void* obj, Nerd from, void* original)
+{
+    SourceObject* src = (SourceObject *)obj;
+    src->data = 0;
+    src->size = 0;
+    src->handle = 0;
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static int registerSourceType(Nerd N)
+{
+    ObjectInfo srcObjectInfo = {
+        .name = "source",
+        .createFn = &sourceCreate,
+        .deleteFn = &sourceDelete,
+        .evalFn = 0,
+        .toStringFn = 0,
+        .markFn = 0,
+        .cloneFn = &sourceClone,
+        .size = sizeof(SourceObject)
+    };
+    return NeObjectRegister(N, &srcObjectInfo);
+}
+
+//----------------------------------------------------------------------------------------------------------------------{SYMBOLS}
+//----------------------------------------------------------------------------------------------------------------------
+// S Y M B O L S
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------------------------------------------------
+// Symbols are interned, so two symbols with the same name are the same object and can be compared by pointer.  The
+// name follows the structure in the object's extra bytes.
+
+typedef struct _SymbolObject
+{
+    u64 hash;                           // FNV-1a hash of the name, as calculated by the lexer.
+    i64 size;                           // Length of the name.
+    int bound;                          // Non-zero if value has been set.
+    Atom value;                         // Global value bound to this symbol.
+}
+SymbolObject;
+
+typedef struct
+{
+    Range range;                        // The name of the symbol.
+    u64 hash;                           // Hash of the name.
+}
+SymbolInit;
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static char* symbolName(SymbolObject* sym)
+{
+    return (char *)(sym + 1);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static int symbolCreate(Nerd N, void* obj, const void* data)
+{
+    SymbolObject* sym = (SymbolObject *)obj;
+    const SymbolInit* init = (const SymbolInit *)data;
+
+    sym->hash = init->hash;
+    sym->size = (i64)(init->range.end - init->range.start);
+    sym->bound = 0;
+    sym->value = NeMakeNil();
+    memcpy(symbolName(sym), init->range.start, (size_t)sym->size);
+    symbolName(sym)[sym->size] = 0;
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static int symbolValue(Nerd N, SymbolObject* sym, Atom* outResult)
+{
+    if (sym->bound)
+    {
+        *outResult = sym->value;
+        return 1;
+    }
+    else
+    {
+        NeOut(N, "EVAL ERROR: Undefined symbol '%s'.\n", symbolName(sym));
+        *outResult = NeMakeNil();
+        return 0;
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static int symbolEval(Nerd N, Atom a, void* obj, Atom* outResult)
+{
+    return symbolValue(N, (SymbolObject *)obj, outResult);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static void symbolToString(Nerd N, void* obj, NeStringMode mode)
+{
+    SymbolObject* sym = (SymbolObject *)obj;
+    NeScratchAdd(N, symbolName(sym), symbolName(sym) + sym->size);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static void symbolMark(Nerd N, void* obj)
+{
+    SymbolObject* sym = (SymbolObject *)obj;
+    NeMarkAtom(N, &sym->value);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static int registerSymbolType(Nerd N)
+{
+    ObjectInfo symObjectInfo = {
+        .name = "symbol",
+        .createFn = &symbolCreate,
+        .deleteFn = 0,
+        .evalFn = &symbolEval,
+        .toStringFn = &symbolToString,
+        .markFn = &symbolMark,
+        .size = sizeof(SymbolObject)
+    };
+    return NeObjectRegister(N, &symObjectInfo);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Look up an interned symbol from its name and the name's hash.  This never allocates.  Returns 0 if the symbol
+// hasn't been interned.
+
+static SymbolObject* symbolFind(Nerd N, u64 h, const char* start, const char* end)
+{
+    if (N->symbolCapacity == 0) return 0;
+
+    i64 size = (i64)(end - start);
+    i64 mask = N->symbolCapacity - 1;
+
+    for (i64 i = (i64)(h & mask);; i = (i + 1) & mask)
+    {
+        SymbolSlot* slot = &N->symbols[i];
+        if (!slot->symbol) return 0;
+        if (slot->hash == h && slot->symbol->size == size &&
+            memcmp(symbolName(slot->symbol), start, (size_t)size) == 0)
+        {
+            return slot->symbol;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Insert a symbol into the table.  There must be at least one free slot.
+
+static void symbolInsert(SymbolSlot* slots, i64 capacity, u64 h, SymbolObject* sym)
+{
+    i64 mask = capacity - 1;
+    i64 i = (i64)(h & mask);
+    while (slots[i].symbol) i = (i + 1) & mask;
+    slots[i].hash = h;
+    slots[i].symbol = sym;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Double the size of the symbol table, or give it its first slots if NeOpen couldn't.  The cached hashes mean names
+// are never rehashed.
+
+static int symbolGrow(Nerd N)
+{
+    i64 newCapacity = NE_MAX(N->symbolCapacity * 2, 256);
+    SymbolSlot* newSlots = (SymbolSlot *)NeAlloc(N, sizeof(SymbolSlot) * newCapacity);
+    if (!newSlots) return 0;
+    memset(newSlots, 0, sizeof(SymbolSlot) * newCapacity);
+
+    for (i64 i = 0; i < N->symbolCapacity; ++i)
+    {
+        if (N->symbols[i].symbol)
+        {
+            symbolInsert(newSlots, newCapacity, N->symbols[i].hash, N->symbols[i].symbol);
+        }
+    }
+
+    NeFree(N, N->symbols, sizeof(SymbolSlot) * N->symbolCapacity);
+    N->symbols = newSlots;
+    N->symbolCapacity = newCapacity;
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Return the symbol for a name, creating it if it doesn't exist yet.
+
+static SymbolObject* symbolIntern(Nerd N, u64 h, const char* start, const char* end)
+{
+    SymbolObject* sym = symbolFind(N, h, start, end);
+    if (!sym)
+    {
+        // Keep the load factor under 75%.
+        if ((N->symbolCount + 1) * 4 > N->symbolCapacity * 3)
+        {
+            if (!symbolGrow(N)) return 0;
+        }
+
+        SymbolInit init = { .range = { .start = start, .end = end }, .hash = h };
+        sym = (SymbolObject *)NeObjectCreateSized(N, N->symbolType, (i64)(end - start) + 1, &init);
+        if (sym)
+        {
+            symbolInsert(N->symbols, N->symbolCapacity, h, sym);
+            ++N->symbolCount;
+        }
+    }
+
+    return sym;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static int symbolInit(Nerd N)
+{
+    N->symbolCapacity = 256;
+    N->symbolCount = 0;
+    N->symbols = (SymbolSlot *)NeAlloc(N, sizeof(SymbolSlot) * N->symbolCapacity);
+    if (N->symbols)
+    {
+        memset(N->symbols, 0, sizeof(SymbolSlot) * N->symbolCapacity);
+    }
+    else
+    {
+        // Leave the table empty; the first symbol interned will try to allocate it again.
+        N->symbolCapacity = 0;
+    }
+    return registerSymbolType(N);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static void symbolDone(Nerd N)
+{
+    NeFree(N, N->symbols, sizeof(SymbolSlot) * N->symbolCapacity);
+    N->symbols = 0;
+    N->symbolCapacity = 0;
+    N->symbolCount = 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+void NeSymbolBind(Nerd N, Atom symbol, Atom value)
+{
+    assert(NE_ATOM_TYPE(symbol) == AT_Object && NE_ATOM_OBJ(symbol)->type == (u32)N->symbolType);
+    SymbolObject* sym = (SymbolObject *)(NE_ATOM_OBJ(symbol) + 1);
+    NeWriteBarrier(N, sym, value);
+    sym->value = value;
+    sym->bound = 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------{VECTORS}
+//----------------------------------------------------------------------------------------------------------------------
+// V E C T O R S
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------------------------------------------------
+// A vector's atoms are kept in a separate buffer that grows geometrically by the configuration's arena growth factor,
+// so pushing is amortised O(1).  The buffer comes from the pools, so small vectors are cheap.
+
+typedef struct
+{
+    Atom* atoms;
+    i64 size;                           // Number of atoms in the vector.
+    i64 capacity;                       // Number of atoms the buffer can hold.
+}
+VectorObject;
+
+static void atomToString(Nerd N, Atom value, NeStringMode mode);
+
+//----------------------------------------------------------------------------------------------------------------------
+// Start and end printing the contents of a vector or table.  Returns 1 or 0 if it's nested too deeply or it's already
+// being printed by an outer call, so cycles are cut short the first time round.  Either way "..." is printed instead.
+
+static int printEnter(Nerd N, const void* obj)
+{
+    int found = 0;
+    for (int i = 0; !found && i < N->printDepth; ++i) found = N->printing[i] == obj;
+
+    if (found || N->printDepth >= NE_PRINT_MAX_DEPTH)
+    {
+        NeScratchFormat(N, "...");
+        return 0;
+    }
+
+    N->printing[N->printDepth++] = obj;
+    return 1;
+}
+
+static void printLeave(Nerd N)
+{
+    --N->printDepth;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static int vectorCreate(Nerd N, void* obj, const void* data)
+{
+    VectorObject* vec = (VectorObject *)obj;
+    i64 capacity = *(const i64 *)data;
+    vec->size = 0;
+    vec->capacity = capacity;
+    vec->atoms = capacity ? (Atom *)poolAlloc(N, capacity * (i64)sizeof(Atom)) : 0;
+    return !capacity || vec->atoms;
+}
+
+static void vectorDelete(Nerd N, void* obj)
+{
+    VectorObject* vec = (VectorObject *)obj;
+    if (vec->atoms) poolFree(N, vec->atoms, vec->capacity * (i64)sizeof(Atom));
+}
+
+static void vectorMark(Nerd N, void* obj)
+{
+    VectorObject* vec = (VectorObject *)obj;
+    for (i64 i = 0; i < vec->size; ++i) NeMarkAtom(N, &vec->atoms[i]);
+}
+
+static int vectorClone(Nerd N, void* obj, Nerd from, void* original)
+{
+    VectorObject* vec = (VectorObject *)obj;
+    vec->atoms = (Atom *)poolClone(N, vec->atoms, vec->capacity * (i64)sizeof(Atom));
+    return !vec->capacity || vec->atoms;
+}
+
+static void vectorToString(Nerd N, void* obj, NeStringMode mode)
+{
+    VectorObject* vec = (VectorObject *)obj;
+    NeStringMode elementMode = mode == NSM_Normal ? NSM_REPL : mode;
+
+    NeScratchAddChar(N, '[');
+    if (printEnter(N, obj))
+    {
+        for (i64 i = 0; i < vec->size; ++i)
+        {
+            if (i) NeScratchAddChar(N, ' ');
+            atomToString(N, vec->atoms[i], elementMode);
+        }
+        printLeave(N);
+    }
+    NeScratchAddChar(N, ']');
+}
+
+static int registerVectorType(Nerd N)
+{
+    ObjectInfo vectorObjectInfo = {
+        .name = "vector",
+        .createFn = &vectorCreate,
+        .deleteFn = &vectorDelete,
+        .evalFn = 0,
+        .toStringFn = &vectorToString,
+        .markFn = &vectorMark,
+        .cloneFn = &vectorClone,
+        .size = sizeof(VectorObject),
+        .flags = NOF_Movable
+    };
+    return NeObjectRegister(N, &vectorObjectInfo);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static VectorObject* vectorGet(Nerd N, Atom a)
+{
+    assert(NeIsVector(N, a));
+    return (VectorObject *)(NE_ATOM_OBJ(a) + 1);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+Atom NeMakeVector(Nerd N, i64 capacity)
+{
+    assert(capacity >= 0);
+    VectorObject* vec = (VectorObject *)NeObjectCreate(N, N->vectorType, &capacity);
+    return vec ? NeMakeObject(N, vec) : NeMakeNil();
+}
+
+int NeIsVector(Nerd N, Atom a)
+{
+    return NE_ATOM_TYPE(a) == AT_Object && NE_ATOM_OBJ(a)->type == (u32)N->vectorType;
+}
+
+i64 NeVectorSize(Nerd N, Atom vector)
+{
+    return vectorGet(N, vector)->size;
+}
+
+Atom NeVectorGet(Nerd N, Atom vector, i64 index)
+{
+    VectorObject* vec = vectorGet(N, vector);
+    assert(index >= 0 && index < vec->size);
+    return vec->atoms[index];
+}
+
+void NeVectorSet(Nerd N, Atom vector, i64 index, Atom value)
+{
+    VectorObject* vec = vectorGet(N, vector);
+    assert(index >= 0 && index < vec->size);
+    NeWriteBarrier(N, vec, value);
+    vec->atoms[index] = value;
+}
+
+int NeVectorPush(Nerd N, Atom vector, Atom value)
+{
+    VectorObject* vec = vectorGet(N, vector);
+    if (vec->size == vec->capacity)
+    {
+        i64 capacity = NE_MAX((i64)((double)vec->capacity * N->config.arenaGrowth), NE_MAX(vec->capacity + 1, 8));
+        Atom* atoms = (Atom *)poolAlloc(N, capacity * (i64)sizeof(Atom));
+        if (!atoms) return 0;
+        if (vec->atoms)
+        {
+            memcpy(atoms, vec->atoms, (size_t)vec->size * sizeof(Atom));
+            poolFree(N, vec->atoms, vec->capacity * (i64)sizeof(Atom));
+        }
+        vec->atoms = atoms;
+        vec->capacity = capacity;
+    }
+
+    NeWriteBarrier(N, vec, value);
+    vec->atoms[vec->size++] = value;
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------{TABLES}
+//----------------------------------------------------------------------------------------------------------------------
+// T A B L E S
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------------------------------------------------
+// Tables use open addressing with linear probing, like the symbol table.  Each slot caches its key's hash, so probing
+// and growing only compare keys when the hashes match.  A hash of 0 marks an empty slot, so hashes are never 0.
+// Removal shifts the following entries back rather than leaving tombstones.  Tables grow when they are 3/4 full.
+
+typedef struct
+{
+    u64 hash;                           // Hash of the key, or 0 if the slot is empty.
+    Atom key;
+    Atom value;
+}
+TableSlot;
+
+typedef struct
+{
+    TableSlot* slots;
+    i64 capacity;                       // Number of slots (always 0 or a power of 2).
+    i64 count;                          // Number of entries.
+}
+TableObject;
+
+//----------------------------------------------------------------------------------------------------------------------
+// Hash an atom.  Strings are hashed by their characters, symbols use the hash of their name, and other objects use
+// their address.
+
+static u64 atomHash(Nerd N, Atom a)
+{
+    u64 h;
+    AtomType type = NE_ATOM_TYPE(a);
+
+    switch (type)
+    {
+    case AT_Integer:    h = (u64)NE_ATOM_INT(a);                    break;
+    case AT_Boolean:    h = (u64)NE_ATOM_BOOL(a);                   break;
+    case AT_Character:  h = (u64)(u8)NE_ATOM_CHAR(a);               break;
+
+    case AT_Object:
+        {
+            GcObj* obj = NE_ATOM_OBJ(a);
+            if (obj->type == (u32)N->stringType)
+            {
+                StringObject* str = (StringObject *)(obj + 1);
+                const char* chars = stringChars(str);
+                h = hash(chars, chars + str->size);
+                return h ? h : 1;
+            }
+            else if (obj->type == (u32)N->symbolType)
+            {
+                h = ((SymbolObject *)(obj + 1))->hash;
+                return h ? h : 1;
+            }
+            h = (u64)(uintptr_t)obj;
+        }
+        break;
+
+    default:            h = 0;                                      break;
+    }
+
+    // Mix the bits (the splitmix64 finaliser) so that nearby values don't probe the same slots.
+    h ^= (u64)type << 56;
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    return h ? h : 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Return non-zero if two atoms are the same key.
+
+static int atomKeyEqual(Nerd N, Atom a, Atom b)
+{
+    AtomType type = NE_ATOM_TYPE(a);
+    if (type != NE_ATOM_TYPE(b)) return 0;
+
+    switch (type)
+    {
+    case AT_Nil:        return 1;
+    case AT_Integer:    return NE_ATOM_INT(a) == NE_ATOM_INT(b);
+    case AT_Boolean:    return NE_ATOM_BOOL(a) == NE_ATOM_BOOL(b);
+    case AT_Character:  return NE_ATOM_CHAR(a) == NE_ATOM_CHAR(b);
+
+    case AT_Object:
+        {
+            GcObj* objA = NE_ATOM_OBJ(a);
+            GcObj* objB = NE_ATOM_OBJ(b);
+            if (objA == objB) return 1;
+            if (objA->type != (u32)N->stringType || objB->type != (u32)N->stringType) return 0;
+
+            StringObject* strA = (StringObject *)(objA + 1);
+            StringObject* strB = (StringObject *)(objB + 1);
+            return strA->size == strB->size && !memcmp(stringChars(strA), stringChars(strB), (size_t)strA->size);
+        }
+
+    default:            return 0;
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Work out the hash of every key again after objects used as keys have moved, and move entries until each one can be
+// found by probing from its hash.  Each move takes an entry closer to its hash's slot, so it finishes.  This runs
+// during collections, so it can't allocate a new set of slots.
+
+static void tableRehash(Nerd N, TableObject* table)
+{
+    i64 mask = table->capacity - 1;
+    for (i64 i = 0; i < table->capacity; ++i)
+    {
+        if (table->slots[i].hash) table->slots[i].hash = atomHash(N, table->slots[i].key);
+    }
+
+    int moved = 1;
+    while (moved)
+    {
+        moved = 0;
+        for (i64 i = 0; i < table->capacity; ++i)
+        {
+            TableSlot* slot = &table->slots[i];
+            if (!slot->hash) continue;
+
+            i64 j = (i64)(slot->hash & (u64)mask);
+            while (j != i && table->slots[j].hash) j = (j + 1) & mask;
+            if (j != i)
+            {
+                table->slots[j] = *slot;
+                memset(slot, 0, sizeof(TableSlot));
+                moved = 1;
+            }
+        }
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static int tableCreate(Nerd N, void* obj, const void* data)
+{
+    TableObject* table = (TableObject *)obj;
+    i64 capacity = 0;
+    i64 needed = *(const i64 *)data;
+    if (needed)
+    {
+        // Room for the entries without going over 3/4 full.
+        capacity = 8;
+        while (capacity * 3 / 4 < needed) capacity *= 2;
+    }
+
+    table->count = 0;
+    table->capacity = capacity;
+    table->slots = 0;
+    if (capacity)
+    {
+        table->slots = (TableSlot *)poolAlloc(N, capacity * (i64)sizeof(TableSlot));
+        if (!table->slots) return 0;
+        memset(table->slots, 0, (size_t)capacity * sizeof(TableSlot));
+    }
+    return 1;
+}
+
+static void tableDelete(Nerd N, void* obj)
+{
+    TableObject* table = (TableObject *)obj;
+    if (table->slots) poolFree(N, table->slots, table->capacity * (i64)sizeof(TableSlot));
+}
+
+static void tableMark(Nerd N, void* obj)
+{
+    TableObject* table = (TableObject *)obj;
+    int moved = 0;
+    for (i64 i = 0; i < table->capacity; ++i)
+    {
+        TableSlot* slot = &table->slots[i];
+        if (slot->hash)
+        {
+            Atom key = slot->key;
+            NeMarkAtom(N, &slot->key);
+            NeMarkAtom(N, &slot->value);
+            moved |= NE_ATOM_TYPE(key) == AT_Object && NE_ATOM_OBJ(key) != NE_ATOM_OBJ(slot->key);
+        }
+    }
+
+    // A minor collection or a clone has pointed keys at objects' new addresses, which other objects are hashed by.
+    if (moved) tableRehash(N, table);
+}
+
+static int tableClone(Nerd N, void* obj, Nerd from, void* original)
+{
+    // The keys, and the hashes of those hashed by address, are updated by tableMark once every object is copied.
+    TableObject* table = (TableObject *)obj;
+    table->slots = (TableSlot *)poolClone(N, table->slots, table->capacity * (i64)sizeof(TableSlot));
+    return !table->capacity || table->slots;
+}
+
+static void tableToString(Nerd N, void* obj, NeStringMode mode)
+{
+    TableObject* table = (TableObject *)obj;
+    NeStringMode elementMode = mode == NSM_Normal ? NSM_REPL : mode;
+
+    NeScratchAddChar(N, '{');
+    if (printEnter(N, obj))
+    {
+        int first = 1;
+        for (i64 i = 0; i < table->capacity; ++i)
+        {
+            TableSlot* slot = &table->slots[i];
+            if (!slot->hash) continue;
+
+            if (!first) NeScratchFormat(N, ", ");
+            first = 0;
+            atomToString(N, slot->key, elementMode);
+            NeScratchAddChar(N, ' ');
+            atomToString(N, slot->value, elementMode);
+        }
+        printLeave(N);
+    }
+    NeScratchAddChar(N, '}');
+}
+
+static int registerTableType(Nerd N)
+{
+    ObjectInfo tableObjectInfo = {
+        .name = "table",
+        .createFn = &tableCreate,
+        .deleteFn = &tableDelete,
+        .evalFn = 0,
+        .toStringFn = &tableToString,
+        .markFn = &tableMark,
+        .cloneFn = &tableClone,
+        .size = sizeof(TableObject),
+        .flags = NOF_Movable
+    };
+    return NeObjectRegister(N, &tableObjectInfo);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static TableObject* tableGet(Nerd N, Atom a)
+{
+    assert(NeIsTable(N, a));
+    return (TableObject *)(NE_ATOM_OBJ(a) + 1);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Find the slot holding a key, or the empty slot where it would go.  The table must have at least one empty slot.
+
+static TableSlot* tableFind(Nerd N, TableObject* table, u64 h, Atom key)
+{
+    i64 mask = table->capacity - 1;
+    for (i64 i = (i64)(h & (u64)mask);; i = (i + 1) & mask)
+    {
+        TableSlot* slot = &table->slots[i];
+        if (!slot->hash || (slot->hash == h && atomKeyEqual(N, slot->key, key))) return slot;
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Double the number of slots, reinserting the entries using their cached hashes.  Returns 1 or 0 if out of memory.
+
+static int tableGrow(Nerd N, TableObject* table)
+{
+    i64 capacity = table->capacity ? table->capacity * 2 : 8;
+    TableSlot* slots = (TableSlot *)poolAlloc(N, capacity * (i64)sizeof(TableSlot));
+    if (!slots) return 0;
+    memset(slots, 0, (size_t)capacity * sizeof(TableSlot));
+
+    i64 mask = capacity - 1;
+    for (i64 i = 0; i < table->capacity; ++i)
+    {
+        TableSlot* slot = &table->slots[i];
+        if (!slot->hash) continue;
+
+        i64 j = (i64)(slot->hash & (u64)mask);
+        while (slots[j].hash) j = (j + 1) & mask;
+        slots[j] = *slot;
+    }
+
+    if (table->slots) poolFree(N, table->slots, table->capacity * (i64)sizeof(TableSlot));
+    table->slots = slots;
+    table->capacity = capacity;
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+Atom NeMakeTable(Nerd N, i64 capacity)
+{
+    assert(capacity >= 0);
+    TableObject* table = (TableObject *)NeObjectCreate(N, N->tableType, &capacity);
+    return table ? NeMakeObject(N, table) : NeMakeNil();
+}
+
+int NeIsTable(Nerd N, Atom a)
+{
+    return NE_ATOM_TYPE(a) == AT_Object && NE_ATOM_OBJ(a)->type == (u32)N->tableType;
+}
+
+i64 NeTableSize(Nerd N, Atom table)
+{
+    return tableGet(N, table)->count;
+}
+
+int NeTableGet(Nerd N, Atom table, Atom key, Atom* outValue)
+{
+    TableObject* t = tableGet(N, table);
+    if (!t->count) return 0;
+
+    TableSlot* slot = tableFind(N, t, atomHash(N, key), key);
+    if (!slot->hash) return 0;
+
+    if (outValue) *outValue = slot->value;
+    return 1;
+}
+
+int NeTableSet(Nerd N, Atom table, Atom key, Atom value)
+{
+    TableObject* t = tableGet(N, table);
+    u64 h = atomHash(N, key);
+    TableSlot* slot = t->capacity ? tableFind(N, t, h, key) : 0;
+
+    // Only a new key needs a slot, so replacing a value never grows the table.
+    if ((!slot || !slot->hash) && (t->count + 1) * 4 > t->capacity * 3)
+    {
+        if (!tableGrow(N, t)) return 0;
+        slot = tableFind(N, t, h, key);
+    }
+
+    NeWriteBarrier(N, t, value);
+    if (!slot->hash)
+    {
+        NeWriteBarrier(N, t, key);
+        slot->hash = h;
+        slot->key = key;
+        ++t->count;
+    }
+    slot->value = value;
+    return 1;
+}
+
+int NeTableRemove(Nerd N, Atom table, Atom key)
+{
+    TableObject* t = tableGet(N, table);
+    if (!t->count) return 0;
+
+    TableSlot* slot = tableFind(N, t, atomHash(N, key), key);
+    if (!slot->hash) return 0;
+
+    // Shift back any following entries that would no longer be found past the gap.
+    i64 mask = t->capacity - 1;
+    i64 gap = slot - t->slots;
+    for (i64 i = (gap + 1) & mask; t->slots[i].hash; i = (i + 1) & mask)
+    {
+        i64 home = (i64)(t->slots[i].hash & (u64)mask);
+        if (((i - home) & mask) >= ((i - gap) & mask))
+        {
+            t->slots[gap] = t->slots[i];
+            gap = i;
+        }
+    }
+    memset(&t->slots[gap], 0, sizeof(TableSlot));
+    --t->count;
+    return 1;
+}
+
+int NeTableNext(Nerd N, Atom table, i64* index, Atom* outKey, Atom* outValue)
+{
+    TableObject* t = tableGet(N, table);
+    for (i64 i = *index; i < t->capacity; ++i)
+    {
+        TableSlot* slot = &t->slots[i];
+        if (slot->hash)
+        {
+            if (outKey) *outKey = slot->key;
+            if (outValue) *outValue = slot->value;
+            *index = i + 1;
+            return 1;
+        }
+    }
+
+    *index = t->capacity;
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------{COMPILE}
+//----------------------------------------------------------------------------------------------------------------------
+// C O M P I L A T I O N
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------------------------------------------------
+// The byte-code is a stream of 8-bit opcodes for a stack machine, some followed by operands:
+//
+//      Nil                 Push nil.
+//      Yes                 Push yes.
+//      No                  Push no.
+//      Int8 n              Push the integer n (signed 8-bit operand).
+//      Const k             Push constant k (16-bit operand).
+//      Global k            Push the value of the symbol in constant k (16-bit operand).
+//      Eval k c            Push the result of evaluating the object in constant k, using inline cache c (16-bit
+//                          operands).
+//      Pop                 Discard the top of the stack.
+//      Return              Finish, with the top of the stack as the result.
+//
+// 16-bit operands are little-endian.
+
+#define NE_OPCODES(X)   \
+    X(Nil)              \
+    X(Yes)              \
+    X(No)               \
+    X(Int8)             \
+    X(Const)            \
+    X(Global)           \
+    X(Eval)             \
+    X(Pop)              \
+    X(Return)
+
+#define NE_OPCODE_ENUM(name) OP_##name,
+
+typedef enum
+{
+    NE_OPCODES(NE_OPCODE_ENUM)
+    OP_COUNT
+}
+Opcode;
+
+#define NE_MAX_CONSTANTS    65536
+#define NE_MAX_CACHES       65536
+
+//----------------------------------------------------------------------------------------------------------------------
+// Each Eval instruction has an inline cache of the evalFn of the type it last saw, so running it again doesn't look up
+// the type's ObjectInfo.
+
+typedef struct
+{
+    u32             type;           // Type of the object last evaluated here.
+    ObjectEvalFn    evalFn;         // That type's evalFn, or 0 if the cache is empty.
+}
+EvalCache;
+
+//----------------------------------------------------------------------------------------------------------------------
+// A compiled piece of code.  Each top-level datum read is compiled into one of these and then executed.
+
+typedef struct
+{
+    u8*     ops;                    // Byte-code.
+    i64     numOps;                 // Number of bytes of byte-code.
+    i64     opsCapacity;            // Number of bytes allocated for the byte-code.
+    Atom*   constants;              // Constant pool referenced by Const, Global and Eval.
+    i64     numConstants;           // Number of constants in the pool.
+    i64     constantsCapacity;      // Number of constants allocated for the pool.
+    i64     maxStack;               // Maximum number of atoms on the stack while running.
+    EvalCache* caches;              // Inline caches referenced by Eval.
+    i64     numCaches;              // Number of inline caches.
+    i64     cachesCapacity;         // Number of inline caches allocated.
+    GcObj*  owner;                  // If not 0, the object that owns the byte-code (e.g. a mapped image).
+}
+CodeObject;
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static void codeDelete(Nerd N, void* obj)
+{
+    CodeObject* code = (CodeObject *)obj;
+    if (!code->owner) NeFree(N, code->ops, code->opsCapacity);
+    NeFree(N, code->constants, code->constantsCapacity * sizeof(Atom));
+    NeFree(N, code->caches, code->cachesCapacity * sizeof(EvalCache));
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static void codeMark(Nerd N, void* obj)
+{
+    CodeObject* code = (CodeObject *)obj;
+    for (i64 i = 0; i < code->numConstants; ++i)
+    {
+        NeMarkAtom(N, &code->constants[i]);
+    }
+    if (code->owner) gcShade(N, code->owner);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// The copy gets its own byte-code, even if the original's belongs to an image, as well as its own constants and caches.
+
+static int codeClone(Nerd N, void* obj, Nerd from, void* original)
+{
+    CodeObject* code = (CodeObject *)obj;
+    if (code->owner) code->opsCapacity = code->numOps;
+    code->owner = 0;
+
+    u8* ops = code->opsCapacity ? (u8 *)NeAlloc(N, code->opsCapacity) : 0;
+    Atom* constants = code->constantsCapacity ? (Atom *)NeAlloc(N, code->constantsCapacity * sizeof(Atom)) : 0;
+    EvalCache* caches = code->cachesCapacity ? (EvalCache *)NeAlloc(N, code->cachesCapacity * sizeof(EvalCache)) : 0;
+    if ((code->opsCapacity && !ops) || (code->constantsCapacity && !constants) || (code->cachesCapacity && !caches))
+    {
+        NeFree(N, ops, code->opsCapacity);
+        NeFree(N, constants, code->constantsCapacity * sizeof(Atom));
+        NeFree(N, caches, code->cachesCapacity * sizeof(EvalCache));
+        return 0;
+    }
+
+    if (ops) memcpy(ops, code->ops, (size_t)code->numOps);
+    if (constants) memcpy(constants, code->constants, (size_t)code->numConstants * sizeof(Atom));
+    if (caches) memcpy(caches, code->caches, (size_t)code->numCaches * sizeof(EvalCache));
+    code->ops = ops;
+    code->constants = constants;
+    code->caches = caches;
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static int registerCodeType(Nerd N)
+{
+    ObjectInfo codeObjectInfo = {
+        .name = "code",
+        .createFn = 0,
+        .deleteFn = &codeDelete,
+        .evalFn = 0,
+        .toStringFn = 0,
+        .markFn = &codeMark,
+        .cloneFn = &codeClone,
+        .size = sizeof(CodeObject),
+        .flags = NOF_Movable
+    };
+    return NeObjectRegister(N, &codeObjectInfo);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Add bytes to the end of the byte-code.
+
+static int codeEmit(Nerd N, CodeObject* code, const u8* bytes, i64 numBytes)
+{
+    if (code->numOps + numBytes > code->opsCapacity)
+    {
+        i64 newCapacity = NE_MAX(code->opsCapacity * 2, NE_MAX(code->numOps + numBytes, 16));
+        u8* newOps = (u8 *)NeRealloc(N, code->ops, code->opsCapacity, newCapacity);
+        if (!newOps) return 0;
+        code->ops = newOps;
+        code->opsCapacity = newCapacity;
+    }
+
+    memcpy(code->ops + code->numOps, bytes, (size_t)numBytes);
+    code->numOps += numBytes;
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Emit an opcode with no operands.
+
+static int codeEmitOp(Nerd N, CodeObject* code, Opcode op)
+{
+    u8 b = (u8)op;
+    return codeEmit(N, code, &b, 1);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Add an atom to the constant pool and emit an opcode that refers to it.
+
+static int codeEmitConstant(Nerd N, CodeObject* code, Opcode op, Atom a)
+{
+    if (code->numConstants == NE_MAX_CONSTANTS)
+    {
+        NeOut(N, "COMPILE ERROR: Too many constants.\n");
+        return 0;
+    }
+
+    if (code->numConstants == code->constantsCapacity)
+    {
+        i64 newCapacity = NE_MAX(code->constantsCapacity * 2, 4);
+        Atom* newConstants = (Atom *)NeRealloc(N, code->constants, code->constantsCapacity * sizeof(Atom),
+            newCapacity * sizeof(Atom));
+        if (!newConstants) return 0;
+        code->constants = newConstants;
+        code->constantsCapacity = newCapacity;
+    }
+
+    i64 k = code->numConstants++;
+    NeWriteBarrier(N, code, a);
+    code->constants[k] = a;
+
+    u8 bytes[3] = { (u8)op, (u8)(k & 0xff), (u8)(k >> 8) };
+    return codeEmit(N, code, bytes, 3);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Add an empty inline cache and emit its index.
+
+static int codeEmitCache(Nerd N, CodeObject* code)
+{
+    if (code->numCaches == NE_MAX_CACHES)
+    {
+        NeOut(N, "COMPILE ERROR: Too many evaluations.\n");
+        return 0;
+    }
+
+    if (code->numCaches == code->cachesCapacity)
+    {
+        i64 newCapacity = NE_MAX(code->cachesCapacity * 2, 4);
+        EvalCache* newCaches = (EvalCache *)NeRealloc(N, code->caches, code->cachesCapacity * sizeof(EvalCache),
+            newCapacity * sizeof(EvalCache));
+        if (!newCaches) return 0;
+        code->caches = newCaches;
+        code->cachesCapacity = newCapacity;
+    }
+
+    i64 c = code->numCaches++;
+    code->caches[c].type = 0;
+    code->caches[c].evalFn = 0;
+
+    u8 bytes[2] = { (u8)(c & 0xff), (u8)(c >> 8) };
+    return codeEmit(N, code, bytes, 2);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Emit the byte-code that evaluates an atom and pushes the result.
+
+static int compileAtom(Nerd N, CodeObject* code, Atom a)
+{
+    switch (NE_ATOM_TYPE(a))
+    {
+    case AT_Nil:
+        return codeEmitOp(N, code, OP_Nil);
+
+    case AT_Boolean:
+        return codeEmitOp(N, code, NE_ATOM_BOOL(a) ? OP_Yes : OP_No);
+
+    case AT_Integer:
+        if (NE_ATOM_INT(a) >= -128 && NE_ATOM_INT(a) <= 127)
+        {
+            u8 bytes[2] = { OP_Int8, (u8)(i8)NE_ATOM_INT(a) };
+            return codeEmit(N, code, bytes, 2);
+        }
+        return codeEmitConstant(N, code, OP_Const, a);
+
+    case AT_Character:
+        return codeEmitConstant(N, code, OP_Const, a);
+
+    case AT_Object:
+        if (NE_ATOM_OBJ(a)->type == (u32)N->symbolType)
+        {
+            return codeEmitConstant(N, code, OP_Global, a);
+        }
+        else if (!NE_ATOM_OBJ(a)->selfEval)
+        {
+            return codeEmitConstant(N, code, OP_Eval, a) && codeEmitCache(N, code);
+        }
+        else
+        {
+            // The object evaluates to itself.
+            return codeEmitConstant(N, code, OP_Const, a);
+        }
+
+    default:
+        assert(0);
+        return 0;
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Compile a datum into a new code object.  Returns 0 if it cannot be compiled.
+
+static CodeObject* compile(Nerd N, Atom a)
+{
+    CodeObject* code = (CodeObject *)NeObjectCreate(N, N->codeType, 0);
+    if (!code) return 0;
+
+    code->maxStack = 1;
+    if (!compileAtom(N, code, a) || !codeEmitOp(N, code, OP_Return))
+    {
+        return 0;
+    }
+
+    return code;
+}
+
+//----------------------------------------------------------------------------------------------------------------------{PROFILE}
+//----------------------------------------------------------------------------------------------------------------------
+// S A M P L I N G   P R O F I L E R
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------------------------------------------------
+// The timer thread only counts ticks, so the VM's thread does all the work of taking samples.  Checking for a tick
+// is a single load, which keeps the cost low enough to leave in the interpreter loop.
+
+#define NE_PROFILE_CHECK(N, obj, pc) \
+    ((N)->profiler && atomicLoad(&(N)->profiler->ticks) != (N)->profiler->seen ? profileSample((N), (obj), (pc)) : (void)0)
+
+static void profileMain(void* arg)
+{
+    Nerd N = (Nerd)arg;
+    Profiler* P = N->profiler;
+    while (!atomicLoad(&P->quit))
+    {
+        N->config.threads.sleep(N->config.profileInterval);
+        atomicInc(&P->ticks);
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Add samples to a folded stack's count.  Returns 1 or 0 if out of memory.
+
+static int profileCount(Nerd N, const char* stack, i64 size, i64 samples)
+{
+    Profiler* P = N->profiler;
+    u64 h = hash(stack, stack + size);
+
+    if ((P->count + 1) * 2 > P->capacity)
+    {
+        // Grow the table, keeping it at most half full.
+        i64 capacity = P->capacity * 2;
+        ProfileEntry* entries = (ProfileEntry *)NeAlloc(N, capacity * (i64)sizeof(ProfileEntry));
+        if (!entries) return 0;
+        memset(entries, 0, (size_t)capacity * sizeof(ProfileEntry));
+
+        for (i64 i = 0; i < P->capacity; ++i)
+        {
+            if (!P->entries[i].stack) continue;
+            i64 j = (i64)(P->entries[i].hash & (u64)(capacity - 1));
+            while (entries[j].stack) j = (j + 1) & (capacity - 1);
+            entries[j] = P->entries[i];
+        }
+
+        NeFree(N, P->entries, P->capacity * (i64)sizeof(ProfileEntry));
+        P->entries = entries;
+        P->capacity = capacity;
+    }
+
+    i64 i = (i64)(h & (u64)(P->capacity - 1));
+    for (; P->entries[i].stack; i = (i + 1) & (P->capacity - 1))
+    {
+        ProfileEntry* e = &P->entries[i];
+        if (e->hash == h && e->size == size && !memcmp(e->stack, stack, (size_t)size))
+        {
+            e->count += samples;
+            return 1;
+        }
+    }
+
+    char* key = (char *)arenaAlloc(N, &P->keys, size);
+    if (!key) return 0;
+    memcpy(key, stack, (size_t)size);
+
+    ProfileEntry* e = &P->entries[i];
+    e->hash = h;
+    e->stack = key;
+    e->size = size;
+    e->count = samples;
+    ++P->count;
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Add the frames of a run and those that started it to the scratch, outermost first, each followed by ';'.
+
+static void profileFormatFrames(Nerd N, const ProfileFrame* frame)
+{
+    if (!frame) return;
+    profileFormatFrames(N, frame->prev);
+
+    i64 start = N->scratch.cursor;
+    if (frame->line)
+    {
+        arenaFormat(N, &N->scratch, "%s:%lld", frame->origin, (long long)frame->line);
+    }
+    else
+    {
+        arenaFormat(N, &N->scratch, "%s", frame->origin);
+    }
+
+    // Keep separators out of the origin.
+    for (char* p = (char *)N->scratch.start + start; p < (char *)N->scratch.start + N->scratch.cursor; ++p)
+    {
+        if (*p == ';') *p = ':';
+    }
+    char* separator = (char *)arenaAlloc(N, &N->scratch, 1);
+    if (separator) *separator = ';';
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Charge the ticks since the last sample to the current stack.  If obj isn't 0 it is the object being evaluated by
+// the instruction at offset pc.
+
+static void profileSample(Nerd N, GcObj* obj, i64 pc)
+{
+    Profiler* P = N->profiler;
+    i64 ticks = atomicLoad(&P->ticks);
+    i64 samples = ticks - P->seen;
+    P->seen = ticks;
+
+    arenaPush(N, &N->scratch);
+    i64 start = N->scratch.cursor;
+    profileFormatFrames(N, N->profileTop);
+    if (obj) arenaFormat(N, &N->scratch, "%s@%lld;", objectType(N, obj)->name, (long long)pc);
+
+    // Leave out the last separator.
+    i64 size = N->scratch.cursor - start - 1;
+    if (size > 0 && profileCount(N, (const char *)N->scratch.start + start, size, samples))
+    {
+        P->samples += samples;
+    }
+    arenaPop(N, &N->scratch);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Start running some source.  Ticks that passed while nothing was running aren't charged to anything.
+
+static void profileEnter(Nerd N, ProfileFrame* frame, const char* origin)
+{
+    if (N->profiler && !N->profileTop) N->profiler->seen = atomicLoad(&N->profiler->ticks);
+
+    frame->prev = N->profileTop;
+    frame->origin = origin;
+    frame->line = 0;
+    N->profileTop = frame;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static void profileLeave(Nerd N, ProfileFrame* frame)
+{
+    assert(N->profileTop == frame);
+    NE_PROFILE_CHECK(N, 0, 0);
+    N->profileTop = frame->prev;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Create the profiler and start its timer thread, if the configuration asks for one.
+
+static void profileOpen(Nerd N)
+{
+    const NeThreadFuncs* t = &N->config.threads;
+    N->profileTop = 0;
+    N->profiler = 0;
+    if (N->config.profileInterval <= 0 || !t->createThread || !t->sleep) return;
+
+    Profiler* P = (Profiler *)NeAlloc(N, sizeof(Profiler));
+    if (!P) return;
+    memset(P, 0, sizeof(Profiler));
+    P->capacity = 64;
+    P->entries = (ProfileEntry *)NeAlloc(N, P->capacity * (i64)sizeof(ProfileEntry));
+    arenaInitChunked(N, &P->keys, 4096);
+    if (!P->entries || !P->keys.start)
+    {
+        arenaDone(N, &P->keys);
+        if (P->entries) NeFree(N, P->entries, P->capacity * (i64)sizeof(ProfileEntry));
+        NeFree(N, P, sizeof(Profiler));
+        return;
+    }
+    memset(P->entries, 0, (size_t)P->capacity * sizeof(ProfileEntry));
+
+    N->profiler = P;
+    P->thread = t->createThread(&profileMain, N);
+    if (!P->thread)
+    {
+        N->profiler = 0;
+        arenaDone(N, &P->keys);
+        NeFree(N, P->entries, P->capacity * (i64)sizeof(ProfileEntry));
+        NeFree(N, P, sizeof(Profiler));
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static void profileClose(Nerd N)
+{
+    Profiler* P = N->profiler;
+    if (!P) return;
+
+    atomicInc(&P->quit);
+    N->config.threads.joinThread(P->thread);
+    arenaDone(N, &P->keys);
+    NeFree(N, P->entries, P->capacity * (i64)sizeof(ProfileEntry));
+    NeFree(N, P, sizeof(Profiler));
+    N->profiler = 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+i64 NeProfileWrite(Nerd N, NeOutputFunc func)
+{
+    Profiler* P = N->profiler;
+    if (!P) return 0;
+
+    for (i64 i = 0; i < P->capacity; ++i)
+    {
+        const ProfileEntry* e = &P->entries[i];
+        if (!e->stack) continue;
+
+        char count[32];
+        int numChars = snprintf(count, sizeof(count), " %lld\n", (long long)e->count);
+        func(N, e->stack, e->size);
+        func(N, count, numChars);
+    }
+
+    return P->samples;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+void NeProfileReset(Nerd N)
+{
+    Profiler* P = N->profiler;
+    if (!P) return;
+
+    memset(P->entries, 0, (size_t)P->capacity * sizeof(ProfileEntry));
+    arenaDone(N, &P->keys);
+    arenaInitChunked(N, &P->keys, 4096);
+    P->count = 0;
+    P->samples = 0;
+    P->seen = atomicLoad(&P->ticks);
+}
+
+//----------------------------------------------------------------------------------------------------------------------{VM}
+//----------------------------------------------------------------------------------------------------------------------
+// B Y T E - C O D E   I N T E R P R E T E R
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------------------------------------------------
+// Computed gotos dispatch each opcode with its own indirect jump, which predicts better than the single jump of a
+// switch.  Compilers that don't support them fall back to the switch.
+
+#ifndef NE_COMPUTED_GOTO
+#   if defined(__GNUC__) || defined(__clang__)
+#       define NE_COMPUTED_GOTO     1
+#   else
+#       define NE_COMPUTED_GOTO     0
+#   endif
+#endif
+
+#if NE_COMPUTED_GOTO
+#   define NE_OPCODE_LABEL(name)    &&L_OP_##name,
+#   define VM_START()               goto *dispatch[*ip++];
+#   define VM_CASE(op)              L_##op:
+#   define VM_NEXT()                goto *dispatch[*ip++]
+#   define VM_END()
+#else
+#   define VM_START()               for (;;) { switch (*ip++) {
+#   define VM_CASE(op)              case op:
+#   define VM_NEXT()                continue
+#   define VM_END()                 default: assert(0); result = 0; goto done; } }
+#endif
+
+#define VM_OPERAND16()              (ip += 2, (i64)ip[-2] | ((i64)ip[-1] << 8))
+
+// The stack arena may move if something called by the interpreter runs more code, so these save the stack position
+// before calling out (which also lets the GC see the stack) and find it again afterwards.
+#define VM_SAVE()                   (N->stack.cursor = base + (i64)((u8 *)sp - (u8 *)stack))
+#define VM_RESTORE()                (stack = (Atom *)(N->stack.start + base), sp = (Atom *)(N->stack.start + N->stack.cursor))
+
+//----------------------------------------------------------------------------------------------------------------------
+// Run some byte-code.
+
+static int exec(Nerd N, CodeObject* code, Atom* outResult)
+{
+#if NE_COMPUTED_GOTO
+    static const void* const dispatch[OP_COUNT] = { NE_OPCODES(NE_OPCODE_LABEL) };
+#endif
+
+    NE_STAT(N, atomsEvaluated, 1);
+    i64 base = N->stack.cursor;
+    if (!arenaEnsureSpace(N, &N->stack, code->maxStack * (i64)sizeof(Atom))) return 0;
+
+    Atom* stack = (Atom *)(N->stack.start + base);
+    Atom* sp = stack;
+    const u8* ip = code->ops;
+    int result = 1;
+
+    VM_START()
+
+    VM_CASE(OP_Nil)
+        *sp++ = NeMakeNil();
+        VM_NEXT();
+
+    VM_CASE(OP_Yes)
+        *sp++ = NeMakeBool(1);
+        VM_NEXT();
+
+    VM_CASE(OP_No)
+        *sp++ = NeMakeBool(0);
+        VM_NEXT();
+
+    VM_CASE(OP_Int8)
+        *sp++ = NeMakeInt((i8)*ip++);
+        VM_NEXT();
+
+    VM_CASE(OP_Const)
+        *sp++ = code->constants[VM_OPERAND16()];
+        VM_NEXT();
+
+    VM_CASE(OP_Global)
+        {
+            SymbolObject* sym = (SymbolObject *)(NE_ATOM_OBJ(code->constants[VM_OPERAND16()]) + 1);
+            if (sym->bound)
+            {
+                *sp++ = sym->value;
+                VM_NEXT();
+            }
+
+            // Let the symbol report the error.
+            result = symbolValue(N, sym, outResult);
+            goto done;
+        }
+
+    VM_CASE(OP_Eval)
+        {
+            Atom a = code->constants[VM_OPERAND16()];
+            EvalCache* cache = &code->caches[VM_OPERAND16()];
+            GcObj* obj = NE_ATOM_OBJ(a);
+            if (cache->type != obj->type || !cache->evalFn)
+            {
+                if (obj->selfEval)
+                {
+                    *sp++ = a;
+                    VM_NEXT();
+                }
+                cache->type = obj->type;
+                cache->evalFn = objectType(N, obj)->evalFn;
+            }
+
+            Atom r;
+            VM_SAVE();
+            NE_STAT(N, objectEvals, 1);
+            result = cache->evalFn(N, a, obj + 1, &r);
+            VM_RESTORE();
+            NE_PROFILE_CHECK(N, obj, (i64)(ip - code->ops) - 5);
+            if (!result) goto done;
+            *sp++ = r;
+            VM_NEXT();
+        }
+
+    VM_CASE(OP_Pop)
+        --sp;
+        VM_NEXT();
+
+    VM_CASE(OP_Return)
+        *outResult = sp[-1];
+        goto done;
+
+    VM_END()
+
+done:
+    N->stack.cursor = base;
+    return result;
+}
+
+//----------------------------------------------------------------------------------------------------------------------{LIFETIME}
+//----------------------------------------------------------------------------------------------------------------------
+// L I F E T I M E   M A N A G E M E N T
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+
+Nerd NeOpen(NeConfig* config)
+{
+    // Create a default configuration if necessary.
+    NeConfig defaultConfig;
+    if (!config)
+    {
+        config = &defaultConfig;
+        NeDefaultConfig(config);
+    }
+
+    // Create the Nerd structure.
+    Nerd N = config->memoryFunc(0, 0, 0, sizeof(struct _Nerd));
+    if (N)
+    {
+        // Copy configuration.
+        N->config = *config;
+#if NE_STATS
+        memset(&N->stats, 0, sizeof(N->stats));
+#endif
+
+        // Initialise the scratch.
+        arenaInitVirtual(N, &N->scratch, 4096, config->virtualArenaSize);
+        poolInit(N);
+
+        // Initialise the output buffer.
+        N->outSize = 0;
+        N->outCapacity = NE_MAX(config->outputBufferSize, 0);
+        N->outBuffer = N->outCapacity ? (char *)NeAlloc(N, N->outCapacity) : 0;
+        if (!N->outBuffer) N->outCapacity = 0;
+
+        // Initialise string conversion.
+        N->sinkFunc = 0;
+        N->sinkContext = 0;
+        N->sinkSize = 0;
+        N->printDepth = 0;
+        arenaInit(N, &N->toString, 256);
+
+        // Initialise the garbage collector.
+        N->gcObjs = 0;
+        N->gcSweep = 0;
+        N->gcSweepLink = 0;
+        N->gcState = GC_Idle;
+        N->gcDebt = 0;
+        N->lastResult = NeMakeNil();
+        N->gcMode = GCM_Major;
+        N->gcRememberAll = 0;
+        N->gcYoungFailed = 0;
+        N->gcGrayFailed = 0;
+        N->runDepth = 0;
+        N->gcBlack = 0;
+        N->gcParallel = 0;
+        arenaInit(N, &N->gcGray, sizeof(GcObj*) * 256);
+        arenaInit(N, &N->roots, sizeof(Atom) * 64);
+        arenaInit(N, &N->gcRemembered, sizeof(GcObj*) * 64);
+        arenaInit(N, &N->gcYoung, sizeof(GcObj*) * 256);
+        arenaInit(N, &N->gcFinal, sizeof(GcObj*) * 256);
+        if (config->nurserySize > 0)
+        {
+            arenaInit(N, &N->nursery, config->nurserySize);
+        }
+        else
+        {
+            memset(&N->nursery, 0, sizeof(N->nursery));
+        }
+
+        // Initialise object types
+        arenaInitVirtual(N, &N->objectInfo, sizeof(ObjectInfo) * 16, sizeof(ObjectInfo) * 0x10000);
+        N->stringType = registerStringType(N);
+        N->symbolType = symbolInit(N);
+        N->sourceType = registerSourceType(N);
+        N->codeType = registerCodeType(N);
+        N->vectorType = registerVectorType(N);
+        N->tableType = registerTableType(N);
+
+        // Initialise the interpreter.
+        arenaInit(N, &N->stack, sizeof(Atom) * 256);
+
+        // Start the collector threads and the profiler's timer.
+        gcHelpersOpen(N);
+        profileOpen(N);
+    }
+
+    return N;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+void NeClose(Nerd N)
+{
+    NeFlush(N);
+    NeFree(N, N->outBuffer, N->outCapacity);
+
+    profileClose(N);
+    gcWaitSweep(N);
+    gcHelpersClose(N);
+
+    // Young objects only need deleting if their type has a deleteFn.
+    GcObj** final = (GcObj **)N->gcFinal.start;
+    for (i64 i = 0; i < N->gcFinal.cursor / (i64)sizeof(GcObj*); ++i)
+    {
+        objectDelete(N, final[i] + 1);
+    }
+    N->nursery.cursor = 0;
+    N->gcRemembered.cursor = 0;
+
+    gcFinishSweep(N);
+    while (N->gcObjs)
+    {
+        GcObj* nextObj = N->gcObjs->next;
+        objectDelete(N, N->gcObjs + 1);
+        N->gcObjs = nextObj;
+    }
+
+    symbolDone(N);
+    poolDone(N);
+    arenaDone(N, &N->stack);
+    arenaDone(N, &N->gcGray);
+    arenaDone(N, &N->roots);
+    arenaDone(N, &N->gcRemembered);
+    arenaDone(N, &N->gcYoung);
+    arenaDone(N, &N->gcFinal);
+    if (N->nursery.start) arenaDone(N, &N->nursery);
+    arenaDone(N, &N->toString);
+    arenaDone(N, &N->scratch);
+    arenaDone(N, &N->objectInfo);
+    NeFree(N, N, sizeof(struct _Nerd));
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Cloning copies every object and then points the atoms in the copies, the symbol table and the roots at the copies.
+// Like a minor collection, the original objects' next fields point to their copies while this happens, and the
+// original list is put back afterwards.
+
+static void cloneRelink(GcObj** objs, i64 numObjs)
+{
+    for (i64 i = 0; i < numObjs; ++i)
+    {
+        objs[i]->next = (i + 1 < numObjs) ? objs[i + 1] : 0;
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Copy the objects of one VM into a new one.  Returns 1 or 0 if that couldn't be done, in which case the new VM is
+// left without any objects.
+
+static int cloneObjects(Nerd N, Nerd from, Arena* list)
+{
+    for (GcObj* obj = from->gcObjs; obj; obj = obj->next)
+    {
+        ObjectInfo* info = objectType(from, obj);
+        if (info->deleteFn && !info->cloneFn) return 0;
+
+        GcObj** p = (GcObj **)arenaAlloc(N, list, sizeof(GcObj*));
+        if (!p) return 0;
+        *p = obj;
+    }
+
+    GcObj** objs = (GcObj **)list->start;
+    i64 numObjs = list->cursor / (i64)sizeof(GcObj*);
+
+    // Allocate the copies, which the originals' next fields point to.
+    i64 numCopies = 0;
+    for (; numCopies < numObjs; ++numCopies)
+    {
+        GcObj* copy = (GcObj *)poolAlloc(N, sizeof(GcObj) + objs[numCopies]->size);
+        if (!copy) break;
+        objs[numCopies]->next = copy;
+    }
+
+    // Copy them.  A copy shares everything with its original until its cloneFn has run.
+    i64 numCloned = (numCopies < numObjs) ? 0 : numObjs;
+    for (i64 i = 0; i < numCloned; ++i)
+    {
+        GcObj* copy = objs[i]->next;
+        memcpy(copy, objs[i], sizeof(GcObj) + objs[i]->size);
+        copy->remembered = 0;
+
+        ObjectCloneFn cloneFn = objectType(N, copy)->cloneFn;
+        if (cloneFn && !cloneFn(N, copy + 1, from, objs[i] + 1))
+        {
+            numCloned = i;
+            break;
+        }
+#if NE_STATS
+        if (copy->type < NE_STATS_MAX_TYPES)
+        {
+            ++N->stats.types[copy->type].alive;
+            ++N->stats.types[copy->type].created;
+        }
+#endif
+    }
+
+    if (numCloned < numObjs)
+    {
+        for (i64 i = 0; i < numCopies; ++i)
+        {
+            GcObj* copy = objs[i]->next;
+            if (i < numCloned)
+            {
+                objectDelete(N, copy + 1);
+            }
+            else
+            {
+                poolFree(N, copy, sizeof(GcObj) + objs[i]->size);
+            }
+        }
+        cloneRelink(objs, numObjs);
+        return 0;
+    }
+
+    for (i64 i = numObjs - 1; i >= 0; --i)
+    {
+        GcObj* copy = objs[i]->next;
+        copy->next = N->gcObjs;
+        N->gcObjs = copy;
+        gcAllocated(N, copy);
+    }
+
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+Nerd NeClone(Nerd from)
+{
+    assert(!from->runDepth);
+
+    // Empty the nursery and finish any collection in progress, so that every object is on gcObjs and no object refers
+    // to one that has been deleted.
+    if (!gcMinor(from)) return 0;
+    if (from->gcState != GC_Idle)
+    {
+        while (!gcStep(from, INT64_MAX));
+    }
+
+    Nerd N = NeOpen(&from->config);
+    if (!N) return 0;
+
+    // The built-in types were registered in the same order, so the host's types follow them with the same indices.
+    N->objectInfo.cursor = 0;
+    ObjectInfo* info = (ObjectInfo *)arenaAlloc(N, &N->objectInfo, from->objectInfo.cursor);
+    if (!info)
+    {
+        NeClose(N);
+        return 0;
+    }
+    memcpy(info, from->objectInfo.start, (size_t)from->objectInfo.cursor);
+
+    SymbolSlot* symbols = (SymbolSlot *)NeAlloc(N, sizeof(SymbolSlot) * from->symbolCapacity);
+    Atom* roots = (Atom *)arenaAlloc(N, &N->roots, from->roots.cursor);
+    Arena list;
+    arenaInit(N, &list, sizeof(GcObj*) * 256);
+    if ((from->symbolCapacity && !symbols) || (from->roots.cursor && !roots) || !cloneObjects(N, from, &list))
+    {
+        if (symbols) NeFree(N, symbols, sizeof(SymbolSlot) * from->symbolCapacity);
+        arenaDone(N, &list);
+        NeClose(N);
+        return 0;
+    }
+
+    // Point the copies, the symbol table and the roots at the copies.
+    N->gcMode = GCM_Clone;
+    for (GcObj* obj = N->gcObjs; obj; obj = obj->next)
+    {
+        ObjectMarkFn markFn = objectType(N, obj)->markFn;
+        if (markFn) markFn(N, obj + 1);
+    }
+
+    for (i64 i = 0; i < from->symbolCapacity; ++i)
+    {
+        SymbolObject* sym = from->symbols[i].symbol;
+        symbols[i].hash = from->symbols[i].hash;
+        symbols[i].symbol = sym ? (SymbolObject *)(((GcObj *)sym - 1)->next + 1) : 0;
+    }
+    NeFree(N, N->symbols, sizeof(SymbolSlot) * N->symbolCapacity);
+    N->symbols = symbols;
+    N->symbolCapacity = from->symbolCapacity;
+    N->symbolCount = from->symbolCount;
+
+    if (roots) memcpy(roots, from->roots.start, (size_t)from->roots.cursor);
+    for (i64 i = 0; i < N->roots.cursor / (i64)sizeof(Atom); ++i)
+    {
+        NeMarkAtom(N, &((Atom *)N->roots.start)[i]);
+    }
+    N->lastResult = from->lastResult;
+    NeMarkAtom(N, &N->lastResult);
+    N->gcMode = GCM_Major;
+
+    cloneRelink((GcObj **)list.start, list.cursor / (i64)sizeof(GcObj*));
+    arenaDone(N, &list);
+    return N;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+#if NE_STATS
+
+void NeGetStats(Nerd N, NeStats* outStats)
+{
+    *outStats = N->stats;
+    outStats->scratchGrowths = N->scratch.numGrowths;
+    outStats->objectInfoGrowths = N->objectInfo.numGrowths;
+    outStats->stackGrowths = N->stack.numGrowths;
+    outStats->rootsGrowths = N->roots.numGrowths;
+    outStats->toStringGrowths = N->toString.numGrowths;
+
+    int numTypes = (int)(N->objectInfo.cursor / sizeof(ObjectInfo));
+    outStats->numTypes = NE_MIN(numTypes, NE_STATS_MAX_TYPES);
+    for (int i = 0; i < outStats->numTypes; ++i)
+    {
+        outStats->types[i].name = ((ObjectInfo *)N->objectInfo.start)[i].name;
+    }
+}
+
+#endif
+
+//----------------------------------------------------------------------------------------------------------------------{ATOM}
+//----------------------------------------------------------------------------------------------------------------------
+// A T O M   M A N A G M E N T
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+
+#if NE_ATOM_TAGGED
+
+#define NE_TAG_INTEGER      0x1
+#define NE_TAG_BOOLEAN      0x4
+#define NE_TAG_CHARACTER    0x6
+
+Atom NeMakeNil()
+{
+    Atom a = { .bits = 0 };
+    return a;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+Atom NeMakeInt(i64 i)
+{
+    Atom a = { .bits = ((u64)i << 1) | NE_TAG_INTEGER };
+    return a;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+Atom NeMakeBool(int b)
+{
+    Atom a = { .bits = ((u64)(b ? 1 : 0) << 3) | NE_TAG_BOOLEAN };
+    return a;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+Atom NeMakeAtom(AtomType at)
+{
+    switch (at)
+    {
+    case AT_Integer:    return NeMakeInt(0);
+    case AT_Boolean:    return NeMakeBool(0);
+    case AT_Character:  return NeMakeChar(0);
+
+    default:
+        // There is no such thing as an object atom without an object.
+        assert(at == AT_Nil);
+        return NeMakeNil();
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+Atom NeMakeChar(char c)
+{
+    Atom a = { .bits = ((u64)(u8)c << 8) | NE_TAG_CHARACTER };
+    return a;
+}
+
+#else
+
+Atom NeMakeNil()
+{
+    Atom a = {
+        .type = AT_Nil
+    };
+    return a;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+Atom NeMakeInt(i64 i)
+{
+    Atom a = {
+        .type = AT_Integer,
+        .i = i
+    };
+    return a;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+Atom NeMakeBool(int b)
+{
+    Atom a = {
+        .type = AT_Boolean,
+        .i = b ? 1 : 0
+    };
+    return a;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+Atom NeMakeAtom(AtomType at)
+{
+    Atom a = {
+        .type = at,
+    };
+    return a;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+Atom NeMakeChar(char c)
+{
+    Atom a = {
+        .type = AT_Character,
+        .c = c
+    };
+    return a;
+}
+
+#endif
+
+//----------------------------------------------------------------------------------------------------------------------
+
+Atom NeMakeString(Nerd N, const char* str)
+{
+    return NeMakeStringRanged(N, str, str + (strlen(str)));
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+Atom NeMakeStringRanged(Nerd N, const char* start, const char* end)
+{
+    return stringMake(N, start, end, 0);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+Atom NeMakeStringAdopt(Nerd N, char* buffer, i64 size)
+{
+    assert(buffer && buffer[size] == 0);
+    if (stringIsInline(size))
+    {
+        // Not worth sharing, so copy it into the string object.
+        Atom a = stringMakeRaw(N, buffer, buffer + size, 0);
+        N->config.memoryFunc(0, buffer, size + 1, 0);
+        return a;
+    }
+
+    NeShared shared = sharedCreate(N, buffer, size);
+    if (!shared)
+    {
+        N->config.memoryFunc(0, buffer, size + 1, 0);
+        return NeMakeNil();
+    }
+
+    Atom a = stringMakeShared(N, shared);
+    NeSharedRelease(shared);
+    return a;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+NeShared NeStringShare(Nerd N, Atom a)
+{
+    if (NE_ATOM_TYPE(a) != AT_Object || NE_ATOM_OBJ(a)->type != (u32)N->stringType) return 0;
+    StringObject* str = (StringObject *)(NE_ATOM_OBJ(a) + 1);
+    if (!stringIsInline(str->size) && str->shared) return sharedAcquire(str->shared);
+
+    NeShared shared = sharedCreate(N, 0, str->size);
+    if (!shared) return 0;
+    memcpy(shared->chars, stringChars(str), (size_t)str->size);
+
+    if (!stringIsInline(str->size))
+    {
+        // Swap the string's own copy for the shared one, so that it can be shared again without copying.
+        if (!str->owner) poolFree(N, str->str, str->size + 1);
+        str->str = shared->chars;
+        str->owner = 0;
+        str->shared = sharedAcquire(shared);
+    }
+
+    return shared;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+Atom NeMakeStringShared(Nerd N, NeShared shared)
+{
+    assert(shared);
+    return stringMakeShared(N, shared);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+Atom NeMakeSymbol(Nerd N, const char* name)
+{
+    return NeMakeSymbolRanged(N, name, name + strlen(name));
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+Atom NeMakeSymbolRanged(Nerd N, const char* start, const char* end)
+{
+    SymbolObject* sym = symbolIntern(N, hash(start, end), start, end);
+    return sym ? NeMakeObject(N, sym) : NeMakeNil();
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+Atom NeMakeObject(Nerd N, void* object)
+{
+#if NE_ATOM_TAGGED
+    assert(((uintptr_t)object & 7) == 0);
+    Atom a = { .bits = (u64)(uintptr_t)((GcObj *)object - 1) };
+#else
+    Atom a = {
+        .type = AT_Object,
+        .obj = (GcObj *)object - 1
+    };
+#endif
+    return a;
+}
+
+//----------------------------------------------------------------------------------------------------------------------{PRINT}
+//----------------------------------------------------------------------------------------------------------------------
+// P R I N T I N G
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------------------------------------------------
+// This table classifies every byte for the lexer's decisions.  Bytes from 0x80 up can be found in names so that
+// symbols can be written in UTF-8.
+
+enum
+{
+    CC_Space    = 0x01,             // Whitespace.
+    CC_Term     = 0x02,             // Ends a token (whitespace, closing brackets, ':', '\\' and the null character).
+    CC_Name     = 0x04,             // Can be found within a name.
+    CC_Initial  = 0x08,             // Can start a name.
+    CC_Digit    = 0x10,             // Decimal digit.
+    CC_Hex      = 0x20,             // Hexadecimal digit.
+    CC_Sign     = 0x40,             // '+' or '-'.
+};
+
+#define __  0
+#define CS  (CC_Space | CC_Term)
+#define CT  CC_Term
+#define CN  (CC_Name | CC_Initial)
+#define CD  (CC_Digit | CC_Hex | CC_Name)
+#define CH  (CC_Hex | CC_Name | CC_Initial)
+#define CP  (CC_Sign | CC_Name | CC_Initial)
+
+static const u8 gCharClass[256] =
+{
+    //          00  01  02  03  04  05  06  07  08  09  0a  0b  0c  0d  0e  0f  // Characters
+    /* 00 */    CT, __, __, __, __, __, __, __, __, CS, CS, __, __, CS, __, __,
+    /* 10 */    __, __, __, __, __, __, __, __, __, __, __, __, __, __, __, __,
+    /* 20 */    CS, CN, __, CN, CN, CN, CN, __, __, CT, CN, CP, __, CP, __, CN, //  !"#$%&' ()*+,-./
+    /* 30 */    CD, CD, CD, CD, CD, CD, CD, CD, CD, CD, CT, __, CN, CN, CN, CN, // 01234567 89:;<=>?
+    /* 40 */    CN, CH, CH, CH, CH, CH, CH, CN, CN, CN, CN, CN, CN, CN, CN, CN, // @ABCDEFG HIJKLMNO
+    /* 50 */    CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, __, CT, CT, CN, CN, // PQRSTUVW XYZ[\]^_
+    /* 60 */    __, CH, CH, CH, CH, CH, CH, CN, CN, CN, CN, CN, CN, CN, CN, CN, // `abcdefg hijklmno
+    /* 70 */    CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, __, CN, CT, CN, __, // pqrstuvw xyz{|}~
+    /* 80 */    CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN,
+    /* 90 */    CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN,
+    /* a0 */    CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN,
+    /* b0 */    CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN,
+    /* c0 */    CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN,
+    /* d0 */    CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN,
+    /* e0 */    CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN,
+    /* f0 */    CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN, CN,
+};
+
+#undef __
+#undef CS
+#undef CT
+#undef CN
+#undef CD
+#undef CH
+#undef CP
+
+#define NE_CHAR_CLASS(c) (gCharClass[(u8)(c)])
+#define NE_IS_WHITESPACE(c) (NE_CHAR_CLASS(c) & CC_Space)
+#define NE_IS_TERMCHAR(c) (NE_CHAR_CLASS(c) & CC_Term)
+
+//----------------------------------------------------------------------------------------------------------------------
+// This table defines the character tokens that are understood
+static const struct { const char* name; char ch; } gCharMap[] =
+{
+    { "5\\space", ' ' },
+    { "9\\backspace", '\b' },
+    { "3\\tab", '\t' },
+    { "7\\newline", '\n' },
+    { "6\\return", '\r' },
+    { "4\\bell", '\a' },
+    { "3\\esc", '\033' },
+    { 0, 0 }
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+
+// Write the string representation of an atom to the current sink.
+
+static void atomToString(Nerd N, Atom value, NeStringMode mode)
+{
+    assert(mode == NSM_Normal || mode == NSM_REPL || mode == NSM_Code);
+
+    switch (NE_ATOM_TYPE(value))
+    {
+    case AT_Nil:
+        NeScratchFormat(N, "nil");
+        break;
+
+    case AT_Integer:
+        NeScratchFormat(N, "%lli", NE_ATOM_INT(value));
+        break;
+
+    case AT_Boolean:
+        NeScratchFormat(N, "%s", NE_ATOM_BOOL(value) ? "yes" : "no");
+        break;
+
+    case AT_Character:
+        {
+            int done = 0;
+            char c = NE_ATOM_CHAR(value);
+
+            if (NSM_Normal != mode)
+            {
+                NeScratchFormat(N, "\\");
+
+                // Check for long name version.
+                if (c <= ' ' || c > 126)
+                {
+                    int i = 0;
+                    for (; gCharMap[i].name; ++i)
+                    {
+                        if (c == gCharMap[i].ch)
+                        {
+                            NeScratchFormat(N, "%s", gCharMap[i].name + 2);
+                            done = 1;
+                            break;
+                        }
+                    }
+                    if (!done && !gCharMap[i].name)
+                    {
+                        // Unknown characters, so show hex version.
+                        NeScratchFormat(N, "#x%02x", (int)c);
+                        done = 1;
+                    }
+                }
+
+            }
+
+            if (!done)
+            {
+                if (NE_IS_WHITESPACE(c) || '\r' == c || '\b' == c || '\033' == c ||
+                    (c > ' ' && c < 127))
+                {
+                    NeScratchAdd(N, &c, &c + 1);
+                }
+                else
+                {
+                    NeScratchFormat(N, "?");
+                }
+            }
+        }
+        break;
+
+    case AT_Object:
+        {
+            // The most common types are called directly rather than through their ObjectInfo.
+            GcObj* obj = NE_ATOM_OBJ(value);
+            if (obj->type == (u32)N->stringType)
+            {
+                stringToString(N, obj + 1, mode);
+                break;
+            }
+            else if (obj->type == (u32)N->symbolType)
+            {
+                symbolToString(N, obj + 1, mode);
+                break;
+            }
+
+            ObjectInfo* info = objectType(N, obj);
+            if (info->toStringFn)
+            {
+                info->toStringFn(N, NE_ATOM_OBJ(value) + 1, mode);
+            }
+            else
+            {
+                NeScratchAddChar(N, '<');
+                if (info->name)
+                {
+                    NeScratchAdd(N, info->name, info->name + strlen(info->name));
+                }
+                else
+                {
+                    NeScratchFormat(N, "object");
+                }
+                NeScratchFormat(N, ":%x>", NE_ATOM_OBJ(value) + 1);
+            }
+        }
+        break;
+
+    default:
+        NeScratchFormat(N, "<invalid atom>");
+        assert(0);
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+void NeToStringSink(Nerd N, Atom value, NeStringMode mode, NeSinkFunc sinkFunc, void* context)
+{
+    assert(N);
+    assert(sinkFunc);
+    assert(!N->sinkFunc);
+
+    N->sinkFunc = sinkFunc;
+    N->sinkContext = context;
+    N->sinkSize = 0;
+
+    atomToString(N, value, mode);
+    sinkFlush(N);
+
+    N->sinkFunc = 0;
+    N->sinkContext = 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// NeToString collects the text in its own arena so that it isn't overwritten by other uses of the scratch.
+
+static void toStringSink(Nerd N, void* context, const char* text, i64 size)
+{
+    char* p = (char *)arenaAlloc(N, &N->toString, size);
+    if (p) memcpy(p, text, (size_t)size);
+}
+
+NeString NeToString(Nerd N, Atom value, NeStringMode mode)
+{
+    N->toString.cursor = 0;
+    NeToStringSink(N, value, mode, &toStringSink, 0);
+
+    char* p = (char *)arenaAlloc(N, &N->toString, 1);
+    if (!p) return "";
+    *p = 0;
+    return (NeString)N->toString.start;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+typedef struct
+{
+    char*   buffer;
+    i64     capacity;
+    i64     size;           // Size of the whole string, even if it doesn't fit.
+}
+StringIntoContext;
+
+static void toStringIntoSink(Nerd N, void* context, const char* text, i64 size)
+{
+    StringIntoContext* ctx = (StringIntoContext *)context;
+    i64 space = ctx->capacity - 1 - ctx->size;
+    if (space > 0) memcpy(ctx->buffer + ctx->size, text, (size_t)NE_MIN(size, space));
+    ctx->size += size;
+}
+
+i64 NeToStringInto(Nerd N, Atom value, NeStringMode mode, char* buffer, i64 capacity)
+{
+    StringIntoContext ctx = { .buffer = buffer, .capacity = capacity, .size = 0 };
+    NeToStringSink(N, value, mode, &toStringIntoSink, &ctx);
+    if (capacity > 0) buffer[NE_MIN(ctx.size, capacity - 1)] = 0;
+    return ctx.size;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+// Output is collected in a buffer so that the output callback is called once for a batch of text rather than for
+// every fragment.
+
+void NeFlush(Nerd N)
+{
+    if (N->outSize && N->config.outputFunc)
+    {
+        N->config.outputFunc(N, N->outBuffer, N->outSize);
+    }
+    N->outSize = 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Called after text is added to the output buffer.
+
+static void outputAdded(Nerd N, const char* text, i64 size)
+{
+    if (N->config.outputFlush == NFM_Line && memchr(text, '\n', (size_t)size)) NeFlush(N);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Add text to the output buffer.  Text that is too big for the buffer is passed straight to the output callback.
+
+static void outputWrite(Nerd N, const char* text, i64 size)
+{
+    if (N->outSize + size > N->outCapacity) NeFlush(N);
+    if (size > N->outCapacity)
+    {
+        N->config.outputFunc(N, text, size);
+    }
+    else
+    {
+        memcpy(N->outBuffer + N->outSize, text, (size_t)size);
+        N->outSize += size;
+        outputAdded(N, text, size);
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static void NeOutV(Nerd N, const char* format, va_list args)
+{
+    if (!N->config.outputFunc) return;
+
+    // Try to format straight into the output buffer.  vsnprintf needs room for a null terminator too.
+    i64 space = N->outCapacity - N->outSize;
+    if (space > 0)
+    {
+        va_list argsCopy;
+        va_copy(argsCopy, args);
+        int numChars = vsnprintf(N->outBuffer + N->outSize, (size_t)space, format, argsCopy);
+        va_end(argsCopy);
+
+        if (numChars < 0) return;
+        if (numChars < space)
+        {
+            const char* text = N->outBuffer + N->outSize;
+            N->outSize += numChars;
+            outputAdded(N, text, numChars);
+            return;
+        }
+    }
+
+    // Not enough room so format it in the scratch instead.  This bypasses any sink in case NeOut is called while an atom
+    // is being converted.
+    scratchStart(N);
+    i64 offset = N->scratch.cursor;
+    arenaFormatV(N, &N->scratch, format, args);
+    outputWrite(N, (const char *)N->scratch.start + offset, N->scratch.cursor - offset);
+    scratchEnd(N);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+void NeOut(Nerd N, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    NeOutV(N, format, args);
+    va_end(args);
+}
+
+//----------------------------------------------------------------------------------------------------------------------{LEX}
+//----------------------------------------------------------------------------------------------------------------------
+// L E X I C A L   A N A L Y S I S
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+
+typedef enum _NeToken
+{
+    // Errors
+    NeToken_Unknown = -100,
+    NeToken_Error,
+
+    // End of token stream
+    NeToken_EOF = 0,
+
+    // Literals
+    NeToken_Number,         // e.g. 42, -34
+    NeToken_Symbol,         // e.g. foo, bar, hello-world
+    NeToken_Character,      // e.g. \c \space 
+    NeToken_String,         // e.g. "Hello", "A new line\n"
+
+    // Keywords
+    NeToken_KEYWORDS,
+    NeToken_Nil = NeToken_KEYWORDS,     // e.g. nil
+    NeToken_Yes,                        // e.g. yes
+    NeToken_No,                         // e.g. no
+
+    NeToken_COUNT
+}
+NeToken;
+
+//----------------------------------------------------------------------------------------------------------------------
+// Keywords are recognised with a perfect hash table that is generated by make/keywords.lua.
+
+#include <keywords.h>
+
+//----------------------------------------------------------------------------------------------------------------------
+
+typedef struct _NeLexInfo
+{
+    const char*     start;          // Start of text in source code.
+    const char*     end;            // One past the end of text in the source code.
+    i64             line;           // Line number of token.
+    NeToken         token;          // Token type.
+    Atom            atom;           // Atom generated from token.
+}
+NeLexInfo;
+
+//----------------------------------------------------------------------------------------------------------------------
+
+typedef struct _NeLex
+{
+    i64                 line;           // The current line number in the source.
+    i64                 lastLine;       // The previous line number of the last character read.
+    const char*         cursor;         // The current read position in the lexical stream.
+    const char*         lastCursor;     // The last read position of the last character read.
+    const char*         end;
+    const char*         origin;         // Description of where the source came from (for error messages).
+    int                 quiet;          // Non-zero if errors are not to be reported.
+    int                 incomplete;     // Set if the source ended inside a multi-line comment.
+    int                 scalar;         // Non-zero to scan without SIMD instructions (see NeFuzz).
+}
+NeLex;
+
+//----------------------------------------------------------------------------------------------------------------------
+// Prepare a lexer to read tokens from a buffer on demand.
+
+static void lexInit(NeLex* L, const char* origin, const char* start, const char* end)
+{
+    L->line = 1;
+    L->lastLine = 1;
+    L->cursor = start;
+    L->lastCursor = start;
+    L->end = end;
+    L->origin = origin;
+    L->quiet = 0;
+    L->incomplete = 0;
+    L->scalar = 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Fetch the next character in the stream.  This function keeps tracks of the newlines.  All the different newline
+// representations are converted to just '\n'.  If there are no more characters in the stream, a 0 is returned.
+
+static char nextChar(NeLex* L)
+{
+    char c;
+
+    L->lastCursor = L->cursor;
+    L->lastLine = L->line;
+
+    if (L->cursor == L->end) return 0;
+
+    c = *L->cursor++;
+
+    if ('\r' == c || '\n' == c)
+    {
+        // Handle new-lines
+        ++L->line;
+
+        if (c == '\r')
+        {
+            if ((L->cursor < L->end) && (*L->cursor == '\n'))
+            {
+                ++L->cursor;
+            }
+
+            c = '\n';
+        }
+    }
+
+    return c;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Return the cursor to the previous character.  You can only call this once after calling nextChar().
+
+static void ungetChar(NeLex* L)
+{
+    L->line = L->lastLine;
+    L->cursor = L->lastCursor;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Bulk scanning
+//
+// Whitespace, comments and string bodies are skipped in blocks of 16 characters with SIMD instructions instead of
+// going through nextChar() for every character.  SSE2 is used on x86/x64 and NEON on ARM, otherwise the scalar loops
+// are used.  Define NE_SIMD as 0 to force the scalar versions, or set a lexer's scalar field to use them at run-time.
+// The scanners are only used to find where to move the cursor to; the character at that point is then fetched with
+// nextChar() as usual so that ungetChar() still works.
+
+#define NE_SIMD_NONE    0
+#define NE_SIMD_SSE2    1
+#define NE_SIMD_NEON    2
+
+#ifndef NE_SIMD
+#   if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#       define NE_SIMD  NE_SIMD_SSE2
+#   elif defined(__ARM_NEON) || defined(_M_ARM64)
+#       define NE_SIMD  NE_SIMD_NEON
+#   else
+#       define NE_SIMD  NE_SIMD_NONE
+#   endif
+#endif
+
+#if NE_SIMD == NE_SIMD_SSE2
+
+#include <emmintrin.h>
+
+// Masks have 1 bit per character.
+typedef __m128i ScanBlock;
+#define NE_SCAN_STRIDE          1
+#define NE_SCAN_ALL             0xffffull
+#define NE_SCAN_LAST            0x8000ull
+
+#define scanLoad(p)             _mm_loadu_si128((const __m128i *)(p))
+#define scanEq(v, c)            _mm_cmpeq_epi8((v), _mm_set1_epi8(c))
+#define scanOr(a, b)            _mm_or_si128((a), (b))
+#define scanMask(v)             ((u64)(u32)_mm_movemask_epi8(v))
+
+#elif NE_SIMD == NE_SIMD_NEON
+
+#include <arm_neon.h>
+
+// NEON has no move mask instruction so masks have 4 bits per character, made by narrowing the comparison result.
+typedef uint8x16_t ScanBlock;
+#define NE_SCAN_STRIDE          4
+#define NE_SCAN_ALL             0xffffffffffffffffull
+#define NE_SCAN_LAST            0xf000000000000000ull
+
+#define scanLoad(p)             vld1q_u8((const u8 *)(p))
+#define scanEq(v, c)            vceqq_u8((v), vdupq_n_u8((u8)(c)))
+#define scanOr(a, b)            vorrq_u8((a), (b))
+#define scanMask(v)             vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(v), 4)), 0)
+
+#endif
+
+#if NE_SIMD
+
+// Return the index of the lowest set bit.  The mask must not be 0.
+static int scanFirstBit(u64 mask)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctzll(mask);
+#endif
+}
+
+// Return the number of set bits.  This doesn't use a popcnt instruction since SSE2 doesn't guarantee one.
+static int scanBitCount(u64 mask)
+{
+    mask = mask - ((mask >> 1) & 0x5555555555555555ull);
+    mask = (mask & 0x3333333333333333ull) + ((mask >> 2) & 0x3333333333333333ull);
+    mask = (mask + (mask >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return (int)((mask * 0x0101010101010101ull) >> 56);
+}
+
+#endif
+
+//----------------------------------------------------------------------------------------------------------------------
+// Return the first character that isn't whitespace (including '\r').
+
+static const char* scanSpaces(const char* p, const char* end, int simd)
+{
+#if NE_SIMD
+    while (simd && end - p >= 16)
+    {
+        ScanBlock v = scanLoad(p);
+        u64 mask = scanMask(scanOr(scanOr(scanEq(v, ' '), scanEq(v, '\t')), scanOr(scanEq(v, '\n'), scanEq(v, '\r'))));
+        mask = ~mask & NE_SCAN_ALL;
+        if (mask) return p + scanFirstBit(mask) / NE_SCAN_STRIDE;
+        p += 16;
+    }
+#else
+    (void)simd;
+#endif
+
+    while (p < end && (' ' == *p || '\t' == *p || '\n' == *p || '\r' == *p)) ++p;
+    return p;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Return the first character that matches any of the 4 given, or end.  Pass a character more than once if fewer are
+// needed.
+
+static const char* scanFind(const char* p, const char* end, int simd, char a, char b, char c, char d)
+{
+#if NE_SIMD
+    while (simd && end - p >= 16)
+    {
+        ScanBlock v = scanLoad(p);
+        u64 mask = scanMask(scanOr(scanOr(scanEq(v, a), scanEq(v, b)), scanOr(scanEq(v, c), scanEq(v, d))));
+        if (mask) return p + scanFirstBit(mask) / NE_SCAN_STRIDE;
+        p += 16;
+    }
+#else
+    (void)simd;
+#endif
+
+    while (p < end && a != *p && b != *p && c != *p && d != *p) ++p;
+    return p;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Count the newlines in a range in the same way as nextChar(): "\n", "\r" and "\r\n" are all one newline.  The range
+// must not end between a '\r' and a '\n'.
+
+static i64 scanLines(const char* p, const char* end, int simd)
+{
+    i64 lines = 0;
+
+#if NE_SIMD
+    // Each block looks at the character after it to see if its last '\r' is followed by '\n'.
+    while (simd && end - p > 16)
+    {
+        ScanBlock v = scanLoad(p);
+        u64 n = scanMask(scanEq(v, '\n'));
+        u64 r = scanMask(scanEq(v, '\r'));
+        u64 followedByN = (n >> NE_SCAN_STRIDE) | ('\n' == p[16] ? NE_SCAN_LAST : 0);
+        lines += (scanBitCount(n) + scanBitCount(r & ~followedByN)) / NE_SCAN_STRIDE;
+        p += 16;
+    }
+#else
+    (void)simd;
+#endif
+
+    for (; p < end; ++p)
+    {
+        if ('\n' == *p || ('\r' == *p && (p + 1 == end || '\n' != p[1]))) ++lines;
+    }
+    return lines;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Move the cursor forward to p, counting the newlines skipped.  Call nextChar() afterwards to get the character at p.
+
+static void lexSkip(NeLex* L, const char* p)
+{
+    L->line += scanLines(L->cursor, p, !L->scalar);
+    L->cursor = p;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Fill in the info for the token just read.
+
+static NeToken lexBuild(Nerd N, NeLexInfo* li, const char* start, const char* end, i64 line, NeToken token, Atom atom)
+{
+    li->start = start;
+    li->end = end;
+    li->line = line;
+    li->token = token;
+    li->atom = atom;
+    NE_STAT(N, tokensLexed, 1);
+
+    return token;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Return an error
+
+NeToken lexErrorV(Nerd N, NeLex* L, const char* origin, const char* format, va_list args)
+{
+    if (L->quiet) return NeToken_Error;
+
+    NeOut(N, "%s(%lli): LEX ERROR: ", origin, L->line);
+    NeOutV(N, format, args);
+    NeOut(N, "\n");
+
+    return NeToken_Error;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+NeToken lexError(Nerd N, NeLex* L, const char* origin, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    lexErrorV(N, L, origin, format, args);
+    va_end(args);
+    return NeToken_Error;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Fetch the next token, writing its information to info.
+
+static NeToken lexNext(Nerd N, NeLex* L, NeLexInfo* info)
+{
+    const char* origin = L->origin;
+    if (L->cursor == L->end) return NeToken_EOF;
+
+    // Find the next meaningful character, skipping whitespace and comments.  Comments are delimited by ';' or '# ',
+    // or '#!' (notice the space) to the end of the line, and between '#|' and '|#'.  All comments are nestable.
+    char c = nextChar(L);
+
+    for (;;)
+    {
+        if (0 == c)
+        {
+            // End of stream reached.
+            return NeToken_EOF;
+        }
+
+        // Check for whitespace.  If found, ignore, and get the next character in the stream.
+        if (NE_IS_WHITESPACE(c))
+        {
+            lexSkip(L, scanSpaces(L->cursor, L->end, !L->scalar));
+            c = nextChar(L);
+            continue;
+        }
+
+        // Check for comments.
+        if (';' == c)
+        {
+            lexSkip(L, scanFind(L->cursor, L->end, !L->scalar, '\n', '\r', 0, 0));
+            while ((c != 0) && (c != '\n')) c = nextChar(L);
+            continue;
+        }
+        else if ('#' == c)
+        {
+            c = nextChar(L);
+
+            if ('|' == c)
+            {
+                // Nestable, multi-line comment.
+                int depth = 1;
+                while (c != 0 && depth)
+                {
+                    lexSkip(L, scanFind(L->cursor, L->end, !L->scalar, '#', '|', 0, 0));
+                    c = nextChar(L);
+                    if ('#' == c)
+                    {
+                        // Check for nested #|...|#
+                        c = nextChar(L);
+                        if ('|' == c)
+                        {
+                            ++depth;
+                        }
+                    }
+                    else if ('|' == c)
+                    {
+                        // Check for terminator |#
+                        c = nextChar(L);
+                        if ('#' == c)
+                        {
+                            --depth;
+                        }
+                    }
+                }
+                if (depth) L->incomplete = 1;
+                continue;
+            }
+            else if (NE_IS_WHITESPACE(c))
+            {
+                // Line-base comment.
+                if (c != '\n') lexSkip(L, scanFind(L->cursor, L->end, !L->scalar, '\n', '\r', 0, 0));
+                while ((c != 0) && (c != '\n')) c = nextChar(L);
+                continue;
+            }
+            else
+            {
+                // Possible prefix character.
+                continue;
+            }
+        }
+
+        // If we've reached this point, we have a meaningful character.
+        break;
+    }
+
+    const char* s0 = L->cursor - 1;
+
+    //------------------------------------------------------------------------------------------------------------------
+    // Check for numbers
+    //------------------------------------------------------------------------------------------------------------------
+
+    if ((NE_CHAR_CLASS(c) & CC_Digit) ||
+        // A sign must be followed by a digit, otherwise it is a symbol.
+        ((NE_CHAR_CLASS(c) & CC_Sign) && L->cursor < L->end && (NE_CHAR_CLASS(*L->cursor) & CC_Digit)))
+    {
+        int negative = ('-' == c);
+        if (NE_CHAR_CLASS(c) & CC_Sign) c = nextChar(L);
+
+        // The magnitude is built as an unsigned value so that the most negative integer can be read.
+        u64 limit = negative ? (u64)NE_INT_MAX + 1 : (u64)NE_INT_MAX;
+        u64 value = 0;
+
+        if ('0' == c && L->cursor < L->end &&
+            ('x' == *L->cursor || 'X' == *L->cursor || 'b' == *L->cursor || 'B' == *L->cursor))
+        {
+            // Hexadecimal (0x) or binary (0b) integer.
+            u64 base = ('x' == *L->cursor || 'X' == *L->cursor) ? 16 : 2;
+            nextChar(L);
+            c = nextChar(L);
+
+            int numDigits = 0;
+            while (NE_CHAR_CLASS(c) & CC_Hex)
+            {
+                u64 digit = (c <= '9') ? (u64)(c - '0') : (u64)((c | 0x20) - 'a' + 10);
+                if (digit >= base) return lexError(N, L, origin, "Invalid digit.");
+                if (value > (limit - digit) / base) return lexError(N, L, origin, "Integer is too large.");
+                value = value * base + digit;
+                ++numDigits;
+                c = nextChar(L);
+            }
+
+            if (!numDigits) return lexError(N, L, origin, "Invalid number.");
+        }
+        else
+        {
+            // Decimal integer.  No number of up to 18 digits can overflow, so only check after that.
+            int numDigits = 0;
+            do
+            {
+                u64 digit = (u64)(c - '0');
+                if (++numDigits > 18 && value > (limit - digit) / 10)
+                {
+                    return lexError(N, L, origin, "Integer is too large.");
+                }
+                value = value * 10 + digit;
+                c = nextChar(L);
+            }
+            while (NE_CHAR_CLASS(c) & CC_Digit);
+        }
+
+        ungetChar(L);
+        Atom number = NeMakeInt(negative ? (i64)(0 - value) : (i64)value);
+        return lexBuild(N, info, s0, L->cursor, L->line, NeToken_Number, number);
+    }
+
+    //------------------------------------------------------------------------------------------------------------------
+    // Check for keywords and symbols
+    //------------------------------------------------------------------------------------------------------------------
+
+    else if (NE_CHAR_CLASS(c) & CC_Initial)
+    {
+        while (NE_CHAR_CLASS(c) & CC_Name) c = nextChar(L);
+        ungetChar(L);
+
+        i64 sizeToken = L->cursor - s0;
+        u64 h = hash(s0, L->cursor);
+
+#if NE_DEBUG_SYMBOL_HASHES
+        const char* msg = scratchStart(N);
+        NeScratchFormat(N, "Hash: \"");
+        NeScratchAdd(N, s0, L->cursor);
+        NeScratchFormat(N, "\": %x\n", (int)h);
+        scratchEnd(N);
+        NeOut(N, msg);
+#endif
+
+        // Only the keyword in the name's slot can match.
+        i64 slot = (i64)((h >> NE_KEYWORD_SHIFT) & NE_KEYWORD_MASK);
+        if (gKeywordTable[slot].size == sizeToken && memcmp(s0, gKeywordTable[slot].name, (size_t)sizeToken) == 0)
+        {
+            return lexBuild(N, info, s0, L->cursor, L->line, gKeywordTable[slot].token, NeMakeNil());
+        }
+
+        // Must be a symbol!
+        SymbolObject* sym = symbolIntern(N, h, s0, L->cursor);
+        if (!sym) return lexError(N, L, origin, "Out of memory.");
+        return lexBuild(N, info, s0, L->cursor, L->line, NeToken_Symbol, NeMakeObject(N, sym));
+    }
+
+    //------------------------------------------------------------------------------------------------------------------
+    // Check for strings
+    //------------------------------------------------------------------------------------------------------------------
+
+    else if ('"' == c)
+    {
+        s0 = L->cursor;
+        lexSkip(L, scanFind(L->cursor, L->end, !L->scalar, '"', '\n', '\r', 0));
+        c = nextChar(L);
+        while ((c != 0) && (c != '\n') && (c != '"'))
+        {
+            c = nextChar(L);
+        }
+
+        if (c == '"')
+        {
+            // End of string found
+            return lexBuild(N, info, s0, L->cursor - 1, L->line, NeToken_String, NeMakeNil());
+        }
+        else
+        {
+            // Unterminated string
+            return lexError(N, L, origin, "Unterminated string.");
+        }
+    }
+
+    //------------------------------------------------------------------------------------------------------------------
+    // Check for characters
+    //------------------------------------------------------------------------------------------------------------------
+
+    else if ('\\' == c)
+    {
+        // Fetch next character.
+        c = nextChar(L);
+
+        if (0 == c || NE_IS_WHITESPACE(c))
+        {
+            return lexError(N, L, origin, "Invalid character token.");
+        }
+
+        char ch = c;
+
+        // Check for named characters or hashed characters (\#32 or \#x20
+        if ('#' == c)
+        {
+            c = nextChar(L);
+            if (NE_IS_TERMCHAR(c) || '#' == c)
+            {
+                ungetChar(L);
+                return lexBuild(N, info, s0, L->cursor, L->line, NeToken_Character, NeMakeChar('#'));
+            }
+            else if ('x' == c)
+            {
+                // Possible hex character.  The digits are shifted in unsigned so that a top bit set doesn't overflow.
+                u8 ch = 0;
+                int maxNumChars = sizeof(ch) * 2;
+                while (NE_CHAR_CLASS(c = nextChar(L)) & CC_Hex)
+                {
+                    ch <<= 4;
+                    if (c >= '0' && c <= '9') ch += c - '0';
+                    else if (c >= 'a' && c <= 'f') ch += c - 'a' + 10;
+                    else if (c >= 'A' && c <= 'F') ch += c - 'A' + 10;
+                    if (--maxNumChars < 0)
+                    {
+                        // Too many hex digits to hold a character.
+                        return lexError(N, L, origin, "Unknown character token.");
+                    }
+                }
+                if (!NE_IS_TERMCHAR(c)) return lexError(N, L, origin, "Unknown character token.");
+                ungetChar(L);
+
+                return lexBuild(N, info, s0, L->cursor, L->line, NeToken_Character, NeMakeChar((char)ch));
+            }
+            else if (NE_CHAR_CLASS(c) & CC_Digit)
+            {
+                char ch = c - '0';
+                while (NE_CHAR_CLASS(c = nextChar(L)) & CC_Digit)
+                {
+                    ch *= 10;
+                    ch += c - '0';
+                }
+                if (!NE_IS_TERMCHAR(c)) return lexError(N, L, origin, "Unknown character token.");
+                ungetChar(L);
+                return lexBuild(N, info, s0, L->cursor, L->line, NeToken_Character, NeMakeChar(ch));
+            }
+        }
+
+        c = nextChar(L);
+        if (NE_IS_TERMCHAR(c))
+        {
+            ungetChar(L);
+            return lexBuild(N, info, s0, L->cursor, L->line, NeToken_Character, NeMakeChar(ch));
+        }
+
+        while (!NE_IS_TERMCHAR(c))
+        {
+            if (c < 'a' || c > 'z')
+            {
+                // This cannot be a long character description, so return error
+                if (!NE_IS_TERMCHAR(c)) return lexError(N, L, origin, "Unknown character token.");
+            }
+            c = nextChar(L);
+        }
+        ungetChar(L);
+
+        int tokenLen = (int)(L->cursor - s0);
+        for (int i = 0; gCharMap[i].name; ++i)
+        {
+            int lenToken = (int)gCharMap[i].name[0] - '0' + 1;
+            if (lenToken != tokenLen) continue;
+
+            if (strncmp(gCharMap[i].name + 1, s0, (size_t)tokenLen) == 0)
+            {
+                // Found a match
+                return lexBuild(N, info, s0, L->cursor, L->line, NeToken_Character, NeMakeChar(gCharMap[i].ch));
+            }
+        }
+
+        return lexError(N, L, origin, "Unknown character token.");
+    }
+
+    //------------------------------------------------------------------------------------------------------------------
+    // Unknown token
+    //------------------------------------------------------------------------------------------------------------------
+
+    else
+    {
+        return lexError(N, L, origin, "Unknown token");
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// A token list holds all the tokens of some source code, as produced by lex().  It is stored as a structure of arrays
+// so that each token only takes 9 bytes, plus an atom if it carries one:
+//
+//      starts      u32     Offset of the token's text from the start of the source.
+//      ends        u32     Offset of one past the end of the token's text.
+//      kinds       u8      NeToken value.
+//      atoms       Atom    Atoms of number, character and symbol tokens only, in token order.
+//
+// Line numbers are not stored.  They are worked out on request from an index of line starts that is only built the
+// first time one is needed.  Sources must be smaller than 4GB so that offsets fit in 32 bits.
+
+typedef struct
+{
+    const char*     origin;         // Description of where the source came from (for error messages).
+    const char*     source;         // Start of the source code.
+    const char*     sourceEnd;      // One past the end of the source code.
+    i64             numTokens;
+    Arena           starts;         // u32 offset of each token's text.
+    Arena           ends;           // u32 offset of one past the end of each token's text.
+    Arena           kinds;          // u8 NeToken of each token.
+    Arena           atoms;          // Atom for each token that carries one.
+    Arena           lines;          // u32 offset of the start of each line, or empty if not built yet.
+}
+TokenList;
+
+//----------------------------------------------------------------------------------------------------------------------
+// Return non-zero if a token has an atom stored in the token list.
+
+static int tokenHasAtom(NeToken token)
+{
+    return token == NeToken_Number || token == NeToken_Character || token == NeToken_Symbol;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Only the benchmarks and the fuzzer build token lists.
+
+#if NE_BENCH || NE_FUZZ
+
+static void tokenListDone(Nerd N, TokenList* list)
+{
+#if NE_STATS
+    N->stats.tokenGrowths += list->starts.numGrowths + list->ends.numGrowths + list->kinds.numGrowths +
+        list->atoms.numGrowths + list->lines.numGrowths;
+#endif
+    arenaDone(N, &list->starts);
+    arenaDone(N, &list->ends);
+    arenaDone(N, &list->kinds);
+    arenaDone(N, &list->atoms);
+    arenaDone(N, &list->lines);
+    list->numTokens = 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Add a token to the token list.  Returns 1 or 0 if it ran out of memory.
+
+static int tokenListAdd(Nerd N, TokenList* list, const NeLexInfo* info)
+{
+    u32* start = (u32 *)arenaAlloc(N, &list->starts, sizeof(u32));
+    u32* end = (u32 *)arenaAlloc(N, &list->ends, sizeof(u32));
+    u8* kind = (u8 *)arenaAlloc(N, &list->kinds, sizeof(u8));
+    if (!start || !end || !kind) return 0;
+
+    *start = (u32)(info->start - list->source);
+    *end = (u32)(info->end - list->source);
+    *kind = (u8)info->token;
+    ++list->numTokens;
+
+    if (tokenHasAtom(info->token))
+    {
+        Atom* atom = (Atom *)arenaAlloc(N, &list->atoms, sizeof(Atom));
+        if (!atom) return 0;
+        *atom = info->atom;
+    }
+
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Return the line number of a token, building the line index the first time it's needed.  Lines are counted the same
+// way as nextChar() does, so "\r\n" is a single newline.  Only the fuzzer needs it.
+
+#if NE_FUZZ
+
+static i64 tokenLine(Nerd N, TokenList* list, i64 index)
+{
+    assert(index >= 0 && index < list->numTokens);
+
+    if (list->lines.cursor == 0)
+    {
+        u32* first = (u32 *)arenaAlloc(N, &list->lines, sizeof(u32));
+        if (!first) return 0;
+        *first = 0;
+
+        for (const char* p = list->source; p < list->sourceEnd; ++p)
+        {
+            if (*p == '\r' && (p + 1) < list->sourceEnd && p[1] == '\n') ++p;
+            if (*p == '\r' || *p == '\n')
+            {
+                u32* lineStart = (u32 *)arenaAlloc(N, &list->lines, sizeof(u32));
+                if (!lineStart) return 0;
+                *lineStart = (u32)(p + 1 - list->source);
+            }
+        }
+    }
+
+    // Find the last line that starts at or before the token.
+    u32 offset = ((const u32 *)list->starts.start)[index];
+    const u32* lines = (const u32 *)list->lines.start;
+    i64 lo = 0;
+    i64 hi = list->lines.cursor / (i64)sizeof(u32);
+    while (hi - lo > 1)
+    {
+        i64 mid = lo + (hi - lo) / 2;
+        if (lines[mid] <= offset)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    return lo + 1;
+}
+
+#endif // NE_FUZZ
+
+//----------------------------------------------------------------------------------------------------------------------
+// Analyse some source code and obtain all of its tokens in one go as a token list.  NeRun doesn't use this since it
+// pulls tokens from lexNext as it reads, but it's useful for tools that want the whole token list.  Returns 1 or 0 if
+// there was a lexical error, in which case the list is empty.
+
+static int lex(Nerd N, const char* origin, const char* start, const char* end, TokenList* outList)
+{
+    TokenList* list = outList;
+    list->origin = origin;
+    list->source = start;
+    list->sourceEnd = end;
+    list->numTokens = 0;
+
+    // Guess at one token for every 8 characters.  There can't be more tokens than characters, or more lines than
+    // characters plus one, so virtual arenas reserve that much.
+    i64 guess = NE_MAX((end - start) / 8, 256);
+    i64 most = NE_MIN((i64)(end - start), (i64)UINT32_MAX) + 1;
+    arenaInitVirtual(N, &list->starts, guess * sizeof(u32), most * sizeof(u32));
+    arenaInitVirtual(N, &list->ends, guess * sizeof(u32), most * sizeof(u32));
+    arenaInitVirtual(N, &list->kinds, guess, most);
+    arenaInitVirtual(N, &list->atoms, 4096, most * sizeof(Atom));
+    arenaInitVirtual(N, &list->lines, 4096, most * sizeof(u32));
+
+    if ((u64)(end - start) > UINT32_MAX)
+    {
+        NeOut(N, "%s: LEX ERROR: Source is too large.\n", origin);
+        tokenListDone(N, list);
+        return 0;
+    }
+
+    NeLex L;
+    lexInit(&L, origin, start, end);
+
+    NeToken t = NeToken_Unknown;
+    while (t != NeToken_Error && t != NeToken_EOF)
+    {
+        NeLexInfo li;
+        t = lexNext(N, &L, &li);
+        if (t != NeToken_Error && t != NeToken_EOF)
+        {
+            if (!tokenListAdd(N, list, &li)) t = NeToken_Error;
+        }
+    }
+
+    if (t == NeToken_Error)
+    {
+        tokenListDone(N, list);
+        return 0;
+    }
+
+    return 1;
+}
+
+#endif // NE_BENCH || NE_FUZZ
+
+//----------------------------------------------------------------------------------------------------------------------{READ}
+//----------------------------------------------------------------------------------------------------------------------
+// R E A D I N G
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------------------------------------------------
+// The reader pulls tokens either straight from a lexer as it needs them, or from a token list produced by lex().
+
+typedef struct
+{
+    NeLex*              lex;            // Lexer to pull tokens from, or 0 if reading a token list.
+    const TokenList*    list;           // Token list to read from if there's no lexer.
+    i64                 nextToken;      // Index of the next token in the token list.
+    i64                 nextAtom;       // Index of the next atom in the token list.
+    GcObj*              source;         // Object owning the source text, or 0 if it may not outlive the read.
+    i64                 line;           // Line of the start of the last datum read, or 0 if it isn't known.
+}
+NeReader;
+
+typedef enum
+{
+    RR_Error,               // The datum couldn't be read.
+    RR_Atom,                // An atom was read.
+    RR_EOF,                 // There are no more atoms in the source.
+}
+ReadResult;
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static void readerInitStream(NeReader* R, NeLex* L)
+{
+    R->lex = L;
+    R->list = 0;
+    R->nextToken = 0;
+    R->nextAtom = 0;
+    R->source = 0;
+    R->line = 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+#if NE_FUZZ
+
+static void readerInitTokens(NeReader* R, const TokenList* list)
+{
+    R->lex = 0;
+    R->list = list;
+    R->nextToken = 0;
+    R->nextAtom = 0;
+    R->source = 0;
+    R->line = 0;
+}
+
+#endif // NE_FUZZ
+
+//----------------------------------------------------------------------------------------------------------------------
+// Fetch the next token from the reader's source.  Tokens from a token list don't have their line filled in; use
+// tokenLine() if it's needed.
+
+static NeToken readerNextToken(Nerd N, NeReader* R, NeLexInfo* outInfo)
+{
+    if (R->lex)
+    {
+        return lexNext(N, R->lex, outInfo);
+    }
+    else if (R->nextToken < R->list->numTokens)
+    {
+        const TokenList* list = R->list;
+        i64 i = R->nextToken++;
+        outInfo->start = list->source + ((const u32 *)list->starts.start)[i];
+        outInfo->end = list->source + ((const u32 *)list->ends.start)[i];
+        outInfo->line = 0;
+        outInfo->token = (NeToken)((const u8 *)list->kinds.start)[i];
+        outInfo->atom = tokenHasAtom(outInfo->token)
+            ? ((const Atom *)list->atoms.start)[R->nextAtom++]
+            : NeMakeNil();
+        return outInfo->token;
+    }
+    else
+    {
+        return NeToken_EOF;
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static ReadResult nextAtom(Nerd N, NeReader* R, Atom* outAtom)
+{
+    NeLexInfo info;
+    const NeLexInfo* t = &info;
+    ReadResult result = RR_Atom;
+
+    NeToken token = readerNextToken(N, R, &info);
+    R->line = info.line;
+
+    switch (token)
+    {
+    case NeToken_EOF:
+        result = RR_EOF;
+        break;
+
+    case NeToken_Number:
+    case NeToken_Character:
+    case NeToken_Symbol:
+        // The lexical analyser did the hard work for us!
+        *outAtom = t->atom;
+        break;
+
+    case NeToken_Nil:
+        *outAtom = NeMakeNil();
+        break;
+
+    case NeToken_Yes:
+        *outAtom = NeMakeBool(1);
+        break;
+
+    case NeToken_No:
+        *outAtom = NeMakeBool(0);
+        break;
+
+    case NeToken_String:
+        *outAtom = stringMake(N, t->start, t->end, R->source);
+        break;
+
+    default:
+        // #todo: add error message.
+        result = RR_Error;
+    }
+
+    return result;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+NeReadStatus NeCheckComplete(Nerd N, const char* source, i64 size)
+{
+    if (size == -1) size = (i64)strlen(source);
+
+    NeLex L;
+    lexInit(&L, "<check>", source, source + size);
+    L.quiet = 1;
+
+    NeLexInfo li;
+    NeToken t = NeToken_Unknown;
+    while (t != NeToken_Error && t != NeToken_EOF) t = lexNext(N, &L, &li);
+
+    if (L.incomplete) return NRS_Incomplete;
+    return t == NeToken_Error ? NRS_Error : NRS_Complete;
+}
+
+//----------------------------------------------------------------------------------------------------------------------{IMAGE}
+//----------------------------------------------------------------------------------------------------------------------
+// B Y T E - C O D E   I M A G E S
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------------------------------------------------
+// An image holds the code objects compiled from a source file so that starting up doesn't need to lex, read and
+// compile the file again.  It is written next to the source file by NeRunFile and mapped back in with mapFileFunc.
+// The layout is:
+//
+//      ImageHeader
+//      ImageCode       [numCodes]          One for each top-level datum, in order of execution.
+//      ImageConstant   [numConstants]      Constant pools of all the code objects.
+//      ImageRange      [numSymbols]        Names of the symbols in chars.
+//      ImageRange      [numStrings]        Contents of the strings in chars.
+//      u8              [opsSize]           Byte-code of all the code objects.
+//      char            [charsSize]         Characters of the symbols and strings.
+//
+// Everything is in the host's byte order since images are only a cache.  Constants that refer to symbols and strings
+// hold indices that are only resolved when the code object that uses them is about to run.  The byte-code and long
+// strings are used directly from the mapping.  The image is ignored if the hash of the source doesn't match.
+
+#define NE_IMAGE_MAGIC          0x49445245      // 'ERDI'
+#define NE_IMAGE_VERSION        2               // Increase whenever the opcodes or this format changes.
+#define NE_IMAGE_EXTENSION      ".nbc"
+
+typedef struct
+{
+    u32 magic;
+    u32 version;
+    u64 sourceHash;                     // FNV-1a hash of the source's contents.
+    u64 sourceSize;                     // Size of the source in bytes.
+    u32 numCodes;
+    u32 numConstants;
+    u32 numSymbols;
+    u32 numStrings;
+    u64 opsSize;
+    u64 charsSize;
+}
+ImageHeader;
+
+typedef struct
+{
+    u32 opsOffset;                      // Offset of the byte-code within the ops section.
+    u32 numOps;                         // Size of the byte-code.
+    u32 firstConstant;                  // Index of the first constant in the constants section.
+    u32 numConstants;                   // Number of constants.
+    u32 maxStack;
+    u32 numCaches;                      // Number of inline caches the byte-code uses.
+}
+ImageCode;
+
+typedef enum
+{
+    IC_Nil,
+    IC_Integer,                         // value is the integer.
+    IC_Boolean,                         // value is 0 or 1.
+    IC_Character,                       // value is the character.
+    IC_Symbol,                          // value is the index of the symbol.
+    IC_String,                          // value is the index of the string.
+}
+ImageConstantKind;
+
+typedef struct
+{
+    u32 kind;                           // One of ImageConstantKind.
+    u32 padding;
+    i64 value;
+}
+ImageConstant;
+
+typedef struct
+{
+    u64 offset;                         // Offset within the chars section.
+    u64 size;
+}
+ImageRange;
+
+//----------------------------------------------------------------------------------------------------------------------
+// Append to one of the image sections being written.
+
+static int imageAdd(Nerd N, Arena* section, const void* data, i64 size)
+{
+    void* p = arenaAlloc(N, section, size);
+    if (p) memcpy(p, data, (size_t)size);
+    return p != 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Find the index of a symbol in the image being written, adding it if necessary.  Symbols are found with a table of
+// pointers using open addressing.
+
+static i64 imageSymbol(Nerd N, SymbolObject** table, i64 capacity, Arena* symbols, Arena* chars, SymbolObject* sym)
+{
+    i64 mask = capacity - 1;
+    i64 i = (i64)(((uintptr_t)sym >> 4) & (uintptr_t)mask);
+    for (; table[i]; i = (i + 1) & mask)
+    {
+        if (table[i] == sym)
+        {
+            // The symbol's index was stashed in the slot after the table.
+            return (i64)(uintptr_t)table[capacity + i];
+        }
+    }
+
+    i64 index = symbols->cursor / (i64)sizeof(ImageRange);
+    ImageRange range = { .offset = (u64)chars->cursor, .size = (u64)sym->size };
+    if (!imageAdd(N, symbols, &range, sizeof(range)) || !imageAdd(N, chars, symbolName(sym), sym->size)) return -1;
+
+    table[i] = sym;
+    table[capacity + i] = (SymbolObject *)(uintptr_t)index;
+    return index;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Write an image of the code objects.  Nothing is written if any constant can't be stored in an image.
+
+static int imageWrite(Nerd N, const char* path, u64 sourceHash, i64 sourceSize, const Atom* codes, i64 numCodes)
+{
+    enum { S_Codes, S_Constants, S_Symbols, S_Strings, S_Ops, S_Chars, S_COUNT };
+    Arena sections[S_COUNT];
+    for (int i = 0; i < S_COUNT; ++i) arenaInit(N, &sections[i], 4096);
+
+    // There can't be more symbols than constants, so size the table for them all at 50% load.
+    i64 totalConstants = 0;
+    for (i64 i = 0; i < numCodes; ++i) totalConstants += ((CodeObject *)(NE_ATOM_OBJ(codes[i]) + 1))->numConstants;
+    i64 capacity = 64;
+    while (capacity < totalConstants * 2) capacity *= 2;
+    i64 tableSize = sizeof(SymbolObject*) * capacity * 2;
+    SymbolObject** table = (SymbolObject**)NeAlloc(N, tableSize);
+    int ok = table != 0;
+    if (ok) memset(table, 0, (size_t)tableSize);
+
+    i64 numConstants = 0;
+    for (i64 i = 0; ok && i < numCodes; ++i)
+    {
+        CodeObject* code = (CodeObject *)(NE_ATOM_OBJ(codes[i]) + 1);
+        ImageCode ic = {
+            .opsOffset = (u32)sections[S_Ops].cursor,
+            .numOps = (u32)code->numOps,
+            .firstConstant = (u32)numConstants,
+            .numConstants = (u32)code->numConstants,
+            .maxStack = (u32)code->maxStack,
+            .numCaches = (u32)code->numCaches,
+        };
+        ok = imageAdd(N, &sections[S_Codes], &ic, sizeof(ic)) &&
+             imageAdd(N, &sections[S_Ops], code->ops, code->numOps);
+
+        for (i64 k = 0; ok && k < code->numConstants; ++k)
+        {
+            Atom a = code->constants[k];
+            ImageConstant c = { 0 };
+            switch (NE_ATOM_TYPE(a))
+            {
+            case AT_Nil:        c.kind = IC_Nil;                                    break;
+            case AT_Integer:    c.kind = IC_Integer;    c.value = NE_ATOM_INT(a);   break;
+            case AT_Boolean:    c.kind = IC_Boolean;    c.value = NE_ATOM_BOOL(a);  break;
+            case AT_Character:  c.kind = IC_Character;  c.value = NE_ATOM_CHAR(a);  break;
+
+            case AT_Object:
+                if (NE_ATOM_OBJ(a)->type == (u32)N->symbolType)
+                {
+                    c.kind = IC_Symbol;
+                    c.value = imageSymbol(N, table, capacity, &sections[S_Symbols], &sections[S_Chars],
+                        (SymbolObject *)(NE_ATOM_OBJ(a) + 1));
+                    ok = c.value >= 0;
+                }
+                else if (NE_ATOM_OBJ(a)->type == (u32)N->stringType)
+                {
+                    StringObject* str = (StringObject *)(NE_ATOM_OBJ(a) + 1);
+                    ImageRange range = { .offset = (u64)sections[S_Chars].cursor, .size = (u64)str->size };
+                    c.kind = IC_String;
+                    c.value = sections[S_Strings].cursor / (i64)sizeof(ImageRange);
+                    ok = imageAdd(N, &sections[S_Strings], &range, sizeof(range)) &&
+                         imageAdd(N, &sections[S_Chars], stringChars(str), str->size);
+                }
+                else
+                {
+                    ok = 0;
+                }
+                break;
+
+            default:
+                ok = 0;
+            }
+
+            ok = ok && imageAdd(N, &sections[S_Constants], &c, sizeof(c));
+            ++numConstants;
+        }
+    }
+
+    if (ok)
+    {
+        ImageHeader header = {
+            .magic = NE_IMAGE_MAGIC,
+            .version = NE_IMAGE_VERSION,
+            .sourceHash = sourceHash,
+            .sourceSize = (u64)sourceSize,
+            .numCodes = (u32)numCodes,
+            .numConstants = (u32)numConstants,
+            .numSymbols = (u32)(sections[S_Symbols].cursor / sizeof(ImageRange)),
+            .numStrings = (u32)(sections[S_Strings].cursor / sizeof(ImageRange)),
+            .opsSize = (u64)sections[S_Ops].cursor,
+            .charsSize = (u64)sections[S_Chars].cursor,
+        };
+
+        FILE* f = fopen(path, "wb");
+        ok = f && fwrite(&header, sizeof(header), 1, f) == 1;
+        for (int i = 0; ok && i < S_COUNT; ++i)
+        {
+            size_t size = (size_t)sections[i].cursor;
+            ok = (size == 0) || fwrite(sections[i].start, size, 1, f) == 1;
+        }
+        if (f) fclose(f);
+        if (f && !ok) remove(path);
+    }
+
+    NeFree(N, table, tableSize);
+    for (int i = 0; i < S_COUNT; ++i) arenaDone(N, &sections[i]);
+    return ok;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Check that a range of characters lies within the chars section.
+
+static int imageCheckRange(const ImageHeader* h, const ImageRange* r)
+{
+    return r->offset <= h->charsSize && r->size <= h->charsSize - r->offset;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Check that a code object's byte-code can be run as it is: every opcode is known, every operand is within the
+// byte-code, every constant index is within the code's pool and refers to the right kind of constant, every inline
+// cache index is within the code's caches, the stack never goes below empty or above maxStack, and the code reaches a
+// Return.  The interpreter checks none of this.
+
+static int imageCheckCode(const ImageHeader* h, const ImageCode* ic, const ImageConstant* constants, const u8* ops)
+{
+    if ((u64)ic->opsOffset + ic->numOps > h->opsSize ||
+        (u64)ic->firstConstant + ic->numConstants > h->numConstants ||
+        ic->numConstants > NE_MAX_CONSTANTS ||
+        ic->numCaches > NE_MAX_CACHES ||
+        ic->maxStack > ic->numOps)
+    {
+        return 0;
+    }
+
+    const ImageConstant* pool = constants + ic->firstConstant;
+    const u8* ip = ops + ic->opsOffset;
+    const u8* end = ip + ic->numOps;
+    i64 depth = 0;
+
+    while (ip < end)
+    {
+        u8 op = *ip++;
+        switch (op)
+        {
+        case OP_Nil:
+        case OP_Yes:
+        case OP_No:
+            ++depth;
+            break;
+
+        case OP_Int8:
+            if (end - ip < 1) return 0;
+            ++ip;
+            ++depth;
+            break;
+
+        case OP_Const:
+        case OP_Global:
+        case OP_Eval:
+            {
+                i64 size = (op == OP_Eval) ? 4 : 2;
+                if (end - ip < size) return 0;
+                i64 k = (i64)ip[0] | ((i64)ip[1] << 8);
+                if (k >= ic->numConstants) return 0;
+                u32 kind = pool[k].kind;
+                if (op == OP_Global && kind != IC_Symbol) return 0;
+                if (op == OP_Eval && kind != IC_Symbol && kind != IC_String) return 0;
+                if (op == OP_Eval && ((i64)ip[2] | ((i64)ip[3] << 8)) >= ic->numCaches) return 0;
+                ip += size;
+                ++depth;
+            }
+            break;
+
+        case OP_Pop:
+            if (--depth < 0) return 0;
+            break;
+
+        case OP_Return:
+            return depth > 0;
+
+        default:
+            return 0;
+        }
+
+        if (depth > ic->maxStack) return 0;
+    }
+
+    // The byte-code ran off the end without returning.
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Check that a mapped image is valid for the source, that all its sections fit in the file, and that everything in
+// it refers to something else in it.  Nothing read from the image needs checking again after this.
+
+static const ImageHeader* imageValidate(const SourceObject* image, u64 sourceHash, i64 sourceSize)
+{
+    const ImageHeader* h = (const ImageHeader *)image->data;
+    if (image->size < (i64)sizeof(ImageHeader) ||
+        h->magic != NE_IMAGE_MAGIC ||
+        h->version != NE_IMAGE_VERSION ||
+        h->sourceHash != sourceHash ||
+        h->sourceSize != (u64)sourceSize ||
+        h->opsSize > (u64)image->size ||
+        h->charsSize > (u64)image->size)
+    {
+        return 0;
+    }
+
+    u64 size = sizeof(ImageHeader) +
+        (u64)h->numCodes * sizeof(ImageCode) +
+        (u64)h->numConstants * sizeof(ImageConstant) +
+        ((u64)h->numSymbols + h->numStrings) * sizeof(ImageRange) +
+        h->opsSize + h->charsSize;
+    if (size != (u64)image->size) return 0;
+
+    const ImageCode* codes = (const ImageCode *)(h + 1);
+    const ImageConstant* constants = (const ImageConstant *)(codes + h->numCodes);
+    const ImageRange* ranges = (const ImageRange *)(constants + h->numConstants);
+    const u8* ops = (const u8 *)(ranges + h->numSymbols + h->numStrings);
+
+    for (u64 i = 0; i < (u64)h->numSymbols + h->numStrings; ++i)
+    {
+        if (!imageCheckRange(h, &ranges[i])) return 0;
+    }
+
+    for (u32 i = 0; i < h->numConstants; ++i)
+    {
+        const ImageConstant* c = &constants[i];
+        switch (c->kind)
+        {
+        case IC_Nil:
+        case IC_Integer:
+            break;
+
+        case IC_Boolean:
+            if (c->value != 0 && c->value != 1) return 0;
+            break;
+
+        case IC_Character:
+            if ((i64)(char)c->value != c->value) return 0;
+            break;
+
+        case IC_Symbol:
+            if (c->value < 0 || (u64)c->value >= h->numSymbols) return 0;
+            break;
+
+        case IC_String:
+            if (c->value < 0 || (u64)c->value >= h->numStrings) return 0;
+            break;
+
+        default:
+            return 0;
+        }
+    }
+
+    for (u32 i = 0; i < h->numCodes; ++i)
+    {
+        if (!imageCheckCode(h, &codes[i], constants, ops)) return 0;
+    }
+
+    return h;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Run an image if it exists, was built from the source and passes imageValidate().  Returns 0 if the image couldn't be
+// used, otherwise 1 with the result of running it in outSuccess.
+
+static int imageRun(Nerd N, const char* path, u64 sourceHash, i64 sourceSize, int* outSuccess, Atom* outResult)
+{
+    SourceInit init = { .path = path };
+    SourceObject* image = (SourceObject *)NeObjectCreate(N, N->sourceType, &init);
+    if (!image) return 0;
+
+    const ImageHeader* h = imageValidate(image, sourceHash, sourceSize);
+    if (!h) return 0;
+
+    GcObj* owner = (GcObj *)image - 1;
+    NeRootPush(N, NeMakeObject(N, image));
+
+    const ImageCode* codes = (const ImageCode *)(h + 1);
+    const ImageConstant* constants = (const ImageConstant *)(codes + h->numCodes);
+    const ImageRange* symbols = (const ImageRange *)(constants + h->numConstants);
+    const ImageRange* strings = symbols + h->numSymbols;
+    const u8* ops = (const u8 *)(strings + h->numStrings);
+    const char* chars = (const char *)(ops + h->opsSize);
+
+    // Symbols are interned the first time a code object that uses them runs.
+    i64 symbolsSize = sizeof(SymbolObject*) * (i64)h->numSymbols;
+    SymbolObject** symbolCache = (SymbolObject **)NeAlloc(N, NE_MAX(symbolsSize, 1));
+    int result = symbolCache != 0;
+    if (result) memset(symbolCache, 0, (size_t)symbolsSize);
+
+    // Images don't record lines, so the profiler only sees the image.
+    ProfileFrame frame;
+    profileEnter(N, &frame, path);
+
+    *outResult = NeMakeNil();
+    for (u32 i = 0; result && i < h->numCodes; ++i)
+    {
+        const ImageCode* ic = &codes[i];
+        CodeObject* code = (CodeObject *)NeObjectCreate(N, N->codeType, 0);
+        if (!code)
+        {
+            result = 0;
+            break;
+        }
+        NeRootPush(N, NeMakeObject(N, code));
+
+        code->ops = (u8 *)ops + ic->opsOffset;
+        code->numOps = ic->numOps;
+        code->owner = owner;
+        code->maxStack = ic->maxStack;
+        code->constants = (Atom *)NeAlloc(N, sizeof(Atom) * NE_MAX(ic->numConstants, 1));
+        code->constantsCapacity = NE_MAX(ic->numConstants, 1);
+        code->caches = ic->numCaches ? (EvalCache *)NeAlloc(N, sizeof(EvalCache) * ic->numCaches) : 0;
+        code->cachesCapacity = ic->numCaches;
+        code->numCaches = ic->numCaches;
+        result = code->constants != 0 && (code->caches || !ic->numCaches);
+        if (code->caches) memset(code->caches, 0, sizeof(EvalCache) * ic->numCaches);
+
+        for (u32 k = 0; result && k < ic->numConstants; ++k)
+        {
+            const ImageConstant* c = &constants[ic->firstConstant + k];
+            Atom a = NeMakeNil();
+            switch (c->kind)
+            {
+            case IC_Nil:        a = NeMakeNil();                    break;
+            case IC_Integer:    a = NeMakeInt(c->value);            break;
+            case IC_Boolean:    a = NeMakeBool((int)c->value);      break;
+            case IC_Character:  a = NeMakeChar((char)c->value);     break;
+
+            case IC_Symbol:
                 {
-                    NeScratchAdd(N, info->name, info->name + strlen(info->name));
+                    const ImageRange* r = &symbols[c->value];
+                    if (!symbolCache[c->value])
+                    {
+                        const char* name = chars + r->offset;
+                        symbolCache[c->value] = symbolIntern(N, hash(name, name + r->size), name, name + r->size);
+                    }
+                    result = symbolCache[c->value] != 0;
+                    if (result) a = NeMakeObject(N, symbolCache[c->value]);
                 }
-                else
+                break;
+
+            case IC_String:
                 {
-                    NeScratchFormat(N, "object");
+                    const ImageRange* r = &strings[c->value];
+                    a = stringMakeRaw(N, chars + r->offset, chars + r->offset + r->size, owner);
+                    result = NE_ATOM_TYPE(a) == AT_Object;
                 }
-                NeScratchFormat(N, ":%x>", value.obj + 1);
+                break;
+
+            default:
+                result = 0;
             }
+
+            NeWriteBarrier(N, code, a);
+            code->constants[k] = a;
+            code->numConstants = k + 1;
         }
-        break;
 
-    default:
-        NeScratchFormat(N, "<invalid atom>");
-        assert(0);
+        if (result) result = exec(N, code, outResult);
+        NE_PROFILE_CHECK(N, 0, 0);
+        NeRootPop(N, 1);
+    }
+
+    profileLeave(N, &frame);
+
+    NeFree(N, symbolCache, NE_MAX(symbolsSize, 1));
+    NeRootPop(N, 1);
+
+    N->lastResult = result ? *outResult : NeMakeNil();
+    *outSuccess = result;
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------{EXEC}
+//----------------------------------------------------------------------------------------------------------------------
+// E X E C U T I O N
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------------------------------------------------
+// Read and evaluate all the source code.  If sourceObj is not 0, it owns the source code.  If keepCode is non-zero,
+// each code object compiled is left on the root stack.
+
+static int run(Nerd N, const char* origin, const char* start, const char* end, GcObj* sourceObj, int keepCode,
+    Atom* outResult)
+{
+    // Tokens are lexed on demand as the reader needs them, so evaluation starts straight away.
+    *outResult = NeMakeNil();
+    NeLex L;
+    NeReader R;
+    lexInit(&L, origin, start, end);
+    readerInitStream(&R, &L);
+    R.source = sourceObj;
+
+    int result = 1;
+    ReadResult rr = RR_EOF;
+    ProfileFrame frame;
+    ++N->runDepth;
+    profileEnter(N, &frame, origin);
+
+    while (result && (rr = nextAtom(N, &R, outResult)) == RR_Atom)
+    {
+        frame.line = R.line;
+
+        // Keep the atom, and then its code, alive while it's compiled and executed.
+        NeRootPush(N, *outResult);
+        CodeObject* code = compile(N, *outResult);
+        NeRootPop(N, 1);
+        if (code)
+        {
+            NeRootPush(N, NeMakeObject(N, code));
+            result = exec(N, code, outResult);
+            NE_PROFILE_CHECK(N, 0, 0);
+            if (!keepCode) NeRootPop(N, 1);
+        }
+        else
+        {
+            result = 0;
+        }
+    }
+
+    if (result && rr == RR_Error) result = 0;
+
+    // Don't leave the value of the last datum that succeeded, or the datum that failed, as the result.
+    if (!result) *outResult = NeMakeNil();
+
+    profileLeave(N, &frame);
+    --N->runDepth;
+    N->lastResult = *outResult;
+    return result;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+int NeRun(Nerd N, char* origin, char* source, i64 size, Atom* outResult)
+{
+    if (size == -1)
+    {
+        size = (i64)strlen(source);
+    }
+
+    int result = run(N, origin, source, source + size, 0, 0, outResult);
+    gcSafePoint(N, outResult);
+    NeFlush(N);
+    return result;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+int NeRunFile(Nerd N, const char* path, Atom* outResult)
+{
+    SourceInit init = { .path = path };
+    SourceObject* src = (SourceObject *)NeObjectCreate(N, N->sourceType, &init);
+    if (!src)
+    {
+        NeOut(N, "%s: ERROR: Cannot open file.\n", path);
+        NeFlush(N);
+        *outResult = NeMakeNil();
+        return 0;
+    }
+
+    // The source object is only kept alive by the strings that refer to it once the run is over.
+    int numRoots = (int)(N->roots.cursor / sizeof(Atom));
+    NeRootPush(N, NeMakeObject(N, src));
+    int result = 0;
+    ++N->runDepth;
+
+    if (N->config.imageCache)
+    {
+        // Run the image if it was compiled from the same source, otherwise compile the source and write the image.
+        i64 pathLen = (i64)strlen(path);
+        char* imagePath = (char *)NeAlloc(N, pathLen + sizeof(NE_IMAGE_EXTENSION));
+        if (imagePath)
+        {
+            memcpy(imagePath, path, (size_t)pathLen);
+            memcpy(imagePath + pathLen, NE_IMAGE_EXTENSION, sizeof(NE_IMAGE_EXTENSION));
+
+            u64 sourceHash = hash(src->data, src->data + src->size);
+            if (!imageRun(N, imagePath, sourceHash, src->size, &result, outResult))
+            {
+                result = run(N, path, src->data, src->data + src->size, (GcObj *)src - 1, 1, outResult);
+                if (result)
+                {
+                    Atom* codes = (Atom *)N->roots.start + numRoots + 1;
+                    i64 numCodes = N->roots.cursor / (i64)sizeof(Atom) - (numRoots + 1);
+                    imageWrite(N, imagePath, sourceHash, src->size, codes, numCodes);
+                }
+            }
+
+            NeFree(N, imagePath, pathLen + sizeof(NE_IMAGE_EXTENSION));
+        }
+    }
+    else
+    {
+        result = run(N, path, src->data, src->data + src->size, (GcObj *)src - 1, 0, outResult);
+    }
+
+    --N->runDepth;
+    NeRootPop(N, (int)(N->roots.cursor / sizeof(Atom)) - numRoots);
+    if (!result) *outResult = NeMakeNil();
+    gcSafePoint(N, outResult);
+    NeFlush(N);
+    return result;
+}
+
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------------------------------------------------{WORKERS}
+//----------------------------------------------------------------------------------------------------------------------
+// W O R K E R   P O O L S
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------------------------------------------------
+// Each worker has a double-ended queue of jobs.  New jobs are handed out to the workers in turn.  A worker takes jobs
+// from the back of its own queue and, when that's empty, steals from the front of the others' queues.  Each queue has
+// its own lock so workers only contend when stealing.  The pool's lock protects the job counts and is what idle
+// workers and NeWorkersWait sleep on.
+
+typedef struct
+{
+    char*           origin;         // Copy of the origin, followed by the source.
+    char*           source;
+    i64             size;           // Size of the source.
+    NeJobDoneFunc   doneFunc;
+    void*           context;
+}
+WorkerJob;
+
+typedef struct
+{
+    struct _NeWorkers*  W;
+    Nerd                N;          // The worker's VM.
+    void*               thread;
+    void*               lock;       // Protects the queue.
+    WorkerJob*          jobs;       // Circular buffer of jobs.
+    i64                 capacity;   // Size of the buffer (always a power of 2).
+    i64                 front;      // Index of the first job (wraps around the buffer).
+    i64                 count;      // Number of jobs in the queue.
+}
+Worker;
+
+struct _NeWorkers
+{
+    NeConfig            config;
+    Worker*             workers;
+    int                 numWorkers;
+    void*               lock;       // Protects the counts below.
+    i64                 queued;     // Jobs in the queues.
+    i64                 pending;    // Jobs submitted but not finished.
+    i64                 nextWorker; // Worker to give the next job to.
+    int                 quit;       // Set to stop the workers once the queues are empty.
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// Memory for a pool isn't owned by any one VM.
+
+static void* workersAlloc(NeWorkers W, i64 size)
+{
+    return W->config.memoryFunc(0, 0, 0, size);
+}
+
+static void workersFree(NeWorkers W, void* p, i64 size)
+{
+    if (p) W->config.memoryFunc(0, p, size, 0);
+}
+
+static void workersFreeJob(NeWorkers W, WorkerJob* job)
+{
+    workersFree(W, job->origin, (i64)strlen(job->origin) + 1 + job->size + 1);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Add a job to the back of a worker's queue.  Returns 1 or 0 if out of memory.
+
+static int workerPush(NeWorkers W, Worker* w, const WorkerJob* job)
+{
+    const NeThreadFuncs* t = &W->config.threads;
+    int result = 1;
+
+    t->lock(w->lock);
+    if (w->count == w->capacity)
+    {
+        // Grow the buffer, unwrapping the jobs.
+        i64 newCapacity = w->capacity ? w->capacity * 2 : 16;
+        WorkerJob* jobs = (WorkerJob *)workersAlloc(W, sizeof(WorkerJob) * newCapacity);
+        if (jobs)
+        {
+            for (i64 i = 0; i < w->count; ++i) jobs[i] = w->jobs[(w->front + i) & (w->capacity - 1)];
+            workersFree(W, w->jobs, sizeof(WorkerJob) * w->capacity);
+            w->jobs = jobs;
+            w->capacity = newCapacity;
+            w->front = 0;
+        }
+        else
+        {
+            result = 0;
+        }
+    }
+    if (result)
+    {
+        w->jobs[(w->front + w->count) & (w->capacity - 1)] = *job;
+        ++w->count;
+    }
+    t->unlock(w->lock);
+
+    return result;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Take a job from the back of a worker's queue, or if stealing, from the front.  Returns 1 or 0 if it was empty.
+
+static int workerTake(NeWorkers W, Worker* w, int steal, WorkerJob* outJob)
+{
+    const NeThreadFuncs* t = &W->config.threads;
+    int result = 0;
+
+    t->lock(w->lock);
+    if (w->count)
+    {
+        if (steal)
+        {
+            *outJob = w->jobs[w->front];
+            w->front = (w->front + 1) & (w->capacity - 1);
+        }
+        else
+        {
+            *outJob = w->jobs[(w->front + w->count - 1) & (w->capacity - 1)];
+        }
+        --w->count;
+        result = 1;
+    }
+    t->unlock(w->lock);
+
+    return result;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+static void workerMain(void* arg)
+{
+    Worker* w = (Worker *)arg;
+    NeWorkers W = w->W;
+    const NeThreadFuncs* t = &W->config.threads;
+    i64 index = w - W->workers;
+
+    for (;;)
+    {
+        // Look for a job in our own queue first, then try the others.
+        WorkerJob job;
+        int found = workerTake(W, w, 0, &job);
+        for (int i = 1; !found && i < W->numWorkers; ++i)
+        {
+            found = workerTake(W, &W->workers[(index + i) % W->numWorkers], 1, &job);
+        }
+
+        if (found)
+        {
+            t->lock(W->lock);
+            --W->queued;
+            t->unlock(W->lock);
+
+            Atom result = NeMakeNil();
+            int success = NeRun(w->N, job.origin, job.source, job.size, &result);
+            if (job.doneFunc) job.doneFunc(w->N, job.context, success, result);
+            workersFreeJob(W, &job);
+
+            t->lock(W->lock);
+            if (--W->pending == 0) t->wakeAll(W->lock);
+            t->unlock(W->lock);
+        }
+        else
+        {
+            // Sleep until there are more jobs.  Jobs may already be counted before they are in a queue, in which case
+            // we go round again.
+            t->lock(W->lock);
+            while (!W->queued && !W->quit) t->wait(W->lock);
+            int quit = W->quit && !W->queued;
+            t->unlock(W->lock);
+            if (quit) break;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+NeWorkers NeWorkersOpen(const NeConfig* config, int numWorkers)
+{
+    assert(config);
+    const NeThreadFuncs* t = &config->threads;
+    if (numWorkers < 1 || !t->createThread || !t->createLock) return 0;
+
+    NeWorkers W = (NeWorkers)config->memoryFunc(0, 0, 0, sizeof(struct _NeWorkers));
+    if (!W) return 0;
+    memset(W, 0, sizeof(*W));
+    W->config = *config;
+
+    int ok = (W->lock = t->createLock()) != 0;
+    W->workers = ok ? (Worker *)workersAlloc(W, sizeof(Worker) * numWorkers) : 0;
+    ok = W->workers != 0;
+    if (ok) memset(W->workers, 0, sizeof(Worker) * numWorkers);
+
+    // Create all the VMs before starting any threads, so that the workers never see a partially created pool.
+    for (int i = 0; ok && i < numWorkers; ++i)
+    {
+        Worker* w = &W->workers[i];
+        w->W = W;
+        w->N = NeOpen(&W->config);
+        w->lock = t->createLock();
+        ok = w->N && w->lock;
+        W->numWorkers = i + 1;
+    }
+
+    for (int i = 0; ok && i < W->numWorkers; ++i)
+    {
+        Worker* w = &W->workers[i];
+        w->thread = t->createThread(&workerMain, w);
+        ok = w->thread != 0;
+    }
+
+    if (!ok)
+    {
+        NeWorkersClose(W);
+        W = 0;
     }
 
-    scratchEnd(N);
-    return p;
+    return W;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
 
-static void NeOutV(Nerd N, const char* format, va_list args)
+int NeWorkersSubmit(NeWorkers W, const char* origin, const char* source, i64 size, NeJobDoneFunc doneFunc,
+    void* context)
 {
-    if (N->config.outputFunc)
+    assert(W);
+    const NeThreadFuncs* t = &W->config.threads;
+
+    if (size == -1) size = (i64)strlen(source);
+    i64 originSize = (i64)strlen(origin) + 1;
+
+    // Copy the origin and the source into a single block.
+    WorkerJob job;
+    job.origin = (char *)workersAlloc(W, originSize + size + 1);
+    if (!job.origin) return 0;
+    job.source = job.origin + originSize;
+    job.size = size;
+    job.doneFunc = doneFunc;
+    job.context = context;
+    memcpy(job.origin, origin, (size_t)originSize);
+    memcpy(job.source, source, (size_t)size);
+    job.source[size] = 0;
+
+    t->lock(W->lock);
+    i64 index = W->nextWorker++ % W->numWorkers;
+    ++W->queued;
+    ++W->pending;
+    t->unlock(W->lock);
+
+    if (!workerPush(W, &W->workers[index], &job))
     {
-        const char* msg = scratchStart(N);
-        NeScratchFormatV(N, format, args);
-        scratchEnd(N);
-        N->config.outputFunc(N, msg);
+        t->lock(W->lock);
+        --W->queued;
+        --W->pending;
+        if (!W->pending) t->wakeAll(W->lock);
+        t->unlock(W->lock);
+        workersFreeJob(W, &job);
+        return 0;
     }
+
+    t->lock(W->lock);
+    t->wakeAll(W->lock);
+    t->unlock(W->lock);
+    return 1;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
 
-void NeOut(Nerd N, const char* format, ...)
+void NeWorkersWait(NeWorkers W)
 {
-    va_list args;
-    va_start(args, format);
-    NeOutV(N, format, args);
-    va_end(args);
+    assert(W);
+    const NeThreadFuncs* t = &W->config.threads;
+
+    t->lock(W->lock);
+    while (W->pending) t->wait(W->lock);
+    t->unlock(W->lock);
 }
 
-//----------------------------------------------------------------------------------------------------------------------{LEX}
-//----------------------------------------------------------------------------------------------------------------------
-// L E X I C A L   A N A L Y S I S
-//----------------------------------------------------------------------------------------------------------------------
 //----------------------------------------------------------------------------------------------------------------------
 
-typedef enum _NeToken
+void NeWorkersClose(NeWorkers W)
 {
-    // Errors
-    NeToken_Unknown = -100,
-    NeToken_Error,
+    if (!W) return;
+    const NeThreadFuncs* t = &W->config.threads;
 
-    // End of token stream
-    NeToken_EOF = 0,
+    if (W->lock)
+    {
+        t->lock(W->lock);
+        W->quit = 1;
+        t->wakeAll(W->lock);
+        t->unlock(W->lock);
+    }
 
-    // Literals
-    NeToken_Number,         // e.g. 42, -34
-    NeToken_Symbol,         // e.g. foo, bar, hello-world
-    NeToken_Character,      // e.g. \c \space 
-    NeToken_String,         // e.g. "Hello", "A new line\n"
+    for (int i = 0; i < W->numWorkers; ++i)
+    {
+        Worker* w = &W->workers[i];
+        if (w->thread) t->joinThread(w->thread);
+    }
 
-    // Keywords
-    NeToken_KEYWORDS,
-    NeToken_Nil = NeToken_KEYWORDS,     // e.g. nil
-    NeToken_Yes,                        // e.g. yes
-    NeToken_No,                         // e.g. no
+    for (int i = 0; i < W->numWorkers; ++i)
+    {
+        Worker* w = &W->workers[i];
 
-    NeToken_COUNT
+        // Jobs are only left over if a thread couldn't be started.
+        WorkerJob job;
+        while (w->lock && workerTake(W, w, 1, &job)) workersFreeJob(W, &job);
+
+        workersFree(W, w->jobs, sizeof(WorkerJob) * w->capacity);
+        if (w->lock) t->destroyLock(w->lock);
+        if (w->N) NeClose(w->N);
+    }
+
+    workersFree(W, W->workers, sizeof(Worker) * W->numWorkers);
+    if (W->lock) t->destroyLock(W->lock);
+    W->config.memoryFunc(0, W, sizeof(struct _NeWorkers), 0);
 }
-NeToken;
 
+//----------------------------------------------------------------------------------------------------------------------{BENCH}
+//----------------------------------------------------------------------------------------------------------------------
+// B E N C H M A R K S
 //----------------------------------------------------------------------------------------------------------------------
-// This table represents the validity of a name (symbol or keyword) character.
-//
-//      0 = Cannot be found within a name.
-//      1 = Can be found within a name.
-//      2 = Can be found within a name but not as the initial character.
-//
-static const char gNameChar[128] =
-{
-    //          00  01  02  03  04  05  06  07  08  09  0a  0b  0c  0d  0e  0f  // Characters
-    /* 00 */    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 
-    /* 10 */    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 
-    /* 20 */    0, 1, 0, 1, 1, 1, 1, 0, 0, 0, 1, 1, 0, 1, 0, 1, //  !"#$%&' ()*+,-./
-    /* 30 */    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 0, 1, 1, 1, 1, // 01234567 89:;<=>?
-    /* 40 */    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // @ABCDEFG HIJKLMNO
-    /* 50 */    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1, // PQRSTUVW XYZ[\]^_
-    /* 60 */    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // `abcdefg hijklmno
-    /* 70 */    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0, // pqrstuvw xyz{|}~
-};
-
 //----------------------------------------------------------------------------------------------------------------------
 
-static const unsigned int gKeyWordHashes[] =
-{
-    /* 0 */     NeToken_Yes,
-    /* 1 */     0,
-    /* 2 */     0,
-    /* 3 */     0,
-    /* 4 */     0,
-    /* 5 */     0,
-    /* 6 */     0,
-    /* 7 */     0,
-    /* 8 */     0,
-    /* 9 */     0,
-    /* A */     NeToken_No,
-    /* B */     0,
-    /* C */     NeToken_Nil,
-    /* D */     0,
-    /* E */     0,
-    /* F */     0,
-};
+#if NE_BENCH
 
 //----------------------------------------------------------------------------------------------------------------------
-// The order of this array MUST match the order of the enums after
-// NeToken_KEYWORDS.
-static const char* gKeywords[NeToken_COUNT - NeToken_KEYWORDS] =
+// A benchmark is a function that does one repetition's work and reports how much it did.  The optional setup function
+// runs before each repetition and isn't timed.
+
+typedef struct
 {
-    "3nil",
-    "3yes",
-    "2no",
-};
+    i64 ops;                        // Number of operations done.
+    i64 bytes;                      // Number of bytes processed (0 if not meaningful).
+}
+BenchWork;
 
-//----------------------------------------------------------------------------------------------------------------------
+typedef int (*BenchFunc) (Nerd N, void* context, BenchWork* outWork);
+typedef void (*BenchSetupFunc) (Nerd N, void* context);
 
-typedef struct _NeLexInfo
+typedef struct
 {
-    const char*     start;          // Start of text in source code.
-    const char*     end;            // One past the end of text in the source code.
-    i64             line;           // Line number of token.
-    NeToken         token;          // Token type.
-    Atom            atom;           // Atom generated from token.
+    const NeBenchOptions*   options;
+    i64*                    times;      // Time of each repetition.
+    int                     count;      // Number of results output so far.
+    int                     success;
 }
-NeLexInfo;
+Bench;
+
+#define NE_BENCH_OPS            100000
+#define NE_BENCH_SOURCE_SIZE    (4 * 1024 * 1024)
 
 //----------------------------------------------------------------------------------------------------------------------
 
-typedef struct _NeLex
+void NeDefaultBenchOptions(NeBenchOptions* options)
 {
-    i64                 line;           // The current line number in the source.
-    i64                 lastLine;       // The previous line number of the last character read.
-    const char*         cursor;         // The current read position in the lexical stream.
-    const char*         lastCursor;     // The last read position of the last character read.
-    const char*         end;
+    options->warmup = 2;
+    options->repetitions = 10;
+    options->filter = 0;
+    options->paths = 0;
+    options->numPaths = 0;
 }
-NeLex;
 
 //----------------------------------------------------------------------------------------------------------------------
-// Fetch the next character in the stream.  This function keeps tracks of the newlines.  All the different newline
-// representations are converted to just '\n'.  If there are no more characters in the stream, a 0 is returned.
+// Output a string as a JSON string, escaping quotes, backslashes and control characters.  Names can contain file paths.
 
-static char nextChar(NeLex* L)
+static void benchOutString(Nerd N, const char* str)
 {
-    char c;
-
-    L->lastCursor = L->cursor;
-    L->lastLine = L->line;
-
-    if (L->cursor == L->end) return 0;
-
-    c = *L->cursor++;
-
-    if ('\r' == c || '\n' == c)
+    NeOut(N, "\"");
+    const char* run = str;
+    for (const char* p = str; *p; ++p)
     {
-        // Handle new-lines
-        ++L->line;
-
-        if (c == '\r')
+        u8 c = (u8)*p;
+        if (c == '"' || c == '\\' || c < 0x20)
         {
-            if ((L->cursor < L->end) && (*L->cursor == '\n'))
+            outputWrite(N, run, p - run);
+            if (c == '"' || c == '\\')
             {
-                ++L->cursor;
+                NeOut(N, "\\%c", c);
             }
-
-            c = '\n';
+            else
+            {
+                NeOut(N, "\\u%04x", c);
+            }
+            run = p + 1;
         }
     }
-
-    return c;
+    outputWrite(N, run, (i64)strlen(run));
+    NeOut(N, "\"");
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-// Return the cursor to the previous character.  You can only call this once after calling nextChar().
+// Run a benchmark and output its results.
 
-static void ungetChar(NeLex* L)
+static void benchRun(Nerd N, Bench* B, const char* name, BenchSetupFunc setupFunc, BenchFunc func, void* context)
 {
-    L->line = L->lastLine;
-    L->cursor = L->lastCursor;
-}
+    const NeBenchOptions* options = B->options;
+    if (options->filter && !strstr(name, options->filter)) return;
 
-//----------------------------------------------------------------------------------------------------------------------
-// Add an info to the end of the arena.
+    BenchWork work = { 0 };
+    int ok = 1;
+    for (int i = 0; ok && i < options->warmup; ++i)
+    {
+        if (setupFunc) setupFunc(N, context);
+        ok = func(N, context, &work);
+    }
 
-static NeToken lexBuild(Nerd N, Arena* info, const char* start, const char* end, i64 line, NeToken token, Atom atom)
-{
-    NeLexInfo* li = ARENA_ALLOC(N, info, NeLexInfo, 1);
-    li->start = start;
-    li->end = end;
-    li->line = line;
-    li->token = token;
-    li->atom = atom;
+    for (int i = 0; ok && i < options->repetitions; ++i)
+    {
+        if (setupFunc) setupFunc(N, context);
+        i64 t0 = N->config.timeFunc();
+        ok = func(N, context, &work);
+        B->times[i] = N->config.timeFunc() - t0;
+    }
 
-    return token;
+    NeOut(N, "%s\n    {\"name\": ", B->count++ ? "," : "");
+    benchOutString(N, name);
+    if (!ok)
+    {
+        NeOut(N, ", \"error\": true}");
+        B->success = 0;
+        return;
+    }
+
+    // Insertion sort the times to get the median.
+    i64* times = B->times;
+    int reps = options->repetitions;
+    i64 total = 0;
+    for (int i = 0; i < reps; ++i)
+    {
+        i64 t = times[i];
+        int j = i;
+        for (; j > 0 && times[j - 1] > t; --j) times[j] = times[j - 1];
+        times[j] = t;
+        total += t;
+    }
+    i64 median = (reps & 1) ? times[reps / 2] : (times[reps / 2 - 1] + times[reps / 2]) / 2;
+    double mean = (double)total / reps;
+    double best = (double)NE_MAX(times[0], 1);
+
+    NeOut(N, ", \"ops\": %lli, \"bytes\": %lli, \"min_ns\": %lli, \"median_ns\": %lli, \"mean_ns\": %.0f, "
+        "\"max_ns\": %lli, \"ns_per_op\": %.3f, \"ops_per_s\": %.0f, \"mb_per_s\": %.3f}",
+        work.ops, work.bytes, times[0], median, mean, times[reps - 1],
+        best / (double)NE_MAX(work.ops, 1),
+        (double)work.ops * 1e9 / best,
+        (double)work.bytes * 1e9 / best / (1024.0 * 1024.0));
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-// Return an error
+// Lexing
 
-NeToken lexErrorV(Nerd N, NeLex* L, const char* origin, const char* format, va_list args)
+typedef struct
 {
-    NeOut(N, "%s(%d): LEX ERROR: ", origin, L->line);
-
-    const char* errorMsg = scratchStart(N);
-    NeScratchFormatV(N, format, args);
-    scratchEnd(N);
-
-    NeOut(N, errorMsg);
-    NeOut(N, "\n");
-
-    return NeToken_Error;
+    const char* start;
+    const char* end;
 }
+BenchSource;
 
-//----------------------------------------------------------------------------------------------------------------------
-
-NeToken lexError(Nerd N, NeLex* L, const char* origin, const char* format, ...)
+static int benchLex(Nerd N, void* context, BenchWork* outWork)
 {
-    va_list args;
-    va_start(args, format);
-    lexErrorV(N, L, origin, format, args);
-    va_end(args);
-    return NeToken_Error;
+    BenchSource* src = (BenchSource *)context;
+    TokenList list;
+    if (!lex(N, "<bench>", src->start, src->end, &list)) return 0;
+
+    outWork->ops = list.numTokens;
+    outWork->bytes = (i64)(src->end - src->start);
+    tokenListDone(N, &list);
+    return 1;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-// Fetch the next token
+// Generate a source made of a typical mix of tokens, the same every time.
 
-static NeToken lexNext(Nerd N, Arena* info, NeLex* L, const char* origin)
+static int benchSynthesise(Nerd N, Arena* arena)
 {
-    if (L->cursor == L->end) return NeToken_EOF;
-
-    // Find the next meaningful character, skipping whitespace and comments.  Comments are delimited by ';' or '# ',
-    // or '#!' (notice the space) to the end of the line, and between '#|' and '|#'.  All comments are nestable.
-    char c = nextChar(L);
+    static const char* fragments[] = {
+        "answer ", "hello-world ", "x ", "*global-counter* ", "42 ", "-17 ", "0x7fff ", "0b1011 ",
+        "123456789012 ", "yes ", "no ", "nil ", "#\\a ", "#\\space ", "#\\newline ",
+        "\"short\" ", "\"a string with\\n an escape code\" ",
+        "\"a longer string that is long enough not to be stored inside the string object\" ",
+        "; a comment to the end of the line\n", "\n", "    ",
+    };
+    const int numFragments = (int)(sizeof(fragments) / sizeof(fragments[0]));
 
-    for (;;)
+    u32 seed = 12345;
+    while (arena->cursor < NE_BENCH_SOURCE_SIZE)
     {
-        if (0 == c)
-        {
-            // End of stream reached.
-            return NeToken_EOF;
-        }
+        seed = seed * 1664525 + 1013904223;
+        const char* fragment = fragments[(seed >> 16) % numFragments];
+        i64 len = (i64)strlen(fragment);
+        char* p = (char *)arenaAlloc(N, arena, len);
+        if (!p) return 0;
+        memcpy(p, fragment, (size_t)len);
+    }
 
-        // Check for whitespace.  If found, ignore, and get the next character in the stream.
-        if (NE_IS_WHITESPACE(c))
-        {
-            c = nextChar(L);
-            continue;
-        }
+    return 1;
+}
 
-        // Check for comments.
-        if (';' == c)
-        {
-            while ((c != 0) && (c != '\n')) c = nextChar(L);
-            continue;
-        }
-        else if ('#' == c)
-        {
-            c = nextChar(L);
+//----------------------------------------------------------------------------------------------------------------------
+// Strings
 
-            if ('|' == c)
-            {
-                // Nestable, multi-line comment.
-                int depth = 1;
-                while (c != 0 && depth)
-                {
-                    c = nextChar(L);
-                    if ('#' == c)
-                    {
-                        // Check for nested #|...|#
-                        c = nextChar(L);
-                        if ('|' == c)
-                        {
-                            ++depth;
-                        }
-                    }
-                    else if ('|' == c)
-                    {
-                        // Check for terminator |#
-                        c = nextChar(L);
-                        if ('#' == c)
-                        {
-                            --depth;
-                        }
-                    }
-                }
-                continue;
-            }
-            else if (NE_IS_WHITESPACE(c))
-            {
-                // Line-base comment.
-                while ((c != 0) && (c != '\n')) c = nextChar(L);
-                continue;
-            }
-            else
-            {
-                // Possible prefix character.
-                continue;
-            }
-        }
+typedef struct
+{
+    const char* start;
+    i64 size;
+}
+BenchString;
 
-        // If we've reached this point, we have a meaningful character.
-        break;
+static int benchMakeString(Nerd N, void* context, BenchWork* outWork)
+{
+    BenchString* str = (BenchString *)context;
+    for (int i = 0; i < NE_BENCH_OPS; ++i)
+    {
+        Atom a = NeMakeStringRanged(N, str->start, str->start + str->size);
+        if (NE_ATOM_TYPE(a) == AT_Nil) return 0;
     }
 
-    const char* s0 = L->cursor - 1;
-
-    //------------------------------------------------------------------------------------------------------------------
-    // Check for numbers
-    //------------------------------------------------------------------------------------------------------------------
+    outWork->ops = NE_BENCH_OPS;
+    outWork->bytes = NE_BENCH_OPS * str->size;
+    return 1;
+}
 
-    if (
-        // Check for digit
-        (c >= '0' && c <= '9') ||
-        // Check for '-' or '+'
-        ('-' == c || '+' == c))
-    {
-        // We run the characters through the state machine and either reach state 100 (our terminal state) or EOF.
-        int state = 0;
-        i64 sign = 1;
-        i64 intPart = 0;
-        i64 base = 10;
+//----------------------------------------------------------------------------------------------------------------------
+// Printing
 
-        // Each state (except the start) always fetches the next character for the next state (i.e. consumes the 
-        // current character).
-        for (;;)
-        {
-            switch (state)
-            {
-            case 0:         // START
-                if (c >= '0' && c <= '9')
-                {
-                    state = 2;
-                }
-                else if (c == '-' || c == '+')
-                {
-                    state = 1;
-                }
-                else
-                {
-                    // Cannot possibly reach here since we check for valid starting characters earlier.  If this
-                    // triggers, then the validity check does not match valid state transitions (i.e. if does not
-                    // match the case statements).
-                    assert(0);
-                }
-                break;
+typedef struct
+{
+    int root;                       // Root holding the atom to print.
+}
+BenchPrint;
 
-            case 1:         // +/-
-                if (c == '-')
-                {
-                    sign = -1;
-                }
-                c = nextChar(L);
-                state = 2;
-                break;
+static int benchToString(Nerd N, void* context, BenchWork* outWork)
+{
+    BenchPrint* print = (BenchPrint *)context;
+    Atom value = NeRootGet(N, print->root);
+    char buffer[256];
+    i64 bytes = 0;
+    for (int i = 0; i < NE_BENCH_OPS; ++i)
+    {
+        bytes += NeToStringInto(N, value, NSM_REPL, buffer, sizeof(buffer));
+    }
 
-            case 2:         // Integer digits.
-                intPart = intPart * base + (c - '0');
-                c = nextChar(L);
-                if (c < '0' || c > '9') state = 100;
-                break;
+    outWork->ops = NE_BENCH_OPS;
+    outWork->bytes = bytes;
+    return 1;
+}
 
-            case 100:
-                ungetChar(L);
-                return lexBuild(N, info, s0, L->cursor, L->line, NeToken_Number, NeMakeInt(sign * intPart));
-            }
-        }
+//----------------------------------------------------------------------------------------------------------------------
+// Arenas
+
+static int benchArena(Nerd N, void* context, BenchWork* outWork)
+{
+    Arena* arena = (Arena *)context;
+    for (int i = 0; i < NE_BENCH_OPS; ++i)
+    {
+        arenaPush(N, arena);
+        if (!arenaAlloc(N, arena, 16) || !arenaAlloc(N, arena, 100) || !arenaAlignedAlloc(N, arena, 64)) return 0;
+        arenaPop(N, arena);
     }
 
-    //------------------------------------------------------------------------------------------------------------------
-    // Check for keywords and symbols
-    //------------------------------------------------------------------------------------------------------------------
+    outWork->ops = NE_BENCH_OPS;
+    return 1;
+}
 
-    else if (gNameChar[c] == 1)
+//----------------------------------------------------------------------------------------------------------------------
+// Garbage collection.  The setup creates garbage for a full collection to sweep up.
+
+static void benchGcSetup(Nerd N, void* context)
+{
+    BenchString* str = (BenchString *)context;
+    for (int i = 0; i < NE_BENCH_OPS; ++i) NeMakeStringRanged(N, str->start, str->start + str->size);
+}
+
+static int benchGc(Nerd N, void* context, BenchWork* outWork)
+{
+    NeGarbageCollect(N);
+    outWork->ops = 1;
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Cloning the benchmark VM, with whatever it holds by then, and closing the clone.
+
+#define NE_BENCH_CLONES         100
+
+static int benchClone(Nerd N, void* context, BenchWork* outWork)
+{
+    for (int i = 0; i < NE_BENCH_CLONES; ++i)
     {
-        while (gNameChar[c]) c = nextChar(L);
-        ungetChar(L);
+        Nerd clone = NeClone(N);
+        if (!clone) return 0;
+        NeClose(clone);
+    }
 
-        i64 sizeToken = L->cursor - s0;
-        u64 h = hash(s0, L->cursor);
+    outWork->ops = NE_BENCH_CLONES;
+    return 1;
+}
 
-#if NE_DEBUG_SYMBOL_HASHES
-        const char* msg = scratchStart(N);
-        NeScratchFormat(N, "Hash: \"");
-        NeScratchAdd(N, s0, L->cursor);
-        NeScratchFormat(N, "\": %x\n", (int)h);
-        scratchEnd(N);
-        NeOut(N, msg);
-#endif
+//----------------------------------------------------------------------------------------------------------------------
 
-        i64 tokens = gKeyWordHashes[h & 0xf];
-        while (tokens != 0)
-        {
-            i64 index = (tokens & 0xff) - NeToken_KEYWORDS;
-            tokens >>= 8;
+int NeBench(NeConfig* config, const NeBenchOptions* options)
+{
+    assert(options->repetitions > 0);
 
-            if ((i64)(*gKeywords[index] - '0') == sizeToken)
-            {
-                // The length of the tokens match with the keywords we're currently testing against.
-                if (strncmp(s0, gKeywords[index] + 1, (size_t)sizeToken) == 0)
-                {
-                    // It is a keywords.
-                    NeToken t = NeToken_KEYWORDS + index;
-                    return lexBuild(N, info, s0, L->cursor, L->line, t, NeMakeNil());
-                }
-            }
-        }
+    Nerd N = NeOpen(config);
+    if (!N) return 0;
 
-        // Must be a symbol!
-        // #todo: symbols
-        return lexError(N, L, origin, "Symbols not implemented yet!");
+    Bench B = { .options = options, .count = 0, .success = 1 };
+    B.times = (i64 *)NeAlloc(N, sizeof(i64) * options->repetitions);
+    if (!B.times)
+    {
+        NeClose(N);
+        return 0;
     }
 
-    //------------------------------------------------------------------------------------------------------------------
-    // Check for strings
-    //------------------------------------------------------------------------------------------------------------------
+    NeOut(N, "{\n  \"warmup\": %d,\n  \"repetitions\": %d,\n  \"benchmarks\": [", options->warmup,
+        options->repetitions);
 
-    else if ('"' == c)
+    // Lexing, on the synthetic source and then on each file.
+    Arena synthetic;
+    arenaInit(N, &synthetic, NE_BENCH_SOURCE_SIZE + 4096);
+    if (benchSynthesise(N, &synthetic))
     {
-        s0 = L->cursor;
-        c = nextChar(L);
-        while ((c != 0) && (c != '\n') && (c != '"'))
-        {
-            c = nextChar(L);
-        }
+        const char* start = (const char *)synthetic.start;
+        BenchSource src = { .start = start, .end = start + synthetic.cursor };
+        benchRun(N, &B, "lex_synthetic", 0, &benchLex, &src);
+    }
+    else
+    {
+        B.success = 0;
+    }
+    arenaDone(N, &synthetic);
 
-        if (c == '"')
-        {
-            // End of string found
-            return lexBuild(N, info, s0, L->cursor - 1, L->line, NeToken_String, NeMakeNil());
-        }
-        else
+    for (int i = 0; i < options->numPaths; ++i)
+    {
+        const char* path = options->paths[i];
+        i64 size = 0;
+        void* handle = 0;
+        const char* data = N->config.mapFileFunc(N, path, &size, &handle);
+        if (!data)
         {
-            // Unterminated string
-            return lexError(N, L, origin, "Unterminated string.");
+            B.success = 0;
+            continue;
         }
+
+        BenchSource src = { .start = data, .end = data + size };
+        char name[256];
+        snprintf(name, sizeof(name), "lex_file:%s", path);
+        benchRun(N, &B, name, 0, &benchLex, &src);
+        N->config.unmapFileFunc(N, data, size, handle);
     }
 
-    //------------------------------------------------------------------------------------------------------------------
-    // Check for characters
-    //------------------------------------------------------------------------------------------------------------------
+    // Allocating strings.
+    static const char longString[] =
+        "a string that is too long to be stored inside the string object, so it needs an allocation";
+    BenchString shortStr = { .start = "short", .size = 5 };
+    BenchString longStr = { .start = longString, .size = sizeof(longString) - 1 };
+    benchRun(N, &B, "string_make_short", 0, &benchMakeString, &shortStr);
+    benchRun(N, &B, "string_make_long", 0, &benchMakeString, &longStr);
+
+    // Printing.
+    BenchPrint printInt = { .root = NeRootPush(N, NeMakeInt(-1234567890)) };
+    BenchPrint printStr = { .root = NeRootPush(N, NeMakeString(N, "a \"string\" with\tescape codes\n")) };
+    benchRun(N, &B, "to_string_int", 0, &benchToString, &printInt);
+    benchRun(N, &B, "to_string_string", 0, &benchToString, &printStr);
+    NeRootPop(N, 2);
+
+    // Arenas.
+    Arena arena;
+    arenaInit(N, &arena, 4096);
+    benchRun(N, &B, "arena_push_pop", 0, &benchArena, &arena);
+    arenaDone(N, &arena);
+
+    // Garbage collection.
+    NeGarbageCollect(N);
+    benchRun(N, &B, "gc_full_collect", &benchGcSetup, &benchGc, &longStr);
+
+    // Cloning.
+    benchRun(N, &B, "vm_clone", 0, &benchClone, 0);
+
+    NeOut(N, "\n  ]\n}\n");
+
+    int success = B.success;
+    NeFree(N, B.times, sizeof(i64) * options->repetitions);
+    NeClose(N);
+    return success;
+}
 
-    else if ('\\' == c)
-    {
-        // Fetch next character.
-        c = nextChar(L);
+#endif // NE_BENCH
 
-        if (0 == c || NE_IS_WHITESPACE(c))
-        {
-            return lexError(N, L, origin, "Invalid character token.");
-        }
+//----------------------------------------------------------------------------------------------------------------------{FUZZ}
+//----------------------------------------------------------------------------------------------------------------------
+// F U Z Z I N G
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
 
-        char ch = c;
+#if NE_FUZZ
 
-        // Check for named characters or hashed characters (\#32 or \#x20
-        if ('#' == c)
-        {
-            c = nextChar(L);
-            if (NE_IS_TERMCHAR(c) || '#' == c)
-            {
-                ungetChar(L);
-                return lexBuild(N, info, s0, L->cursor, L->line, NeToken_Character, NeMakeChar('#'));
-            }
-            else if ('x' == c)
-            {
-                // Possible hex character
-                char ch = 0;
-                int maxNumChars = sizeof(ch) * 2;
-                while (((c = nextChar(L)) > '0' && c <= '9') ||
-                    (c >= 'a' && c <= 'f') ||
-                    (c >= 'A' && c <= 'F'))
-                {
-                    ch <<= 4;
-                    if (c >= '0' && c <= '9') ch += c - '0';
-                    else if (c >= 'a' && c <= 'f') ch += c - 'a' + 10;
-                    else if (c >= 'A' && c <= 'F') ch += c - 'A' + 10;
-                    if (--maxNumChars < 0)
-                    {
-                        // Too many hex digits to hold a character.
-                        return lexError(N, L, origin, "Unknown character token.");
-                    }
-                }
-                if (!NE_IS_TERMCHAR(c)) return lexError(N, L, origin, "Unknown character token.");
-                ungetChar(L);
+//----------------------------------------------------------------------------------------------------------------------
+// Report a difference between two ways of lexing the same input.  Returns 0.
 
-                return lexBuild(N, info, s0, L->cursor, L->line, NeToken_Character, NeMakeChar(ch));
-            }
-            else if (c >= '0' && c <= '9')
-            {
-                char ch = c - '0';
-                while ((c = nextChar(L)) >= '0' && c <= '9')
-                {
-                    ch *= 10;
-                    ch += c - '0';
-                }
-                if (!NE_IS_TERMCHAR(c)) return lexError(N, L, origin, "Unknown character token.");
-                ungetChar(L);
-                return lexBuild(N, info, s0, L->cursor, L->line, NeToken_Character, NeMakeChar(ch));
-            }
-        }
+static int fuzzFail(Nerd N, const char* what, i64 index)
+{
+    NeOut(N, "<fuzz>: FUZZ ERROR: %s differs at token %lli.\n", what, index);
+    NeFlush(N);
+    return 0;
+}
 
-        c = nextChar(L);
-        if (NE_IS_TERMCHAR(c))
+//----------------------------------------------------------------------------------------------------------------------
+// Check that a lexer with the SIMD scanners, one with the scalar scanners and the token list made by lex() (if it
+// succeeded) agree token for token.  Returns 1 or 0 if they differ.
+
+static int fuzzCompare(Nerd N, NeLex* fast, NeLex* slow, TokenList* list, int listed)
+{
+    NeReader R;
+    readerInitTokens(&R, list);
+
+    for (i64 index = 0;; ++index)
+    {
+        NeLexInfo a, b, c;
+        NeToken t = lexNext(N, fast, &a);
+        if (lexNext(N, slow, &b) != t) return fuzzFail(N, "Token type", index);
+
+        if (t == NeToken_Error)
         {
-            ungetChar(L);
-            return lexBuild(N, info, s0, L->cursor, L->line, NeToken_Character, NeMakeChar(ch));
+            return listed ? fuzzFail(N, "Lexical error", index) : 1;
         }
-
-        while (!NE_IS_TERMCHAR(c))
+        if (t == NeToken_EOF)
         {
-            if (c < 'a' || c > 'z')
+            if (listed && list->numTokens != index) return fuzzFail(N, "Number of tokens", index);
+            if (fast->line != slow->line || fast->incomplete != slow->incomplete)
             {
-                // This cannot be a long character description, so return error
-                if (!NE_IS_TERMCHAR(c)) return lexError(N, L, origin, "Unknown character token.");
+                return fuzzFail(N, "Final lexer state", index);
             }
-            c = nextChar(L);
+            return 1;
         }
-        ungetChar(L);
 
-        int tokenLen = (int)(L->cursor - s0);
-        for (int i = 0; gCharMap[i].name; ++i)
-        {
-            int lenToken = (int)gCharMap[i].name[0] - '0' + 1;
-            if (lenToken != tokenLen) continue;
+        if (a.start != b.start || a.end != b.end) return fuzzFail(N, "Token text", index);
+        if (a.line != b.line) return fuzzFail(N, "Line", index);
+        if (!atomKeyEqual(N, a.atom, b.atom)) return fuzzFail(N, "Atom", index);
 
-            if (strncmp(gCharMap[i].name + 1, s0, (size_t)tokenLen) == 0)
-            {
-                // Found a match
-                return lexBuild(N, info, s0, L->cursor, L->line, NeToken_Character, NeMakeChar(gCharMap[i].ch));
-            }
+        if (listed)
+        {
+            if (readerNextToken(N, &R, &c) != t) return fuzzFail(N, "Listed token type", index);
+            if (c.start != a.start || c.end != a.end) return fuzzFail(N, "Listed token text", index);
+            if (tokenLine(N, list, index) != a.line) return fuzzFail(N, "Listed line", index);
+            if (!atomKeyEqual(N, c.atom, a.atom)) return fuzzFail(N, "Listed atom", index);
         }
-
-        return lexError(N, L, origin, "Unknown character token.");
     }
+}
 
-    //------------------------------------------------------------------------------------------------------------------
-    // Unknown token
-    //------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
+// Lex a source a token at a time with the SIMD scanners and with the scalar ones, and in one go with lex(), and check
+// that all three agree.  Returns 1 or 0 if they differ.
 
-    else
-    {
-        return lexError(N, L, origin, "Unknown token");
-    }
+static int fuzzLex(Nerd N, const char* start, const char* end)
+{
+    NeLex fast, slow;
+    lexInit(&fast, "<fuzz>", start, end);
+    lexInit(&slow, "<fuzz>", start, end);
+    fast.quiet = 1;
+    slow.quiet = 1;
+    slow.scalar = 1;
+
+    TokenList list;
+    int listed = lex(N, "<fuzz>", start, end, &list);
+    int success = fuzzCompare(N, &fast, &slow, &list, listed);
+    if (listed) tokenListDone(N, &list);
+    return success;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-// Analyse some source code and obtains it's tokens.  It returns an arena full of NeLexInfo structures.
+// Report a check on the VM that failed.  Returns 0.
 
-static int lex(Nerd N, const char* origin, const char* start, const char* end, Arena* outArena)
+static int fuzzCheckFail(Nerd N, const char* what)
 {
-    NeLex L;
-    L.line = 1;
-    L.lastLine = 1;
-    L.cursor = start;
-    L.lastCursor = start;
-    L.end = end;
-    
-    Arena info;
-    arenaInit(N, &info, 4096);
-
-    NeToken t = NeToken_Unknown;
-    while (t != NeToken_Error && t != NeToken_EOF)
-    {
-        t = lexNext(N, &info, &L, origin);
-    }
+    NeOut(N, "<fuzz>: FUZZ ERROR: %s.\n", what);
+    NeFlush(N);
+    return 0;
+}
 
-    if (t == NeToken_Error)
-    {
-        arenaDone(N, &info);
-        *outArena = info;
-        return 0;
-    }
+//----------------------------------------------------------------------------------------------------------------------
+// Check that an atom converts to the expected string.
 
-    *outArena = info;
-    return 1;
+static int fuzzCheckString(Nerd N, Atom a, const char* expected, const char* what)
+{
+    return strcmp(NeToString(N, a, NSM_Normal), expected) == 0 || fuzzCheckFail(N, what);
 }
 
-//----------------------------------------------------------------------------------------------------------------------{READ}
-//----------------------------------------------------------------------------------------------------------------------
-// R E A D I N G
-//----------------------------------------------------------------------------------------------------------------------
 //----------------------------------------------------------------------------------------------------------------------
+// Check that vectors and tables that contain themselves, directly or through each other, print "..." where they recur
+// instead of recursing.  Returns 1 or 0 if one doesn't.
 
-static int nextAtom(Nerd N, const NeLexInfo** tokens, const NeLexInfo* end, Atom* outAtom)
+static int fuzzCheckPrint(Nerd N)
 {
-    const NeLexInfo* t = (*tokens)++;
-    int result = 1;
-
-    switch (t->token)
+    Atom vec = NeMakeVector(N, 2);
+    Atom table = NeMakeTable(N, 4);
+    Atom outer = NeMakeVector(N, 1);
+    Atom inner = NeMakeTable(N, 4);
+    if (!NeIsVector(N, vec) || !NeIsTable(N, table) || !NeIsVector(N, outer) || !NeIsTable(N, inner) ||
+        !NeVectorPush(N, vec, vec) || !NeVectorPush(N, vec, vec) ||
+        !NeTableSet(N, table, table, table) ||
+        !NeVectorPush(N, outer, inner) || !NeTableSet(N, inner, NeMakeInt(1), outer))
     {
-    case NeToken_Number:
-    case NeToken_Character:
-        // The lexical analyser did the hard work for us!
-        *outAtom = t->atom;
-        break;
+        return fuzzCheckFail(N, "Out of memory building cycles");
+    }
 
-    case NeToken_Yes:
-        *outAtom = NeMakeBool(1);
-        break;
+    return fuzzCheckString(N, vec, "[[...] [...]]", "Vector containing itself printed wrongly") &&
+           fuzzCheckString(N, table, "{{...} {...}}", "Table containing itself printed wrongly") &&
+           fuzzCheckString(N, outer, "[{1 [...]}]", "Vector containing itself through a table printed wrongly");
+}
 
-    case NeToken_No:
-        *outAtom = NeMakeBool(0);
-        break;
+//----------------------------------------------------------------------------------------------------------------------
+// Check that the table in root table maps each vector in the vector in root keys to its index, and that setting an
+// existing key doesn't add it again.
 
-    case NeToken_String:
-        *outAtom = NeMakeStringRanged(N, t->start, t->end);
-        break;
+#define NE_FUZZ_KEYS    64
 
-    default:
-        // #todo: add error message.
-        result = 0;
+static int fuzzCheckKeys(Nerd N, int keys, int table)
+{
+    int success = 1;
+    for (int i = 0; success && i < NE_FUZZ_KEYS; ++i)
+    {
+        Atom key = NeVectorGet(N, NeRootGet(N, keys), i);
+        Atom value = NeMakeNil();
+        success = NeTableGet(N, NeRootGet(N, table), key, &value) &&
+                  NE_ATOM_TYPE(value) == AT_Integer && NE_ATOM_INT(value) == i &&
+                  NeTableSet(N, NeRootGet(N, table), key, NeMakeInt(i));
     }
-
-    return result;
+    return success && NeTableSize(N, NeRootGet(N, table)) == NE_FUZZ_KEYS;
 }
 
-//----------------------------------------------------------------------------------------------------------------------{EXEC}
-//----------------------------------------------------------------------------------------------------------------------
-// E X E C U T I O N
-//----------------------------------------------------------------------------------------------------------------------
 //----------------------------------------------------------------------------------------------------------------------
+// Check that a table keyed by vectors still finds every key after a minor collection has moved the vectors, and in a
+// clone of the VM, where the keys are different objects.  Returns 1 or 0 if it doesn't.
 
-static int eval(Nerd N, Atom a, Atom* outResult)
+static int fuzzCheckTableKeys(Nerd N)
 {
-    switch (a.type)
+    int numRoots = (int)(N->roots.cursor / sizeof(Atom));
+    int keys = NeRootPush(N, NeMakeVector(N, NE_FUZZ_KEYS));
+    int table = NeRootPush(N, NeMakeTable(N, 4));
+    int success = N->roots.cursor == (i64)((numRoots + 2) * sizeof(Atom)) &&
+                  NeIsVector(N, NeRootGet(N, keys)) && NeIsTable(N, NeRootGet(N, table));
+
+    for (int i = 0; success && i < NE_FUZZ_KEYS; ++i)
     {
-    case AT_Nil:
-    case AT_Integer:
-    case AT_Boolean:
-    case AT_Character:
-        // These evaluate to themselves.
-        *outResult = a;
-        break;
+        Atom key = NeMakeVector(N, 1);
+        success = NeIsVector(N, key) && NeVectorPush(N, NeRootGet(N, keys), key) &&
+                  NeTableSet(N, NeRootGet(N, table), key, NeMakeInt(i));
+    }
+    if (!success)
+    {
+        NeRootPop(N, (int)(N->roots.cursor / sizeof(Atom)) - numRoots);
+        return fuzzCheckFail(N, "Out of memory building a table");
+    }
 
-    case AT_Object:
-        return objectEval(N, a, outResult);
+    GcObj* before = NE_ATOM_OBJ(NeVectorGet(N, NeRootGet(N, keys), 0));
+    if (!gcMinor(N) || NE_ATOM_OBJ(NeVectorGet(N, NeRootGet(N, keys), 0)) == before)
+    {
+        NeRootPop(N, 2);
+        return fuzzCheckFail(N, "Minor collection didn't move the keys");
+    }
 
-    default:
-        assert(0);
-        *outResult = NeMakeNil();
-        return 0;
+    if (!fuzzCheckKeys(N, keys, table))
+    {
+        NeRootPop(N, 2);
+        return fuzzCheckFail(N, "Table lost vector keys that moved");
     }
 
-    return 1;
+    Nerd copy = NeClone(N);
+    NeRootPop(N, 2);
+    if (!copy) return fuzzCheckFail(N, "Out of memory cloning");
+
+    success = fuzzCheckKeys(copy, keys, table);
+    NeClose(copy);
+    return success || fuzzCheckFail(N, "Cloned table lost vector keys");
 }
 
 //----------------------------------------------------------------------------------------------------------------------
 
-int NeRun(Nerd N, char* origin, char* source, i64 size, Atom* outResult)
+int NeFuzz(NeConfig* config, const char* data, i64 size)
 {
-    if (size == -1)
-    {
-        size = (i64)strlen(source);
-    }
-
-    // Fetch the lexemes.
-    *outResult = NeMakeNil();
-    Arena tokenArena;
-    if (!lex(N, origin, source, source + size, &tokenArena))
-    {
-        return 0;
-    }
-    const NeLexInfo* tokens = (NeLexInfo *)tokenArena.start;
-    const NeLexInfo* endToken = tokens + (tokenArena.cursor / sizeof(NeLexInfo));
+    Nerd N = NeOpen(config);
+    if (!N) return 0;
 
-    int result = 1;
+    int success = fuzzCheckPrint(N) && fuzzCheckTableKeys(N) && fuzzLex(N, data, data + size);
 
-    while (tokens != endToken)
+    // Run a copy that is exactly the size of the input so that any read past its end is caught by the sanitisers.
+    char* source = (char *)NeAlloc(N, NE_MAX(size, 1));
+    if (source)
     {
-        if (!nextAtom(N, &tokens, endToken, outResult)) return 0;
-        if (!eval(N, *outResult, outResult)) return 0;
+        memcpy(source, data, (size_t)size);
+        Atom result;
+        NeRun(N, "<fuzz>", source, size, &result);
+        NeFree(N, source, NE_MAX(size, 1));
     }
 
-    arenaDone(N, &tokenArena);
-    return 1;
+    NeClose(N);
+    return success;
 }
 
-
-//----------------------------------------------------------------------------------------------------------------------
-//----------------------------------------------------------------------------------------------------------------------
+#endif // NE_FUZZ
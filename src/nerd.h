@@ -1,9 +1,15 @@
 //----------------------------------------------------------------------------------------------------------------------
 // Nerd public API
+//
+// Threads: all of a VM's state lives in its Nerd structure and the library has no mutable global state, so separate
+// VMs can be used on separate threads at the same time.  A single VM must only be used by one thread at a time.  The
+// callbacks in NeConfig are called from whichever thread is using the VM, so any shared by several VMs (such as the
+// default memory function) must be thread-safe.
 //----------------------------------------------------------------------------------------------------------------------
 
 #pragma once
 
+#include <stdarg.h>
 #include <stdint.h>
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -26,8 +32,21 @@ typedef struct _Nerd* Nerd;
 // The memory operation callback.
 typedef void* (*NeMemoryFunc) (Nerd, void*, i64, i64);
 
-// Output operation callback.
-typedef void (*NeOutputFunc) (Nerd, const char*);
+// Output operation callback.  It is given a batch of buffered output, which is not null-terminated.
+typedef void (*NeOutputFunc) (Nerd, const char* text, i64 size);
+
+// Receives text from NeToStringSink, a chunk at a time.  The text is not null-terminated.
+typedef void (*NeSinkFunc) (Nerd, void* context, const char* text, i64 size);
+
+// Map a file into memory for reading.  Returns the start of the file's contents and writes its size, and a handle to
+// pass to the unmap function.  Returns 0 if the file cannot be opened.
+typedef const char* (*NeMapFileFunc) (Nerd, const char* path, i64* outSize, void** outHandle);
+
+// Release a file mapped by the map function.
+typedef void (*NeUnmapFileFunc) (Nerd, const char* data, i64 size, void* handle);
+
+// Returns the time in nanoseconds from a steady clock, for measuring intervals.
+typedef i64 (*NeTimeFunc) (void);
 
 //----------------------------------------------------------------------------------------------------------------------
 // Data structures
@@ -51,14 +70,57 @@ typedef const char* NeString;
 
 typedef struct _GcHeader
 {
-    u32 marked : 1;
-    u32 type : 31;
+    u8 marked;                      // Kept apart from the other flags so collector threads can update it on its own.
+    u8 selfEval : 1;                // Set if the type has no evalFn, so the object evaluates to itself.
+    u8 remembered : 1;              // Set if the object is in the remembered set, since it may refer to young objects.
+    u16 type;
+    u32 size;                       // Size of the object in bytes (ObjectInfo.size plus any extra bytes).
     struct _GcHeader* next;
 }
 GcObj;
 
 //----------------------------------------------------------------------------------------------------------------------
 // A single Nerd value.
+//
+// By default an atom is a type and a union of values, which is 16 bytes with padding.  Define NE_ATOM_TAGGED as 1 to
+// pack atoms into 8 bytes instead.  The low bits of a tagged atom say what it holds:
+//
+//      0000...0000     Nil.
+//      xxxx...xxx1     Integer in the upper 63 bits.
+//      xxxx...x000     Pointer to an object (objects are always 8-byte aligned).
+//      0000...x100     Boolean in bit 3.
+//      cccc...0110     Character in bits 8-15.
+//
+// Tagged integers only have 63 bits.  Both layouts are zero for nil.  Always use the NeMake* functions to create atoms
+// and the NE_ATOM_* macros to read them so that code works with either layout.  The macros may evaluate their
+// argument more than once.
+
+#ifndef NE_ATOM_TAGGED
+#   define NE_ATOM_TAGGED 0
+#endif
+
+#if NE_ATOM_TAGGED
+
+typedef struct _Atom
+{
+    u64 bits;
+}
+Atom;
+
+#define NE_ATOM_TYPE(a)     ((a).bits == 0 ? AT_Nil : \
+                             ((a).bits & 1) ? AT_Integer : \
+                             ((a).bits & 7) == 0 ? AT_Object : \
+                             (AtomType)(((a).bits >> 1) & 3))
+#define NE_ATOM_INT(a)      ((i64)(a).bits >> 1)
+#define NE_ATOM_BOOL(a)     ((int)((a).bits >> 3) & 1)
+#define NE_ATOM_CHAR(a)     ((char)((a).bits >> 8))
+#define NE_ATOM_OBJ(a)      ((GcObj *)(uintptr_t)(a).bits)
+
+// Range of integer atoms.
+#define NE_INT_MAX          (INT64_MAX >> 1)
+#define NE_INT_MIN          (-NE_INT_MAX - 1)
+
+#else
 
 typedef struct _Atom
 {
@@ -71,6 +133,63 @@ typedef struct _Atom
 }
 Atom;
 
+#define NE_ATOM_TYPE(a)     ((a).type)
+#define NE_ATOM_INT(a)      ((a).i)
+#define NE_ATOM_BOOL(a)     ((int)(a).i)
+#define NE_ATOM_CHAR(a)     ((a).c)
+#define NE_ATOM_OBJ(a)      ((a).obj)
+
+// Range of integer atoms.
+#define NE_INT_MAX          INT64_MAX
+#define NE_INT_MIN          INT64_MIN
+
+#endif
+
+//----------------------------------------------------------------------------------------------------------------------
+// When buffered output is passed to the output callback.  Output is always flushed when the buffer is full, at the
+// end of NeRun and NeRunFile, by NeFlush and when the VM is closed.
+
+typedef enum
+{
+    NFM_Full,                   // Only flush at the points above.
+    NFM_Line,                   // Also flush after any output that contains a newline.
+}
+NeFlushMode;
+
+//----------------------------------------------------------------------------------------------------------------------
+// Threading primitives supplied by the platform layer, for the features that use threads (e.g. NeWorkersOpen).  A
+// lock is a mutex with a condition variable.  They are all 0 by default, meaning threads aren't available.
+
+typedef void (*NeThreadEntry) (void* arg);
+
+typedef struct
+{
+    void* (*createThread) (NeThreadEntry entry, void* arg);     // Start a thread.  Returns its handle or 0.
+    void (*joinThread) (void* thread);                          // Wait for a thread to end and release its handle.
+    void* (*createLock) (void);                                 // Returns a new lock or 0.
+    void (*destroyLock) (void* lock);
+    void (*lock) (void* lock);
+    void (*unlock) (void* lock);
+    void (*wait) (void* lock);                                  // Unlock, wait to be woken, then lock again.
+    void (*wakeAll) (void* lock);                               // Wake all threads waiting on the lock.
+    void (*sleep) (i64 ns);                                     // Sleep the calling thread for about ns nanoseconds.
+}
+NeThreadFuncs;
+
+//----------------------------------------------------------------------------------------------------------------------
+// Virtual memory primitives supplied by the platform layer.  With them, arenas that would otherwise be reallocated as
+// they grow (the scratch, the object types and lex()'s token lists) reserve address space up front and commit it as
+// they need it, so they grow in place and nothing allocated from them moves.  They are all 0 by default, meaning the
+// arenas are reallocated.
+
+typedef struct
+{
+    void* (*reserve) (i64 size);                                // Reserve address space.  Returns its start or 0.
+    int (*commit) (void* address, i64 size);                    // Make reserved pages usable.  Returns 1 or 0.
+    void (*release) (void* address, i64 size);                  // Release a whole reservation.
+}
+NeVirtualFuncs;
+
 //----------------------------------------------------------------------------------------------------------------------
 // Configuration structure when creating a VM.
 
@@ -78,6 +197,22 @@ typedef struct
 {
     NeMemoryFunc memoryFunc;
     NeOutputFunc outputFunc;
+    i64 outputBufferSize;       // Bytes of output buffered before outputFunc is called (0 = unbuffered).
+    NeFlushMode outputFlush;    // When else to flush the output buffer.
+    NeMapFileFunc mapFileFunc;
+    NeUnmapFileFunc unmapFileFunc;
+    int imageCache;             // Cache files compiled by NeRunFile as byte-code images alongside them.
+    i64 gcThreshold;            // Bytes of objects allocated before a new collection cycle starts.
+    i64 gcStepBudget;           // Objects processed per incremental collection step (0 = stop-the-world).
+    int usePools;               // Allocate objects from size-class pools (0 = use memoryFunc for every object).
+    double arenaGrowth;         // Factor that internal buffers grow by when they are full (greater than 1).
+    NeThreadFuncs threads;      // Threading primitives.
+    NeTimeFunc timeFunc;        // Steady clock that benchmarks are timed with.
+    i64 nurserySize;            // Bytes of movable objects allocated young between minor collections (0 = none).
+    int gcThreads;              // Helper threads that mark in parallel and sweep concurrently (0 = none).
+    NeVirtualFuncs virtualMemory; // Reserve-and-commit primitives for arenas that never move.
+    i64 virtualArenaSize;       // Bytes of address space the scratch reserves when it is a virtual arena.
+    i64 profileInterval;        // Nanoseconds between profiler samples (0 = no profiler).  Needs threads.
 }
 NeConfig;
 
@@ -98,9 +233,48 @@ Nerd NeOpen(NeConfig* config);
 // Destroy a Nerd VM.
 void NeClose(Nerd N);
 
-// Garbage collect the VM.
+// Create a copy of a VM with the same configuration, object types, objects, symbols and roots, so that a VM set up
+// once can be copied for each piece of work instead of being set up again.  The copy is independent of the original
+// and atoms don't carry over between them, but roots have the same indices.  Long strings share their characters
+// between the two instead of copying them.  It must not be called while the VM is running code.  Returns 0 if out of
+// memory, or if an object's type has a deleteFn but no cloneFn.
+//
+// Cloning changes the original VM.  Its nursery is emptied, as at a safe point, so young objects move and atoms the
+// host holds other than roots must be fetched again.  Any collection in progress is finished, and the characters of
+// its long strings are moved into shared memory.  So a VM must not be cloned by two threads at once, or while another
+// thread is using it.
+Nerd NeClone(Nerd N);
+
+//----------------------------------------------------------------------------------------------------------------------
+// Garbage collection
+//----------------------------------------------------------------------------------------------------------------------
+
+// Objects of movable types are allocated in a nursery.  Those still reachable are moved out of it by a minor
+// collection at a safe point: the end of NeRun and NeRunFile, NeGarbageStep and NeGarbageCollect (when they are not
+// called while code is running).  Atoms held by the host must be fetched again with NeRootGet after a safe point.
+
+// Garbage collect the VM.  This finishes any collection in progress and then runs a full collection.
 void NeGarbageCollect(Nerd N);
 
+// Perform a single incremental step of garbage collection, processing at most gcStepBudget objects.  A new cycle is
+// started if one is not in progress.  Returns 1 if the step completed a cycle.
+int NeGarbageStep(Nerd N);
+
+// Push an atom on to the root stack so that it is not collected.  Returns the index of the root.
+int NeRootPush(Nerd N, Atom a);
+
+// Fetch the atom stored in a root.
+Atom NeRootGet(Nerd N, int index);
+
+// Remove the most recent roots from the root stack.
+void NeRootPop(Nerd N, int count);
+
+// Mark an atom as reachable.  Only call this from an object's markFn.
+void NeMarkAtom(Nerd N, Atom* a);
+
+// Must be called when an atom is stored inside an object so that incremental and minor collections don't miss it.
+void NeWriteBarrier(Nerd N, void* object, Atom value);
+
 //----------------------------------------------------------------------------------------------------------------------
 // Atom construction
 //----------------------------------------------------------------------------------------------------------------------
@@ -126,9 +300,40 @@ Atom NeMakeString(Nerd N, const char* str);
 // Create a string from a range from start up to an not including end.
 Atom NeMakeStringRanged(Nerd N, const char* start, const char* end);
 
+// Create a string that takes ownership of a buffer of size characters followed by a null terminator, instead of
+// copying it.  The buffer must be allocated with the configuration's memoryFunc (passing 0 for the VM) and must not be
+// changed afterwards.  It is freed once nothing refers to it.
+Atom NeMakeStringAdopt(Nerd N, char* buffer, i64 size);
+
+// Shared strings are immutable characters that strings in several VMs can refer to, without copying, even when the
+// VMs run on different threads.  They are reference counted; each handle returned must be released exactly once.
+typedef struct _NeShared* NeShared;
+
+// Get a shared handle to a string's characters.  After the first call long strings refer to the shared characters
+// themselves, so sharing them again is free.  Returns 0 if the atom is not a string or out of memory.
+NeShared NeStringShare(Nerd N, Atom str);
+
+// Create a string that refers to shared characters.  The caller still has to release its handle.
+Atom NeMakeStringShared(Nerd N, NeShared shared);
+
+// Get the characters of a shared string, which are null-terminated.
+const char* NeSharedChars(NeShared shared, i64* outSize);
+
+// Release a handle returned by NeStringShare.
+void NeSharedRelease(NeShared shared);
+
+// Create or fetch the interned symbol with a null terminated name.
+Atom NeMakeSymbol(Nerd N, const char* name);
+
+// Create or fetch the interned symbol with a name in the range from start up to and not including end.
+Atom NeMakeSymbolRanged(Nerd N, const char* start, const char* end);
+
 // Create an object atom.
 Atom NeMakeObject(Nerd N, void* object);
 
+// Set the global value of a symbol.
+void NeSymbolBind(Nerd N, Atom symbol, Atom value);
+
 //----------------------------------------------------------------------------------------------------------------------
 // Memory management via the VM
 //----------------------------------------------------------------------------------------------------------------------
@@ -143,7 +348,8 @@ void* NeRealloc(Nerd N, void* address, i64 oldBytes, i64 newBytes);
 void NeFree(Nerd N, void* address, i64 oldBytes);
 
 //----------------------------------------------------------------------------------------------------------------------
-// Scratch pad to generate strings.
+// Scratch pad to generate strings.  While an atom is being converted to a string (e.g. in an object's toStringFn),
+// these write to the string being produced.
 //----------------------------------------------------------------------------------------------------------------------
 
 void NeScratchFormatV(Nerd N, const char* format, va_list args);
@@ -170,6 +376,8 @@ typedef int (*ObjectCreateFn) (Nerd N, void* obj, const void* data);
 typedef void (*ObjectDeleteFn) (Nerd N, void* obj);
 typedef int (*ObjectEvalFn) (Nerd N, Atom a, void* obj, Atom* outResult);
 typedef void (*ObjectToStringFn) (Nerd N, void* obj, NeStringMode mode);
+typedef void (*ObjectMarkFn) (Nerd N, void* obj);
+typedef int (*ObjectCloneFn) (Nerd N, void* obj, Nerd from, void* original);
 
 //----------------------------------------------------------------------------------------------------------------------
 // Default behaviours of functions (if set to 0):
@@ -178,9 +386,31 @@ typedef void (*ObjectToStringFn) (Nerd N, void* obj, NeStringMode mode);
 //      deleteFn        Does nothing.
 //      evalFn          Evaluates to itself.
 //      toStringFn      Outputs: <name:address_in_hex>
+//      markFn          Object holds no references to other atoms.
+//      cloneFn         Object holds nothing of its own, so NeClone's copy of its memory is enough.
 //
 // If you wish to change these behaviours create your own function.
 //
+// Objects of a type with NOF_Movable set may be allocated in the nursery and later copied with memcpy, so they must
+// not be pointed to by anything other than atoms, nor point into themselves.  Their markFn must also be safe to call
+// on zeroed memory.
+//
+// NeClone copies each object's memory into the new VM N and then calls its cloneFn, which must give the copy its own
+// resources (or share immutable ones with the original in the VM from) and return 1, or return 0 if out of memory
+// after releasing anything it allocated.  Atoms are not the cloneFn's business: the markFn is called afterwards to
+// point the copy's atoms at the new VM's objects.  A type with a deleteFn must have a cloneFn.
+//
+// If the VM has gcThreads, markFns may be called on several threads at once, and deleteFns on a helper thread while
+// the VM is running, unless the type has NOF_MutatorDelete set.  The memoryFunc and unmapFileFunc are called from the
+// helper threads too.
+//
+
+typedef enum
+{
+    NOF_Movable = 1,
+    NOF_MutatorDelete = 2,      // deleteFn must be called on the thread running the VM.
+}
+NeObjectFlags;
 
 typedef struct
 {
@@ -189,7 +419,10 @@ typedef struct
     ObjectDeleteFn      deleteFn;       // Pointer to function that destroys an object (memory handled by VM).
     ObjectEvalFn        evalFn;         // Pointer to function that evaluates an atom representing this object.
     ObjectToStringFn    toStringFn;     // Pointer to function that returns a string 
+    ObjectMarkFn        markFn;         // Pointer to function that calls NeMarkAtom on all atoms the object holds.
+    ObjectCloneFn       cloneFn;        // Pointer to function that makes a copy of the object its own in NeClone.
     i32                 size;           // Size of object in bytes.
+    u32                 flags;          // NeObjectFlags.
 }
 ObjectInfo;
 
@@ -199,6 +432,63 @@ int NeObjectRegister(Nerd N, ObjectInfo* info);
 // Create an object of a particular type.
 void* NeObjectCreate(Nerd N, int type, const void* data);
 
+// Create an object of a particular type with extraBytes of zeroed memory allocated after ObjectInfo.size bytes, for
+// objects whose size depends on their contents.
+void* NeObjectCreateSized(Nerd N, int type, i64 extraBytes, const void* data);
+
+//----------------------------------------------------------------------------------------------------------------------
+// Vectors
+//
+// A vector is a growable array of atoms.  Indices must be in range.
+//----------------------------------------------------------------------------------------------------------------------
+
+// Create an empty vector with room for capacity atoms before it has to grow.  Returns nil if out of memory.
+Atom NeMakeVector(Nerd N, i64 capacity);
+
+// Return non-zero if the atom is a vector.
+int NeIsVector(Nerd N, Atom a);
+
+// Return the number of atoms in a vector.
+i64 NeVectorSize(Nerd N, Atom vector);
+
+// Fetch an atom from a vector.
+Atom NeVectorGet(Nerd N, Atom vector, i64 index);
+
+// Replace an atom in a vector.
+void NeVectorSet(Nerd N, Atom vector, i64 index, Atom value);
+
+// Add an atom to the end of a vector.  Returns 1 or 0 if out of memory.
+int NeVectorPush(Nerd N, Atom vector, Atom value);
+
+//----------------------------------------------------------------------------------------------------------------------
+// Tables
+//
+// A table maps keys to values.  Strings are equal as keys if they have the same characters; other objects are only
+// equal to themselves.
+//----------------------------------------------------------------------------------------------------------------------
+
+// Create an empty table with room for capacity entries before it has to grow.  Returns nil if out of memory.
+Atom NeMakeTable(Nerd N, i64 capacity);
+
+// Return non-zero if the atom is a table.
+int NeIsTable(Nerd N, Atom a);
+
+// Return the number of entries in a table.
+i64 NeTableSize(Nerd N, Atom table);
+
+// Look up a key.  Returns 1 and writes the value to outValue (if not NULL), or 0 if the key isn't in the table.
+int NeTableGet(Nerd N, Atom table, Atom key, Atom* outValue);
+
+// Add an entry to a table or replace the value of an existing one.  Returns 1 or 0 if out of memory.
+int NeTableSet(Nerd N, Atom table, Atom key, Atom value);
+
+// Remove a key from a table.  Returns 1 or 0 if it wasn't in the table.
+int NeTableRemove(Nerd N, Atom table, Atom key);
+
+// Iterate over a table's entries.  Start with *index set to 0 and call until it returns 0.  The table must not be
+// changed during the iteration.
+int NeTableNext(Nerd N, Atom table, i64* index, Atom* outKey, Atom* outValue);
+
 //----------------------------------------------------------------------------------------------------------------------
 // Reading
 //----------------------------------------------------------------------------------------------------------------------
@@ -207,20 +497,187 @@ void* NeObjectCreate(Nerd N, int type, const void* data);
 // Execution
 //----------------------------------------------------------------------------------------------------------------------
 
-// Return 1 or 0 on successful execution.  Result is written to outResult (if not NULL).  Origin is the description
-// of where the code comes from (for error messages), source is the char array containing the source code, and
-// size is the length (or -1 to use strlen()).
+// Return 1 or 0 on successful execution.  Result is written to outResult (if not NULL), and is nil if execution
+// failed.  Origin is the description of where the code comes from (for error messages), source is the char array
+// containing the source code, and size is the length (or -1 to use strlen()).
 int NeRun(Nerd N, char* origin, char* source, i64 size, Atom* outResult);
 
+// Run the source code in a file, using the configuration's mapFileFunc to load it.  The source is lexed in place and
+// long strings in the file refer to the mapping instead of being copied, so the file stays mapped until those
+// strings are collected.  If imageCache is set in the configuration, the compiled byte-code is written to the file
+// <path>.nbc and that is run instead the next time, as long as the source hasn't changed.  Returns 1 on successful
+// execution.
+int NeRunFile(Nerd N, const char* path, Atom* outResult);
+
+typedef enum
+{
+    NRS_Complete,               // The source only has complete data.
+    NRS_Incomplete,             // The source ends part way through a datum (e.g. in a #| comment), so needs more.
+    NRS_Error,                  // The source has an error that more input wouldn't fix.
+}
+NeReadStatus;
+
+// Check whether source code is ready to run, without running it or reporting errors.  A REPL uses this to collect
+// the lines of a multi-line datum before passing them all to NeRun.  Size may be -1 to use strlen().
+NeReadStatus NeCheckComplete(Nerd N, const char* source, i64 size);
+
+//----------------------------------------------------------------------------------------------------------------------
+// Worker pools
+//
+// A worker pool runs source code on several VMs at once, each on its own thread.  Jobs are shared out between the
+// workers, and a worker with nothing to do steals jobs from the others.  The configuration must provide the threading
+// primitives, and its memoryFunc and outputFunc must be thread-safe.
+//----------------------------------------------------------------------------------------------------------------------
+
+typedef struct _NeWorkers* NeWorkers;
+
+// Called on a worker's thread when a job has finished.  The result is only valid until this returns.
+typedef void (*NeJobDoneFunc) (Nerd N, void* context, int success, Atom result);
+
+// Open a VM with the configuration for each of numWorkers worker threads.  Returns 0 if they couldn't be created.
+NeWorkers NeWorkersOpen(const NeConfig* config, int numWorkers);
+
+// Queue source code to be run with NeRun on any of the workers.  The origin and source are copied.  doneFunc may be 0.
+// Returns 1 or 0 if out of memory.
+int NeWorkersSubmit(NeWorkers W, const char* origin, const char* source, i64 size, NeJobDoneFunc doneFunc,
+    void* context);
+
+// Wait until all the jobs submitted so far have finished.
+void NeWorkersWait(NeWorkers W);
+
+// Wait for the jobs to finish, then stop the threads and close their VMs.
+void NeWorkersClose(NeWorkers W);
+
 //----------------------------------------------------------------------------------------------------------------------
 // Printing
 //----------------------------------------------------------------------------------------------------------------------
 
-// Convert an atom to a string representation.
+// Convert an atom to a string representation.  The string is valid until the next call to NeToString.
 NeString NeToString(Nerd N, Atom value, NeStringMode mode);
 
-// Output a printf-style formatted string to the output callback.
+// Convert an atom to a string representation in a buffer.  At most capacity - 1 characters are written and the
+// buffer is always null-terminated if capacity > 0.  Returns the length of the whole string, like snprintf.
+i64 NeToStringInto(Nerd N, Atom value, NeStringMode mode, char* buffer, i64 capacity);
+
+// Convert an atom to a string representation that is passed to the sink function a chunk at a time, so that large
+// atoms can be written out without building the whole string.  It must not be called from a sink function or a
+// toStringFn.
+void NeToStringSink(Nerd N, Atom value, NeStringMode mode, NeSinkFunc sinkFunc, void* context);
+
+// Output a printf-style formatted string to the output buffer.
 void NeOut(Nerd N, const char* format, ...);
 
+// Pass any buffered output to the output callback.
+void NeFlush(Nerd N);
+
+//----------------------------------------------------------------------------------------------------------------------
+// Profiling
+//
+// If the configuration has a profileInterval, a timer thread ticks at that interval and the VM charges each tick to
+// what it is running: the origin and line of the datum being run in each nested NeRun or NeRunFile, outermost first,
+// then the type and byte-code offset of the object being evaluated.  Ticks are charged at the next Eval or datum, so
+// time spent in an evalFn is charged to the object being evaluated.
+//----------------------------------------------------------------------------------------------------------------------
+
+// Write the samples taken so far to func in the folded stack format that flame graph tools read: a line for each
+// distinct stack, with its frames separated by ';', then a space and the number of samples.  Returns the total number
+// of samples.
+i64 NeProfileWrite(Nerd N, NeOutputFunc func);
+
+// Discard the samples taken so far.
+void NeProfileReset(Nerd N);
+
+//----------------------------------------------------------------------------------------------------------------------
+// Statistics (only in builds with NE_STATS defined to 1)
+//----------------------------------------------------------------------------------------------------------------------
+
+#if NE_STATS
+
+#define NE_STATS_MAX_TYPES      32
+
+typedef struct
+{
+    // Calls to the configuration's memoryFunc.
+    i64 numAllocs;
+    i64 numReallocs;
+    i64 numFrees;
+    i64 bytesAllocated;         // Total bytes requested by allocations and reallocations.
+    i64 bytesFreed;             // Total bytes released by frees and reallocations.
+    i64 bytesInUse;
+    i64 peakBytesInUse;
+
+    // Number of times arena buffers grew.
+    i64 arenaGrowths;           // All arenas.
+    i64 scratchGrowths;
+    i64 objectInfoGrowths;
+    i64 stackGrowths;
+    i64 rootsGrowths;
+    i64 toStringGrowths;
+    i64 tokenGrowths;           // Token list arenas.
+
+    // Objects of each type (indexed by type, for the first NE_STATS_MAX_TYPES types).
+    int numTypes;
+    struct
+    {
+        const char* name;
+        i64 alive;              // Objects currently in the VM.
+        i64 created;            // Objects ever created.
+    }
+    types[NE_STATS_MAX_TYPES];
+
+    // Work done.
+    i64 tokensLexed;
+    i64 atomsEvaluated;         // Top-level atoms executed.
+    i64 objectEvals;            // Objects evaluated by their type's evalFn.
+
+    // Generational collection.
+    i64 minorCollections;
+    i64 objectsPromoted;        // Young objects moved out of the nursery.
+    i64 bytesPromoted;
+}
+NeStats;
+
+// Fetch the VM's counters.
+void NeGetStats(Nerd N, NeStats* outStats);
+
+#endif
+
+//----------------------------------------------------------------------------------------------------------------------
+// Benchmarks (only in builds with NE_BENCH defined to 1)
+//----------------------------------------------------------------------------------------------------------------------
+
+#if NE_BENCH
+
+typedef struct
+{
+    int warmup;                 // Untimed runs of each benchmark before the timed ones.
+    int repetitions;            // Timed runs of each benchmark.
+    const char* filter;         // Only run benchmarks whose names contain this (0 = run them all).
+    const char** paths;         // Source files to measure lexing on, as well as the synthetic source.
+    int numPaths;
+}
+NeBenchOptions;
+
+// Initialise benchmark options with default settings.
+void NeDefaultBenchOptions(NeBenchOptions* options);
+
+// Run the benchmarks on a new VM, writing the results as JSON to the configuration's output function.  Each result
+// has the minimum, median, mean and maximum time of the repetitions.  Returns 1 or 0 if a benchmark failed.
+int NeBench(NeConfig* config, const NeBenchOptions* options);
+
+#endif
+
+//----------------------------------------------------------------------------------------------------------------------
+// Fuzzing (only in builds with NE_FUZZ defined to 1)
+//----------------------------------------------------------------------------------------------------------------------
+
+#if NE_FUZZ
+
+// Run some arbitrary input on a new VM.  It is lexed with and without the SIMD scanners, and into a token list, and
+// then run with NeRun.  Returns 0 if the lexes didn't agree token for token, and asserts on anything else that breaks.
+int NeFuzz(NeConfig* config, const char* data, i64 size);
+
+#endif
+
 //----------------------------------------------------------------------------------------------------------------------
 //----------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,650 @@
+// Nerd - POSIX platform layer
+// Copyright (C)2018 Matt Davies, all rights reserved.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <nerd.h>
+
+#ifndef PATH_MAX
+#   define PATH_MAX 4096
+#endif
+
+//----------------------------------------------------------------------------------------------------------------------
+// Returns the path of the executable.
+// Free the return value with free().
+//----------------------------------------------------------------------------------------------------------------------
+
+char* getExePathName()
+{
+    size_t len = PATH_MAX;
+    for(;;)
+    {
+        char* buf = malloc(len);
+        if (!buf) return 0;
+        ssize_t pathLen = readlink("/proc/self/exe", buf, len);
+        if (pathLen < 0)
+        {
+            // No procfs, so fall back to the current directory.
+            strcpy(buf, ".");
+            return buf;
+        }
+        if ((size_t)pathLen >= len)
+        {
+            // Not enough memory!
+            len = 2 * len;
+            free(buf);
+            continue;
+        }
+
+        while (pathLen > 0 && buf[pathLen] != '/') --pathLen;
+        buf[pathLen] = 0;
+        return buf;
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// File mapping
+//----------------------------------------------------------------------------------------------------------------------
+
+const char* mapFile(Nerd N, const char* path, i64* outSize, void** outHandle)
+{
+    int file = open(path, O_RDONLY);
+    if (file < 0) return 0;
+
+    struct stat info;
+    if (fstat(file, &info) < 0 || !S_ISREG(info.st_mode))
+    {
+        close(file);
+        return 0;
+    }
+
+    *outSize = (i64)info.st_size;
+    *outHandle = 0;
+    if (info.st_size == 0)
+    {
+        // Empty files cannot be mapped.
+        close(file);
+        return "";
+    }
+
+    // The mapping keeps the file open, so the file descriptor isn't needed any more.
+    void* data = mmap(0, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (data == MAP_FAILED) return 0;
+
+    *outHandle = data;
+    return (const char *)data;
+}
+
+void unmapFile(Nerd N, const char* data, i64 size, void* handle)
+{
+    if (handle)
+    {
+        munmap(handle, (size_t)size);
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Timing
+//----------------------------------------------------------------------------------------------------------------------
+
+i64 timeNow()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (i64)now.tv_sec * 1000000000 + (i64)now.tv_nsec;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Memory
+//
+// Blocks of PAGE_MIN_SIZE bytes or more (the VM's arenas, pool chunks and large objects) are mapped straight from the
+// OS instead of the C heap.  On Linux they grow with mremap, which moves page mappings rather than copying, and blocks
+// of a huge page or more ask for transparent huge pages.  The VM always passes a block's current size, so the size
+// alone says where a block came from.
+//----------------------------------------------------------------------------------------------------------------------
+
+#define PAGE_MIN_SIZE       (64 * 1024)
+#define HUGE_PAGE_SIZE      (2 * 1024 * 1024)
+
+static size_t pageRound(i64 size)
+{
+    static size_t pageSize;
+    if (!pageSize) pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    return ((size_t)size + pageSize - 1) & ~(pageSize - 1);
+}
+
+static void pageAdvise(void* address, i64 size)
+{
+#ifdef MADV_HUGEPAGE
+    if (size >= HUGE_PAGE_SIZE) madvise(address, pageRound(size), MADV_HUGEPAGE);
+#endif
+}
+
+static void* pageMap(i64 size)
+{
+    void* p = mmap(0, pageRound(size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return 0;
+    pageAdvise(p, size);
+    return p;
+}
+
+void* pageMemory(Nerd N, void* address, i64 oldSize, i64 newSize)
+{
+    int oldPages = address && oldSize >= PAGE_MIN_SIZE;
+    int newPages = newSize >= PAGE_MIN_SIZE;
+
+    if (newSize == 0)
+    {
+        if (oldPages)
+        {
+            munmap(address, pageRound(oldSize));
+        }
+        else
+        {
+            free(address);
+        }
+        return 0;
+    }
+
+    if (!oldPages && !newPages) return realloc(address, (size_t)newSize);
+
+    if (oldPages && newPages)
+    {
+        if (pageRound(oldSize) == pageRound(newSize)) return address;
+#ifdef MREMAP_MAYMOVE
+        void* p = mremap(address, pageRound(oldSize), pageRound(newSize), MREMAP_MAYMOVE);
+        if (p == MAP_FAILED) return 0;
+        pageAdvise(p, newSize);
+        return p;
+#endif
+    }
+
+    // Moving between the heap and mapped pages.
+    void* p = newPages ? pageMap(newSize) : malloc((size_t)newSize);
+    if (!p) return 0;
+    if (address)
+    {
+        memcpy(p, address, (size_t)(oldSize < newSize ? oldSize : newSize));
+        pageMemory(N, address, oldSize, 0);
+    }
+    return p;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Virtual memory for the VM's arenas: address space is reserved with no access and made readable and writable as
+// the arenas grow.  MAP_NORESERVE keeps large reservations from counting against the overcommit limit.
+
+void* virtualReserve(i64 size)
+{
+    void* p = mmap(0, (size_t)size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return p == MAP_FAILED ? 0 : p;
+}
+
+int virtualCommit(void* address, i64 size)
+{
+    return mprotect(address, (size_t)size, PROT_READ | PROT_WRITE) == 0;
+}
+
+void virtualRelease(void* address, i64 size)
+{
+    munmap(address, (size_t)size);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Threads
+//----------------------------------------------------------------------------------------------------------------------
+
+typedef struct
+{
+    pthread_t thread;
+    NeThreadEntry entry;
+    void* arg;
+}
+Thread;
+
+typedef struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+}
+Lock;
+
+static void* threadMain(void* arg)
+{
+    Thread* thread = (Thread *)arg;
+    thread->entry(thread->arg);
+    return 0;
+}
+
+void* createThread(NeThreadEntry entry, void* arg)
+{
+    Thread* thread = (Thread *)malloc(sizeof(Thread));
+    if (!thread) return 0;
+    thread->entry = entry;
+    thread->arg = arg;
+
+    if (pthread_create(&thread->thread, 0, &threadMain, thread) != 0)
+    {
+        free(thread);
+        return 0;
+    }
+    return thread;
+}
+
+void joinThread(void* thread)
+{
+    pthread_join(((Thread *)thread)->thread, 0);
+    free(thread);
+}
+
+void* createLock()
+{
+    Lock* lock = (Lock *)malloc(sizeof(Lock));
+    if (lock)
+    {
+        if (pthread_mutex_init(&lock->mutex, 0) != 0)
+        {
+            free(lock);
+            return 0;
+        }
+        if (pthread_cond_init(&lock->cond, 0) != 0)
+        {
+            pthread_mutex_destroy(&lock->mutex);
+            free(lock);
+            return 0;
+        }
+    }
+    return lock;
+}
+
+void destroyLock(void* lock)
+{
+    pthread_cond_destroy(&((Lock *)lock)->cond);
+    pthread_mutex_destroy(&((Lock *)lock)->mutex);
+    free(lock);
+}
+
+void lockLock(void* lock)
+{
+    pthread_mutex_lock(&((Lock *)lock)->mutex);
+}
+
+void unlockLock(void* lock)
+{
+    pthread_mutex_unlock(&((Lock *)lock)->mutex);
+}
+
+void waitLock(void* lock)
+{
+    pthread_cond_wait(&((Lock *)lock)->cond, &((Lock *)lock)->mutex);
+}
+
+void wakeAllLock(void* lock)
+{
+    pthread_cond_broadcast(&((Lock *)lock)->cond);
+}
+
+void sleepFor(i64 ns)
+{
+    struct timespec t = { (time_t)(ns / 1000000000), (long)(ns % 1000000000) };
+    while (nanosleep(&t, &t) < 0 && errno == EINTR) {}
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Input
+//
+// The REPL collects input in a single buffer that is reused for every prompt.  A terminal is read a line at a time
+// so it gets the terminal's line editing.  Pipes are read without blocking: whatever has arrived is read in one go,
+// and while waiting for more the VM does some garbage collection.  This way pasted or piped scripts are run as a
+// whole rather than a line at a time.
+//----------------------------------------------------------------------------------------------------------------------
+
+typedef enum
+{
+    IT_Console,
+    IT_Pipe,
+    IT_File,
+}
+InputType;
+
+typedef struct
+{
+    int handle;
+    InputType type;
+    char* data;                 // Input waiting to be run (always null-terminated).
+    size_t size;                // Number of characters in data.
+    size_t capacity;            // Size of data's buffer.
+}
+Input;
+
+#define INPUT_READ_SIZE     (64 * 1024)
+
+void inputInit(Input* in)
+{
+    struct stat info;
+    in->handle = STDIN_FILENO;
+    if (isatty(in->handle))
+    {
+        in->type = IT_Console;
+    }
+    else if (fstat(in->handle, &info) == 0 && (S_ISFIFO(info.st_mode) || S_ISSOCK(info.st_mode)))
+    {
+        in->type = IT_Pipe;
+    }
+    else
+    {
+        in->type = IT_File;
+    }
+    in->data = 0;
+    in->size = 0;
+    in->capacity = 0;
+}
+
+void inputDone(Input* in)
+{
+    free(in->data);
+    in->data = 0;
+    in->size = 0;
+    in->capacity = 0;
+}
+
+// Make room for some more characters and the null terminator.  Returns 1 or 0 if out of memory.
+int inputReserve(Input* in, size_t numChars)
+{
+    if (in->size + numChars + 1 <= in->capacity) return 1;
+
+    size_t capacity = in->capacity ? in->capacity : INPUT_READ_SIZE;
+    while (capacity < in->size + numChars + 1) capacity *= 2;
+    char* data = (char *)realloc(in->data, capacity);
+    if (!data) return 0;
+
+    in->data = data;
+    in->capacity = capacity;
+    return 1;
+}
+
+// Read the characters waiting in the handle, up to maxChars.  Returns the number read or -1 at the end of the input.
+int inputReadHandle(Input* in, size_t maxChars)
+{
+    if (!inputReserve(in, maxChars)) return -1;
+
+    ssize_t numRead;
+    do
+    {
+        numRead = read(in->handle, in->data + in->size, maxChars);
+    }
+    while (numRead < 0 && errno == EINTR);
+    if (numRead <= 0) return -1;
+
+    in->size += (size_t)numRead;
+    in->data[in->size] = 0;
+    return (int)numRead;
+}
+
+// Append more input to the buffer, waiting until there is some.  Returns the number of characters added or -1 at the
+// end of the input.
+int inputRead(Input* in, Nerd N)
+{
+    if (in->type != IT_Pipe)
+    {
+        // The terminal returns a line at a time; files return as much as we ask for.
+        return inputReadHandle(in, in->type == IT_Console ? 4096 : INPUT_READ_SIZE);
+    }
+
+    int collected = 0;
+    for (;;)
+    {
+        // Once there's no garbage collection left to do, just wait.
+        struct pollfd fd = { in->handle, POLLIN, 0 };
+        int ready = poll(&fd, 1, collected ? -1 : 0);
+        if (ready < 0 && errno != EINTR) return -1;
+
+        if (ready > 0)
+        {
+            // A closed pipe is readable too, and reads nothing.
+            return inputReadHandle(in, INPUT_READ_SIZE);
+        }
+
+        // Nothing yet, so use the time to finish a garbage collection cycle.
+        if (!collected)
+        {
+            collected = NeGarbageStep(N);
+        }
+    }
+}
+
+// Remove the first numChars characters from the buffer.
+void inputConsume(Input* in, size_t numChars)
+{
+    memmove(in->data, in->data + numChars, in->size - numChars);
+    in->size -= numChars;
+    if (in->data) in->data[in->size] = 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Entry point
+//----------------------------------------------------------------------------------------------------------------------
+
+void out(Nerd N, const char* text, i64 size)
+{
+    fwrite(text, 1, (size_t)size, stdout);
+}
+
+#if NE_BENCH
+
+//----------------------------------------------------------------------------------------------------------------------
+// nerd --bench [--warmup <n>] [--reps <n>] [--filter <name>] [--pages] [<source files>...]
+
+int benchMain(int argc, char** argv)
+{
+    NeConfig config;
+    NeDefaultConfig(&config);
+    config.outputFunc = &out;
+    config.mapFileFunc = &mapFile;
+    config.unmapFileFunc = &unmapFile;
+    config.timeFunc = &timeNow;
+    config.virtualMemory.reserve = &virtualReserve;
+    config.virtualMemory.commit = &virtualCommit;
+    config.virtualMemory.release = &virtualRelease;
+
+    NeBenchOptions options;
+    NeDefaultBenchOptions(&options);
+    options.paths = (const char **)malloc(sizeof(const char*) * argc);
+    if (!options.paths) return 1;
+
+    for (int i = 2; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "--warmup") && i + 1 < argc)
+        {
+            options.warmup = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--reps") && i + 1 < argc)
+        {
+            options.repetitions = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--filter") && i + 1 < argc)
+        {
+            options.filter = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--pages"))
+        {
+            config.memoryFunc = &pageMemory;
+        }
+        else
+        {
+            options.paths[options.numPaths++] = argv[i];
+        }
+    }
+    if (options.warmup < 0) options.warmup = 0;
+    if (options.repetitions < 1) options.repetitions = 1;
+
+    int result = NeBench(&config, &options) ? 0 : 1;
+    free((void *)options.paths);
+    return result;
+}
+
+#endif
+
+//----------------------------------------------------------------------------------------------------------------------
+// nerd [--pages] [--profile]
+
+int main(int argc, char** argv)
+{
+#if NE_BENCH
+    if (argc > 1 && !strcmp(argv[1], "--bench")) return benchMain(argc, argv);
+#endif
+
+    int pages = 0;
+    i64 profileInterval = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "--pages"))
+        {
+            pages = 1;
+        }
+        else if (!strcmp(argv[i], "--profile"))
+        {
+            // Sample every millisecond.
+            profileInterval = 1000000;
+        }
+    }
+    char* exePath = getExePathName();
+
+    int cont = 1;
+
+    while(cont)
+    {
+        printf("Nerd REPL (V0.0)\n");
+        printf("PWD: %s\n", exePath);
+        printf("\nEnter ,q to quit.\n");
+        if (profileInterval) printf("Enter ,p to write the profile.\n");
+        printf("\n");
+        cont = 0;
+
+        NeConfig config;
+        NeDefaultConfig(&config);
+        if (pages) config.memoryFunc = &pageMemory;
+        config.outputFunc = &out;
+        config.mapFileFunc = &mapFile;
+        config.unmapFileFunc = &unmapFile;
+        config.imageCache = 1;
+        config.timeFunc = &timeNow;
+        config.virtualMemory.reserve = &virtualReserve;
+        config.virtualMemory.commit = &virtualCommit;
+        config.virtualMemory.release = &virtualRelease;
+        config.threads.createThread = &createThread;
+        config.threads.joinThread = &joinThread;
+        config.threads.createLock = &createLock;
+        config.threads.destroyLock = &destroyLock;
+        config.threads.lock = &lockLock;
+        config.threads.unlock = &unlockLock;
+        config.threads.wait = &waitLock;
+        config.threads.wakeAll = &wakeAllLock;
+        config.threads.sleep = &sleepFor;
+        config.profileInterval = profileInterval;
+        Nerd N = NeOpen(&config);
+        if (N)
+        {
+            // Run the system script that sits alongside the executable.
+            char systemPath[PATH_MAX];
+            snprintf(systemPath, PATH_MAX, "%s/system.n", exePath ? exePath : ".");
+            if (access(systemPath, R_OK) == 0)
+            {
+                Atom result;
+                if (!NeRunFile(N, systemPath, &result))
+                {
+                    printf("ERROR: %s\n", NeToString(N, result, NSM_Normal));
+                }
+            }
+
+            Input in;
+            inputInit(&in);
+            int interactive = in.type == IT_Console;
+
+            for (;;)
+            {
+                if (interactive)
+                {
+                    printf(in.size ? ". " : "> ");
+                    fflush(stdout);
+                }
+                int numRead = inputRead(&in, N);
+
+                // Commands must be at the start of a line on their own.
+                if (in.size && *in.data == ',')
+                {
+                    char* eol = strchr(in.data, '\n');
+                    if (!eol && numRead >= 0) continue;
+
+                    char command = in.data[1];
+                    inputConsume(&in, eol ? (size_t)(eol - in.data) + 1 : in.size);
+                    if (command == 'q') break;
+                    if (command == 'r')
+                    {
+                        cont = 1;
+                        break;
+                    }
+                    if (command == 'p')
+                    {
+                        // Write the profile in the folded stack format.
+                        fflush(stdout);
+                        NeProfileWrite(N, &out);
+                        fflush(stdout);
+                    }
+                    continue;
+                }
+
+                // Run all the whole lines read so far (or everything at the end of the input), once they are complete.
+                size_t runSize = in.size;
+                if (numRead >= 0)
+                {
+                    while (runSize && in.data[runSize - 1] != '\n') --runSize;
+                }
+
+                // Piped input arrives in blocks of many lines, so stop at the first command and run it next time round.
+                // The lines before it are run even if they are incomplete, since a command always ends them.
+                int command = 0;
+                for (size_t i = 1; !command && i < runSize; ++i)
+                {
+                    command = in.data[i - 1] == '\n' && in.data[i] == ',';
+                    if (command) runSize = i;
+                }
+
+                if (!runSize)
+                {
+                    if (numRead < 0) break;
+                    continue;
+                }
+                if (!command && numRead >= 0 && NeCheckComplete(N, in.data, (i64)runSize) == NRS_Incomplete) continue;
+
+                Atom result = NeMakeNil();
+                int success = NeRun(N, "<stdin>", in.data, (i64)runSize, &result);
+                inputConsume(&in, runSize);
+
+                NeString resultString = NeToString(N, result, success ? NSM_REPL : NSM_Normal);
+
+                printf(success ? "==> %s\n" : "ERROR: %s\n", resultString);
+                if (numRead < 0 && !in.size) break;
+            }
+
+            inputDone(&in);
+        }
+        NeClose(N);
+    }
+
+    free(exePath);
+    return 0;
+}
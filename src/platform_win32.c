@@ -8,6 +8,7 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <nerd.h>
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -40,24 +41,491 @@ char* getExePathName()
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-// Entry point
+// File mapping
+//----------------------------------------------------------------------------------------------------------------------
+
+const char* mapFile(Nerd N, const char* path, i64* outSize, void** outHandle)
+{
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file == INVALID_HANDLE_VALUE) return 0;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size))
+    {
+        CloseHandle(file);
+        return 0;
+    }
+
+    *outSize = (i64)size.QuadPart;
+    *outHandle = 0;
+    if (size.QuadPart == 0)
+    {
+        // Empty files cannot be mapped.
+        CloseHandle(file);
+        return "";
+    }
+
+    // The mapping keeps the file open, so the file handle isn't needed any more.
+    HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+    CloseHandle(file);
+    if (!mapping) return 0;
+
+    const char* data = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!data)
+    {
+        CloseHandle(mapping);
+        return 0;
+    }
+
+    *outHandle = mapping;
+    return data;
+}
+
+void unmapFile(Nerd N, const char* data, i64 size, void* handle)
+{
+    if (handle)
+    {
+        UnmapViewOfFile(data);
+        CloseHandle((HANDLE)handle);
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Timing
+//----------------------------------------------------------------------------------------------------------------------
+
+i64 timeNow()
+{
+    static LARGE_INTEGER frequency;
+    if (!frequency.QuadPart) QueryPerformanceFrequency(&frequency);
+
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+
+    // Split the conversion to avoid overflowing 64 bits.
+    i64 seconds = counter.QuadPart / frequency.QuadPart;
+    i64 remainder = counter.QuadPart % frequency.QuadPart;
+    return seconds * 1000000000 + remainder * 1000000000 / frequency.QuadPart;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Memory
+//
+// Blocks of PAGE_MIN_SIZE bytes or more (the VM's arenas, pool chunks and large objects) are allocated straight from
+// the OS instead of the C heap.  Each reserves PAGE_RESERVE times its size of address space but commits only the pages
+// it uses, so it can grow in place until the reservation is full.  The VM always passes a block's current size, so the
+// size alone says where a block came from and how many of its pages are committed.
+//----------------------------------------------------------------------------------------------------------------------
+
+#define PAGE_MIN_SIZE       (64 * 1024)
+#define PAGE_RESERVE        8
+
+static SIZE_T pageRound(i64 size)
+{
+    static SIZE_T pageSize;
+    if (!pageSize)
+    {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        pageSize = info.dwPageSize;
+    }
+    return ((SIZE_T)size + pageSize - 1) & ~(pageSize - 1);
+}
+
+static void* pageReserve(i64 size)
+{
+    // Fall back to an exact reservation if the address space is short.
+    void* p = VirtualAlloc(0, pageRound(size * PAGE_RESERVE), MEM_RESERVE, PAGE_NOACCESS);
+    if (!p) p = VirtualAlloc(0, pageRound(size), MEM_RESERVE, PAGE_NOACCESS);
+    if (!p) return 0;
+
+    if (!VirtualAlloc(p, pageRound(size), MEM_COMMIT, PAGE_READWRITE))
+    {
+        VirtualFree(p, 0, MEM_RELEASE);
+        return 0;
+    }
+    return p;
+}
+
+// Commit or decommit the pages at the end of a block so it holds newSize bytes.  Returns 1 or 0 if there isn't
+// enough reserved space after it.
+static int pageResize(void* address, i64 oldSize, i64 newSize)
+{
+    SIZE_T committed = pageRound(oldSize);
+    SIZE_T needed = pageRound(newSize);
+    char* end = (char *)address + committed;
+
+    if (needed < committed)
+    {
+        VirtualFree((char *)address + needed, committed - needed, MEM_DECOMMIT);
+    }
+    else if (needed > committed)
+    {
+        MEMORY_BASIC_INFORMATION info;
+        if (!VirtualQuery(end, &info, sizeof(info)) ||
+            info.AllocationBase != address ||
+            info.State != MEM_RESERVE ||
+            info.RegionSize < needed - committed)
+        {
+            return 0;
+        }
+        if (!VirtualAlloc(end, needed - committed, MEM_COMMIT, PAGE_READWRITE)) return 0;
+    }
+    return 1;
+}
+
+void* pageMemory(Nerd N, void* address, i64 oldSize, i64 newSize)
+{
+    int oldPages = address && oldSize >= PAGE_MIN_SIZE;
+    int newPages = newSize >= PAGE_MIN_SIZE;
+
+    if (newSize == 0)
+    {
+        if (oldPages)
+        {
+            VirtualFree(address, 0, MEM_RELEASE);
+        }
+        else
+        {
+            free(address);
+        }
+        return 0;
+    }
+
+    if (!oldPages && !newPages) return realloc(address, (size_t)newSize);
+    if (oldPages && newPages && pageResize(address, oldSize, newSize)) return address;
+
+    // Moving to a new reservation, or between the heap and reserved pages.
+    void* p = newPages ? pageReserve(newSize) : malloc((size_t)newSize);
+    if (!p) return 0;
+    if (address)
+    {
+        memcpy(p, address, (size_t)(oldSize < newSize ? oldSize : newSize));
+        pageMemory(N, address, oldSize, 0);
+    }
+    return p;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Virtual memory for the VM's arenas: address space is reserved up front and committed as the arenas grow.
+
+void* virtualReserve(i64 size)
+{
+    return VirtualAlloc(0, (SIZE_T)size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+int virtualCommit(void* address, i64 size)
+{
+    return VirtualAlloc(address, (SIZE_T)size, MEM_COMMIT, PAGE_READWRITE) != 0;
+}
+
+void virtualRelease(void* address, i64 size)
+{
+    VirtualFree(address, 0, MEM_RELEASE);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Threads
 //----------------------------------------------------------------------------------------------------------------------
 
-extern size_t getline(char **lineptr, size_t *n, FILE *stream);
+typedef struct
+{
+    NeThreadEntry entry;
+    void* arg;
+}
+ThreadStart;
+
+typedef struct
+{
+    SRWLOCK lock;
+    CONDITION_VARIABLE cond;
+}
+Lock;
+
+static DWORD WINAPI threadMain(void* arg)
+{
+    ThreadStart start = *(ThreadStart *)arg;
+    free(arg);
+    start.entry(start.arg);
+    return 0;
+}
+
+void* createThread(NeThreadEntry entry, void* arg)
+{
+    ThreadStart* start = (ThreadStart *)malloc(sizeof(ThreadStart));
+    if (!start) return 0;
+    start->entry = entry;
+    start->arg = arg;
+
+    HANDLE thread = CreateThread(0, 0, &threadMain, start, 0, 0);
+    if (!thread) free(start);
+    return thread;
+}
+
+void joinThread(void* thread)
+{
+    WaitForSingleObject((HANDLE)thread, INFINITE);
+    CloseHandle((HANDLE)thread);
+}
+
+void* createLock()
+{
+    Lock* lock = (Lock *)malloc(sizeof(Lock));
+    if (lock)
+    {
+        InitializeSRWLock(&lock->lock);
+        InitializeConditionVariable(&lock->cond);
+    }
+    return lock;
+}
+
+void destroyLock(void* lock)
+{
+    // SRW locks and condition variables don't need destroying.
+    free(lock);
+}
+
+void lockLock(void* lock)
+{
+    AcquireSRWLockExclusive(&((Lock *)lock)->lock);
+}
+
+void unlockLock(void* lock)
+{
+    ReleaseSRWLockExclusive(&((Lock *)lock)->lock);
+}
+
+void waitLock(void* lock)
+{
+    SleepConditionVariableSRW(&((Lock *)lock)->cond, &((Lock *)lock)->lock, INFINITE, 0);
+}
+
+void wakeAllLock(void* lock)
+{
+    WakeAllConditionVariable(&((Lock *)lock)->cond);
+}
+
+void sleepFor(i64 ns)
+{
+    // Sleep only has millisecond resolution.
+    DWORD ms = (DWORD)(ns / 1000000);
+    Sleep(ms ? ms : 1);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Input
+//
+// The REPL collects input in a single buffer that is reused for every prompt.  The console is read a line at a time
+// so it gets the console's line editing.  Pipes are read without blocking: whatever has arrived is read in one go,
+// and while waiting for more the VM does some garbage collection.  This way pasted or piped scripts are run as a
+// whole rather than a line at a time.
+//----------------------------------------------------------------------------------------------------------------------
+
+typedef struct
+{
+    HANDLE handle;
+    DWORD type;                 // FILE_TYPE_CHAR for the console, FILE_TYPE_PIPE or FILE_TYPE_DISK.
+    char* data;                 // Input waiting to be run (always null-terminated).
+    size_t size;                // Number of characters in data.
+    size_t capacity;            // Size of data's buffer.
+}
+Input;
+
+#define INPUT_READ_SIZE     (64 * 1024)
+
+void inputInit(Input* in)
+{
+    in->handle = GetStdHandle(STD_INPUT_HANDLE);
+    in->type = GetFileType(in->handle);
+    in->data = 0;
+    in->size = 0;
+    in->capacity = 0;
+}
+
+void inputDone(Input* in)
+{
+    free(in->data);
+    in->data = 0;
+    in->size = 0;
+    in->capacity = 0;
+}
+
+// Make room for some more characters and the null terminator.  Returns 1 or 0 if out of memory.
+int inputReserve(Input* in, size_t numChars)
+{
+    if (in->size + numChars + 1 <= in->capacity) return 1;
+
+    size_t capacity = in->capacity ? in->capacity : INPUT_READ_SIZE;
+    while (capacity < in->size + numChars + 1) capacity *= 2;
+    char* data = (char *)realloc(in->data, capacity);
+    if (!data) return 0;
+
+    in->data = data;
+    in->capacity = capacity;
+    return 1;
+}
+
+// Read the characters waiting in the handle, up to maxChars.  Returns the number read or -1 at the end of the input.
+int inputReadHandle(Input* in, DWORD maxChars)
+{
+    if (!inputReserve(in, maxChars)) return -1;
+
+    DWORD numRead = 0;
+    if (!ReadFile(in->handle, in->data + in->size, maxChars, &numRead, 0) || (numRead == 0 && in->type != FILE_TYPE_PIPE))
+    {
+        return -1;
+    }
+
+    in->size += numRead;
+    in->data[in->size] = 0;
+    return (int)numRead;
+}
+
+// Append more input to the buffer, waiting until there is some.  Returns the number of characters added or -1 at the
+// end of the input.
+int inputRead(Input* in, Nerd N)
+{
+    if (in->type != FILE_TYPE_PIPE)
+    {
+        // The console returns a line at a time; files return as much as we ask for.
+        return inputReadHandle(in, in->type == FILE_TYPE_CHAR ? 4096 : INPUT_READ_SIZE);
+    }
+
+    int collected = 0;
+    for (;;)
+    {
+        DWORD available = 0;
+        if (!PeekNamedPipe(in->handle, 0, 0, 0, &available, 0)) return -1;
+
+        if (available)
+        {
+            return inputReadHandle(in, available);
+        }
+
+        // Nothing yet, so use the time to finish a garbage collection cycle, then just wait.
+        if (collected)
+        {
+            Sleep(1);
+        }
+        else
+        {
+            collected = NeGarbageStep(N);
+        }
+    }
+}
+
+// Remove the first numChars characters from the buffer.
+void inputConsume(Input* in, size_t numChars)
+{
+    memmove(in->data, in->data + numChars, in->size - numChars);
+    in->size -= numChars;
+    if (in->data) in->data[in->size] = 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Entry point
+//----------------------------------------------------------------------------------------------------------------------
 
 void SigHandler(int sig)
 {
     _CrtCheckMemory();
 }
 
-void out(Nerd N, const char* msg)
+void out(Nerd N, const char* text, i64 size)
 {
-    OutputDebugStringA(msg);
-    printf("%s", msg);
+    fwrite(text, 1, (size_t)size, stdout);
+
+    // OutputDebugStringA needs null-terminated strings.
+    char buffer[1024];
+    while (size > 0)
+    {
+        i64 numChars = size < (i64)sizeof(buffer) - 1 ? size : (i64)sizeof(buffer) - 1;
+        memcpy(buffer, text, (size_t)numChars);
+        buffer[numChars] = 0;
+        OutputDebugStringA(buffer);
+        text += numChars;
+        size -= numChars;
+    }
+}
+
+#if NE_BENCH
+
+//----------------------------------------------------------------------------------------------------------------------
+// nerd --bench [--warmup <n>] [--reps <n>] [--filter <name>] [--pages] [<source files>...]
+
+int benchMain(int argc, char** argv)
+{
+    NeConfig config;
+    NeDefaultConfig(&config);
+    config.outputFunc = &out;
+    config.mapFileFunc = &mapFile;
+    config.unmapFileFunc = &unmapFile;
+    config.timeFunc = &timeNow;
+    config.virtualMemory.reserve = &virtualReserve;
+    config.virtualMemory.commit = &virtualCommit;
+    config.virtualMemory.release = &virtualRelease;
+
+    NeBenchOptions options;
+    NeDefaultBenchOptions(&options);
+    options.paths = (const char **)malloc(sizeof(const char*) * argc);
+    if (!options.paths) return 1;
+
+    for (int i = 2; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "--warmup") && i + 1 < argc)
+        {
+            options.warmup = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--reps") && i + 1 < argc)
+        {
+            options.repetitions = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--filter") && i + 1 < argc)
+        {
+            options.filter = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--pages"))
+        {
+            config.memoryFunc = &pageMemory;
+        }
+        else
+        {
+            options.paths[options.numPaths++] = argv[i];
+        }
+    }
+    if (options.warmup < 0) options.warmup = 0;
+    if (options.repetitions < 1) options.repetitions = 1;
+
+    int result = NeBench(&config, &options) ? 0 : 1;
+    free((void *)options.paths);
+    return result;
 }
 
+#endif
+
+//----------------------------------------------------------------------------------------------------------------------
+// nerd [--pages] [--profile]
+
 int _main(int argc, char** argv)
 {
+#if NE_BENCH
+    if (argc > 1 && !strcmp(argv[1], "--bench")) return benchMain(argc, argv);
+#endif
+
+    int pages = 0;
+    i64 profileInterval = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "--pages"))
+        {
+            pages = 1;
+        }
+        else if (!strcmp(argv[i], "--profile"))
+        {
+            // Sample every millisecond.
+            profileInterval = 1000000;
+        }
+    }
     char* exePath = getExePathName();
 
     signal(SIGINT, &SigHandler);
@@ -68,58 +536,117 @@ int _main(int argc, char** argv)
     {
         printf("Nerd REPL (V0.0)\n");
         printf("PWD: %s\n", exePath);
-        printf("\nEnter ,q to quit.\n\n");
+        printf("\nEnter ,q to quit.\n");
+        if (profileInterval) printf("Enter ,p to write the profile.\n");
+        printf("\n");
         cont = 0;
 
         NeConfig config;
         NeDefaultConfig(&config);
+        if (pages) config.memoryFunc = &pageMemory;
         config.outputFunc = &out;
+        config.mapFileFunc = &mapFile;
+        config.unmapFileFunc = &unmapFile;
+        config.imageCache = 1;
+        config.timeFunc = &timeNow;
+        config.virtualMemory.reserve = &virtualReserve;
+        config.virtualMemory.commit = &virtualCommit;
+        config.virtualMemory.release = &virtualRelease;
+        config.threads.createThread = &createThread;
+        config.threads.joinThread = &joinThread;
+        config.threads.createLock = &createLock;
+        config.threads.destroyLock = &destroyLock;
+        config.threads.lock = &lockLock;
+        config.threads.unlock = &unlockLock;
+        config.threads.wait = &waitLock;
+        config.threads.wakeAll = &wakeAllLock;
+        config.threads.sleep = &sleepFor;
+        config.profileInterval = profileInterval;
         Nerd N = NeOpen(&config);
         if (N)
         {
+            // Run the system script that sits alongside the executable.
+            char systemPath[MAX_PATH];
+            snprintf(systemPath, MAX_PATH, "%s\\system.n", exePath);
+            if (GetFileAttributesA(systemPath) != INVALID_FILE_ATTRIBUTES)
+            {
+                Atom result;
+                if (!NeRunFile(N, systemPath, &result))
+                {
+                    printf("ERROR: %s\n", NeToString(N, result, NSM_Normal));
+                }
+            }
+
+            Input in;
+            inputInit(&in);
+            int interactive = in.type == FILE_TYPE_CHAR;
+
             for (;;)
             {
-                char* input = 0;
-                size_t size = 0;
-                size_t numChars = 0;
+                if (interactive) printf(in.size ? ". " : "> ");
+                int numRead = inputRead(&in, N);
 
-                printf("> ");
-                numChars = getline(&input, &size, stdin);
-                if ((-1 != numChars) && (*input == ','))
+                // Commands must be at the start of a line on their own.
+                if (in.size && *in.data == ',')
                 {
-                    switch (input[1])
-                    {
-                    case 'q':
-                        numChars = -1;
-                        break;
+                    char* eol = strchr(in.data, '\n');
+                    if (!eol && numRead >= 0) continue;
 
-                    case 'r':
-                        numChars = -1;
+                    char command = in.data[1];
+                    inputConsume(&in, eol ? (size_t)(eol - in.data) + 1 : in.size);
+                    if (command == 'q') break;
+                    if (command == 'r')
+                    {
                         cont = 1;
                         break;
                     }
+                    if (command == 'p')
+                    {
+                        // Write the profile in the folded stack format.
+                        fflush(stdout);
+                        NeProfileWrite(N, &out);
+                        fflush(stdout);
+                    }
+                    continue;
                 }
 
-                if (-1 == numChars)
+                // Run all the whole lines read so far (or everything at the end of the input), once they are complete.
+                size_t runSize = in.size;
+                if (numRead >= 0)
                 {
-                    free(input);
-                    break;
+                    while (runSize && in.data[runSize - 1] != '\n') --runSize;
                 }
 
-                if (size)
+                // Piped input arrives in blocks of many lines, so stop at the first command and run it next time round.
+                // The lines before it are run even if they are incomplete, since a command always ends them.
+                int command = 0;
+                for (size_t i = 1; !command && i < runSize; ++i)
                 {
-                    Atom result = { AT_Nil };
-                    int success = NeRun(N, "<stdin>", input, numChars, &result);
-                    free(input);
+                    command = in.data[i - 1] == '\n' && in.data[i] == ',';
+                    if (command) runSize = i;
+                }
 
-                    NeString resultString = NeToString(N, result, success ? NSM_REPL : NSM_Normal);
+                if (!runSize)
+                {
+                    if (numRead < 0) break;
+                    continue;
+                }
+                if (!command && numRead >= 0 && NeCheckComplete(N, in.data, (i64)runSize) == NRS_Incomplete) continue;
+
+                Atom result = NeMakeNil();
+                int success = NeRun(N, "<stdin>", in.data, (i64)runSize, &result);
+                inputConsume(&in, runSize);
 
-                    printf(success ? "==> %s\n" : "ERROR: %s\n", resultString);
+                NeString resultString = NeToString(N, result, success ? NSM_REPL : NSM_Normal);
+
+                printf(success ? "==> %s\n" : "ERROR: %s\n", resultString);
 #ifndef NDEBUG
-                    _CrtCheckMemory();
+                _CrtCheckMemory();
 #endif
-                }
+                if (numRead < 0 && !in.size) break;
             }
+
+            inputDone(&in);
         }
         NeClose(N);
     }